@@ -0,0 +1,317 @@
+#ifndef subline_ast_cache
+#define subline_ast_cache
+
+// On-disk cache of parsed scripts.
+//
+// A parsed script is written out as a single image, which
+// contains a copy of the script text, every AST node and every
+// bag backing array. Pointers inside the image are stored as
+// offsets from the start of the image, and the locations of all
+// of them are listed in a relocation table. Loading an image is
+// an mmap of the file and one pass over that table, after which
+// the AST is used in place, without tokenizing or parsing.
+//
+// Images live in $XDG_CACHE_HOME/subline (or ~/.cache/subline)
+// and are named after the hash of the script text. An image
+// whose version, layout or script text does not match is
+// ignored, and the script is parsed normally. So is one with a
+// pointer anywhere outside of it. Images that haven't been
+// written for a week are deleted when a new one is, so editing
+// a script doesn't leave them behind for good.
+
+#include <stddef.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "utils.cpp"
+#include "files.cpp"
+#include "tokenizer.cpp"
+#include "ast.cpp"
+
+// Bump this whenever the image format changes.
+#define AST_IMAGE_VERSION 1
+
+#define AST_IMAGE_MAX_AGE (7*24*60*60)
+
+const char AST_IMAGE_MAGIC[8] = {'S','U','B','L','A','S','T',0};
+
+struct AST_Image_Header {
+    char magic[8];
+    u32 version;
+    u32 pointer_size;
+    u64 layout;
+    u64 hash;
+    u64 size;
+    u64 source;
+    u64 statements;
+    u64 absent;
+    u64 relocs;
+    u64 reloc_count;
+};
+
+/// Changes whenever any of the node structures change size,
+/// so images written by an incompatible build are rejected.
+u64 ast_image_layout() {
+    u64 sizes[] = {
+        sizeof(Token), sizeof(AST_Value), sizeof(AST_Params),
+        sizeof(AST_Call), sizeof(AST_Param_Named), sizeof(AST_Block),
+        sizeof(AST_If),
+    };
+    string bytes = {(const char*)sizes, sizeof(sizes)};
+    return hash(&bytes);
+}
+
+struct AST_Image_Writer {
+    char* data;
+    u64 len;
+    u64 capacity;
+    bag<u64> relocs;
+    u64 source;
+    u64 absent;
+};
+
+/// Reserves zeroed space in the image and returns its offset.
+u64 image_reserve(AST_Image_Writer* w, u64 size) {
+    u64 offset = (w->len + 7) & ~(u64)7;
+    u64 end = offset + size;
+    if (end > w->capacity) {
+        while (end > w->capacity) w->capacity *= 2;
+        w->data = (char*)realloc(w->data, w->capacity);
+    }
+    memset(w->data + w->len, 0, end - w->len);
+    w->len = end;
+    return offset;
+}
+
+/// Writes a pointer to the target offset into the field
+/// at the given offset, and records it for relocation.
+void image_ptr(AST_Image_Writer* w, u64 field, u64 target) {
+    *(u64*)(w->data + field) = target;
+    bag_add(&w->relocs, field);
+}
+
+void image_token(AST_Image_Writer* w, u64 at, Token* tok) {
+    memcpy(w->data + at, tok, sizeof(Token));
+    image_ptr(w, at + offsetof(Token, source), w->source);
+}
+
+/// Optional errors only need to stay non-zero, so they all
+/// point to the same placeholder message in the image.
+template<typename T>
+void image_optional(AST_Image_Writer* w, u64 at, optional<T> opt, u64 value) {
+    if (opt.error) {
+        image_ptr(w, at + offsetof(optional<T>, error), w->absent);
+    } else {
+        image_ptr(w, at + offsetof(optional<T>, value), value);
+    }
+}
+
+u64 image_node(AST_Image_Writer* w, AST_Node* node);
+
+void image_bag(AST_Image_Writer* w, u64 at, bag<AST_Node*>* b) {
+    u64 items = image_reserve(w, sizeof(AST_Node*) * b->len);
+    for (int i=0; i<b->len; i++) {
+        u64 item = image_node(w, b->items[i]);
+        image_ptr(w, items + sizeof(AST_Node*) * i, item);
+    }
+    auto out = (bag<AST_Node*>*)(w->data + at);
+    out->len = b->len;
+    out->capacity = b->len;
+    image_ptr(w, at + offsetof(bag<AST_Node*>, items), items);
+}
+
+u64 image_node(AST_Image_Writer* w, AST_Node* node) {
+    switch (node->kind) {
+    case AT_IDENT:
+    case AT_STRING:
+    case AT_COLOR:
+    case AT_ENV:
+    case AT_NUMBER: {
+        auto val = to_value(node);
+        u64 at = image_reserve(w, sizeof(AST_Value));
+        ((AST_Value*)(w->data + at))->kind = val->kind;
+        image_token(w, at + offsetof(AST_Value, token), &val->token);
+        return at;
+    }
+
+    case AT_PARAM_NAMED: {
+        auto named = to_param_named(node);
+        u64 at = image_reserve(w, sizeof(AST_Param_Named));
+        ((AST_Param_Named*)(w->data + at))->kind = AT_PARAM_NAMED;
+        image_token(w, at + offsetof(AST_Param_Named, name), &named->name);
+        u64 value = image_node(w, named->value);
+        image_ptr(w, at + offsetof(AST_Param_Named, value), value);
+        return at;
+    }
+
+    case AT_PARAMS: {
+        auto params = to_params(node);
+        u64 at = image_reserve(w, sizeof(AST_Params));
+        ((AST_Params*)(w->data + at))->kind = AT_PARAMS;
+        image_bag(w, at + offsetof(AST_Params, values), &params->values);
+        return at;
+    }
+
+    case AT_CALL: {
+        auto call = to_call(node);
+        u64 at = image_reserve(w, sizeof(AST_Call));
+        ((AST_Call*)(w->data + at))->kind = AT_CALL;
+        image_token(w, at + offsetof(AST_Call, ident), &call->ident);
+        u64 params = image_node(w, downcast(call->params));
+        image_ptr(w, at + offsetof(AST_Call, params), params);
+        return at;
+    }
+
+    case AT_BLOCK: {
+        auto block = to_block(node);
+        u64 at = image_reserve(w, sizeof(AST_Block));
+        ((AST_Block*)(w->data + at))->kind = AT_BLOCK;
+        u64 params = 0;
+        if (block->params.error == 0) params = image_node(w, downcast(block->params.value));
+        image_optional(w, at + offsetof(AST_Block, params), block->params, params);
+        image_bag(w, at + offsetof(AST_Block, statements), &block->statements);
+        return at;
+    }
+
+    case AT_IF: {
+        auto if_stmt = to_if(node);
+        u64 at = image_reserve(w, sizeof(AST_If));
+        ((AST_If*)(w->data + at))->kind = AT_IF;
+        u64 condition = image_node(w, if_stmt->condition);
+        image_ptr(w, at + offsetof(AST_If, condition), condition);
+        u64 body = image_node(w, if_stmt->body);
+        image_ptr(w, at + offsetof(AST_If, body), body);
+        u64 else_body = 0;
+        if (if_stmt->else_body.error == 0) else_body = image_node(w, if_stmt->else_body.value);
+        image_optional(w, at + offsetof(AST_If, else_body), if_stmt->else_body, else_body);
+        return at;
+    }
+
+    default:
+        assert(false, "Unhandled AST node type (image_node): %d\n", node->kind);
+    }
+}
+
+string ast_cache_name(u64 h) {
+    return stringf("%016lx.ast", (unsigned long)h);
+}
+
+/// Attempts to load a parsed script from the cache.
+/// Fails if there is no image for this exact script text.
+optional<bag<AST_Node*>> ast_cache_load(string* script) {
+    auto dir = cache_dir();
+    if (dir.error) return error(dir.error);
+
+    auto h = hash(script);
+    auto name = ast_cache_name(h);
+    auto path = stringf(FSTR "/" FSTR, FARG(dir.value), FARG(name));
+    free((void*)name.text);
+
+    int fd = open(path.text, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return error("No cached image");
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(AST_Image_Header)) {
+        close(fd);
+        return error("Invalid cached image");
+    }
+
+    // Private and writable, so relocation only dirties our own copy.
+    auto base = (char*)mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return error("Failed to map cached image");
+
+    auto header = (AST_Image_Header*)base;
+    auto source = (string*)(base + header->source);
+    bool valid =
+        memcmp(header->magic, AST_IMAGE_MAGIC, sizeof(AST_IMAGE_MAGIC)) == 0 &&
+        header->version == AST_IMAGE_VERSION &&
+        header->pointer_size == sizeof(void*) &&
+        header->layout == ast_image_layout() &&
+        header->hash == h &&
+        header->size == (u64)st.st_size &&
+        header->reloc_count <= header->size / sizeof(u64) &&
+        header->relocs <= header->size - header->reloc_count*sizeof(u64) &&
+        header->statements <= header->size - sizeof(bag<AST_Node*>) &&
+        header->source <= header->size - sizeof(string) &&
+        (u64)(size_t)source->text + script->len <= header->size &&
+        source->len == script->len &&
+        memcmp(base + (size_t)source->text, script->text, script->len) == 0;
+
+    if (!valid) {
+        munmap(base, st.st_size);
+        return error("Stale cached image");
+    }
+
+    // Every pointer, and every place one is stored, must be in
+    // the image. The mapping is private, so giving up halfway
+    // through leaves the file as it was.
+    auto relocs = (u64*)(base + header->relocs);
+    for (u64 i=0; i<header->reloc_count; i++) {
+        auto at = relocs[i];
+        if (at > header->size - sizeof(u64) || *(u64*)(base + at) >= header->size) {
+            munmap(base, st.st_size);
+            return error("Invalid cached image");
+        }
+        *(u64*)(base + at) += (u64)(size_t)base;
+    }
+
+    return ok(*(bag<AST_Node*>*)(base + header->statements));
+}
+
+/// Writes a parsed script to the cache. The image is written
+/// to a temporary file and renamed into place, so concurrent
+/// readers never see a partially written image.
+void ast_cache_store(string* script, bag<AST_Node*>* statements) {
+    AST_Image_Writer w;
+    w.capacity = 4096;
+    w.len = 0;
+    w.data = (char*)malloc(w.capacity);
+    w.relocs = create_bag<u64>(256);
+
+    u64 header = image_reserve(&w, sizeof(AST_Image_Header));
+
+    u64 text = image_reserve(&w, script->len);
+    memcpy(w.data + text, script->text, script->len);
+
+    w.source = image_reserve(&w, sizeof(string));
+    ((string*)(w.data + w.source))->len = script->len;
+    image_ptr(&w, w.source + offsetof(string, text), text);
+
+    const char absent[] = "Absent";
+    w.absent = image_reserve(&w, sizeof(absent));
+    memcpy(w.data + w.absent, absent, sizeof(absent));
+
+    u64 stmts = image_reserve(&w, sizeof(bag<AST_Node*>));
+    image_bag(&w, stmts, statements);
+
+    u64 relocs = image_reserve(&w, sizeof(u64) * w.relocs.len);
+    memcpy(w.data + relocs, w.relocs.items, sizeof(u64) * w.relocs.len);
+
+    auto h = (AST_Image_Header*)(w.data + header);
+    memcpy(h->magic, AST_IMAGE_MAGIC, sizeof(AST_IMAGE_MAGIC));
+    h->version = AST_IMAGE_VERSION;
+    h->pointer_size = sizeof(void*);
+    h->layout = ast_image_layout();
+    h->hash = hash(script);
+    h->size = w.len;
+    h->source = w.source;
+    h->statements = stmts;
+    h->absent = w.absent;
+    h->relocs = relocs;
+    h->reloc_count = w.relocs.len;
+
+    auto name = ast_cache_name(h->hash);
+    cache_write(name.text, w.data, w.len);
+    free((void*)name.text);
+    cache_prune(".ast", AST_IMAGE_MAX_AGE);
+
+    free(w.data);
+    free(w.relocs.items);
+}
+
+#endif
@@ -0,0 +1,188 @@
+#ifndef subline_async
+#define subline_async
+
+// Prompts that don't wait for slow segments: --async-fd N.
+//
+// Included from main.cpp, after render() and friends. The script
+// is rendered twice. The first render leaves every slow builtin
+// out (see PV_SLOW), showing a placeholder instead, and is printed
+// at once. The process then forks: the parent exits, so that the
+// shell can show the prompt, while the child renders it again, in
+// full, and sends whatever changed to fd N.
+//
+// Every top-level statement renders one part of the prompt, and
+// parts are numbered from 0; the reset at the end of the prompt is
+// the last part. Records on fd N are:
+//      id \t bytes \0
+// First comes a record for every part of the first render, then
+// an empty record, then a record for every part that came out
+// differently the second time, in order. The stream ends when the
+// prompt is complete.
+//
+// A newer invocation from the same terminal cancels one that's
+// still running: its commands are killed, and it exits without
+// sending anything more.
+
+#include <signal.h>
+#include <unistd.h>
+
+/// Renders a statement into a string, instead of the terminal.
+string render_part(AST_Node* stmt) {
+    fflush(stdout);
+    char* text = 0;
+    size_t len = 0;
+    auto capture = open_memstream(&text, &len);
+    assert(capture != 0, "Failed to capture the prompt!");
+    auto out = stdout;
+    stdout = capture;
+    if (stmt != 0) display(eval(stmt));
+    else reset(&state);
+    fclose(capture);
+    stdout = out;
+    return {text, (int)len};
+}
+
+bool write_all(int fd, const char* data, int len) {
+    while (len > 0) {
+        auto res = write(fd, data, len);
+        if (res == -1 && errno == EINTR && !commands_cancelled) continue;
+        if (res <= 0) return false;
+        data += res;
+        len -= res;
+    }
+    return true;
+}
+
+/// Sends one part of the prompt. NULs can't be sent, and are
+/// left out.
+bool async_record(int fd, int id, string bytes) {
+    bag<char> record = create_bag<char>(bytes.len + 16);
+    char head[16];
+    int head_len = snprintf(head, sizeof(head), "%d\t", id);
+    for (int i=0; i<head_len; i++) bag_add(&record, head[i]);
+    for (int i=0; i<bytes.len; i++) {
+        if (bytes.text[i] != 0) bag_add(&record, bytes.text[i]);
+    }
+    bag_add(&record, '\0');
+    bool sent = write_all(fd, record.items, record.len);
+    free(record.items);
+    return sent;
+}
+
+/// Name of the file in the cache directory that records the
+/// invocation running for the current terminal, if there's a
+/// terminal.
+string async_pid_name() {
+    auto tty = ttyname(STDIN_FILENO);
+    if (tty == 0) tty = ttyname(STDERR_FILENO);
+    if (tty == 0) return {0};
+    auto name = to_string(tty);
+    return stringf("async-%016lx.pid", (unsigned long)hash(&name));
+}
+
+/// When a process started, in clock ticks after boot, or 0 if
+/// there is no such process. Tells a process from a later one
+/// that got the same pid.
+u64 process_start(pid_t pid) {
+    char path[64];
+    char buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    if (read_small(path, buf, sizeof(buf)) <= 0) return 0;
+
+    // The fields after the name, which may have spaces in it,
+    // start with the third; the start time is the 22nd.
+    auto p = strrchr(buf, ')');
+    for (int field=2; p != 0 && field < 22; field++) p = strchr(p + 1, ' ');
+    return p != 0 ? strtoull(p + 1, 0, 10) : 0;
+}
+
+/// Cancels the invocation still running for the terminal.
+void async_cancel_previous(string name) {
+    auto dir = cache_dir();
+    if (dir.error) return;
+    auto path = stringf(FSTR "/" FSTR, FARG(dir.value), FARG(name));
+    char buf[64];
+    int len = read_small(path.text, buf, sizeof(buf));
+    free((void*)path.text);
+    free((void*)dir.value.text);
+    if (len <= 0) return;
+
+    char* end;
+    pid_t pid = strtol(buf, &end, 10);
+    u64 start = strtoull(end, 0, 10);
+    if (pid > 0 && pid != getpid() && start != 0 && process_start(pid) == start) kill(pid, SIGTERM);
+}
+
+void async_register(string name, pid_t pid) {
+    auto data = stringf("%d %lu\n", pid, (unsigned long)process_start(pid));
+    cache_write(name.text, data.text, data.len);
+    free((void*)data.text);
+}
+
+void async_cancel(int) {
+    commands_cancelled = 1;
+}
+
+int render_async(string subline, int fd) {
+    state.loaded = 0;
+    auto st = Subline_Tokenizer(subline);
+    auto stmts = load_script(&st);
+    int parts = stmts.len + 1;
+
+    state.style = default_style();
+    state.providers = script_providers(&stmts);
+    state.deferring = true;
+    state.deferred = 0;
+    string first[parts];
+    for (int i=0; i<stmts.len; i++) first[i] = render_part(stmts.items[i]);
+    first[stmts.len] = render_part(0);
+    state.deferring = false;
+
+    for (int i=0; i<parts; i++) display(first[i]);
+    fflush(stdout);
+
+    // The previous prompt's render is outdated, even if this one
+    // has nothing to render in the background.
+    auto pid_name = async_pid_name();
+    if (pid_name.len > 0) async_cancel_previous(pid_name);
+
+    bool sent = true;
+    for (int i=0; i<parts && sent; i++) sent = async_record(fd, i, first[i]);
+    sent = sent && write_all(fd, "", 1);
+    if (!sent || state.deferred == 0) {
+        close(fd);
+        return 0;
+    }
+
+    pid_t pid = fork();
+    if (pid != 0) {
+        if (pid > 0 && pid_name.len > 0) async_register(pid_name, pid);
+        close(fd);
+        return 0;
+    }
+
+    // Until every copy of the prompt's output is closed, the
+    // shell would wait.
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    close(null);
+
+    struct sigaction cancel = {0};
+    cancel.sa_handler = async_cancel;
+    sigaction(SIGTERM, &cancel, 0);
+    signal(SIGPIPE, SIG_IGN);
+
+    state_prefetch(&state, &stmts);
+    for (int i=0; i<stmts.len && !commands_cancelled; i++) {
+        auto part = render_part(stmts.items[i]);
+        if (commands_cancelled) break;
+        if (!equal(&part, &first[i]) && !async_record(fd, i, part)) commands_cancelled = 1;
+    }
+
+    if (commands_cancelled) commands_kill();
+    while (state.prefetched.len > 0) command_cancel(bag_pop(&state.prefetched).value.command);
+    close(fd);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,114 @@
+#ifndef subline_bench
+#define subline_bench
+
+// In-process benchmark of the whole rendering pipeline.
+//
+// Included from main.cpp, after eval() and friends. Every
+// iteration tokenizes, parses, discovers the git repository and
+// renders the prompt into /dev/null, timing each phase on its own.
+// The on-disk script cache is deliberately bypassed.
+
+#include <stdlib.h>
+
+enum BENCH_PHASE {
+    BP_TOKENIZE = 0,
+    BP_PARSE,
+    BP_GIT,
+    BP_EVAL,
+    BP_TOTAL,
+    BENCH_PHASES,
+};
+
+const char* bench_phase_str(BENCH_PHASE p) {
+    switch (p) {
+    case BP_TOKENIZE: return "tokenize";
+    case BP_PARSE: return "parse";
+    case BP_GIT: return "cwd+git";
+    case BP_EVAL: return "eval";
+    case BP_TOTAL: return "total";
+    default: return "unknown";
+    }
+}
+
+int compare_u64(const void* a, const void* b) {
+    auto x = *(const u64*)a;
+    auto y = *(const u64*)b;
+    return (x > y) - (x < y);
+}
+
+int bench_main(int iterations, string subline) {
+    u64* samples[BENCH_PHASES];
+    for (int p=0; p<BENCH_PHASES; p++) {
+        samples[p] = (u64*)malloc(sizeof(u64) * iterations);
+    }
+
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int devnull = open("/dev/null", O_WRONLY | O_CLOEXEC);
+    assert(saved_stdout != -1 && devnull != -1, "Failed to set up the output sink\n");
+    dup2(devnull, STDOUT_FILENO);
+    close(devnull);
+
+    for (int i=0; i<iterations; i++) {
+        state.style_stack.len = 0;
+        state.style = default_style();
+
+        u64 start = now_ns();
+
+        auto st = Subline_Tokenizer(subline);
+        auto tokens = st.tokenize();
+        u64 tokenized = now_ns();
+
+        auto sp = Subline_Parser::create(&tokens);
+        bag<AST_Node*> stmts;
+        REQUIRED(stmts, sp.parse());
+        u64 parsed = now_ns();
+
+        // Providers would otherwise be computed lazily during
+        // eval, so compute the ones the script needs up front
+        // to keep their cost out of the eval phase.
+        auto providers = script_providers(&stmts);
+        state.loaded = 0;
+        if (providers & PV_CWD) state_cwd(&state);
+        if (providers & PV_GIT_ROOT) state_git(&state);
+        if (providers & PV_GIT_BRANCH) state_git_branch(&state);
+        u64 discovered = now_ns();
+
+        render(&stmts);
+        fflush(stdout);
+        u64 rendered = now_ns();
+
+        samples[BP_TOKENIZE][i] = tokenized - start;
+        samples[BP_PARSE][i] = parsed - tokenized;
+        samples[BP_GIT][i] = discovered - parsed;
+        samples[BP_EVAL][i] = rendered - discovered;
+        samples[BP_TOTAL][i] = rendered - start;
+
+        free(tokens.items);
+        free(stmts.items);
+        arena_free(&sp.arena);
+    }
+
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+
+    warn("%d iterations, times in microseconds\n", iterations);
+    warn("%-10s %10s %10s %10s %10s\n", "phase", "min", "median", "p99", "max");
+    for (int p=0; p<BENCH_PHASES; p++) {
+        auto s = samples[p];
+        qsort(s, iterations, sizeof(u64), compare_u64);
+        warn(
+            "%-10s %10.2f %10.2f %10.2f %10.2f\n",
+            bench_phase_str((BENCH_PHASE)p),
+            s[0] / 1000.0,
+            s[iterations/2] / 1000.0,
+            s[(iterations-1)*99/100] / 1000.0,
+            s[iterations-1] / 1000.0
+        );
+        free(s);
+    }
+
+    return 0;
+}
+
+#endif
@@ -1,3 +1,3 @@
 #!/bin/bash
 
-g++ -g main.cpp -o subline
+g++ -g -pthread main.cpp -o subline -lz
@@ -0,0 +1,571 @@
+#ifndef subline_command
+#define subline_command
+
+// Running the commands of stdout().
+//
+// A command's standard output and error are read as they are
+// written, both at once, so a command writing more than a pipe
+// can hold never blocks on us. Every command has a deadline: once
+// it passes, its whole process group is killed, and whatever it
+// wrote so far is all there is. Output past COMMAND_OUTPUT_CAP is
+// read and thrown away. Several commands may be running at once,
+// see command_start.
+//
+// Commands are started with posix_spawn, which doesn't copy the
+// page tables of the (possibly large) parent, as fork does. Where
+// a command lives is looked up in PATH only once for each name,
+// for as long as PATH doesn't change.
+
+#include <poll.h>
+#include <spawn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <signal.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+#include "utils.cpp"
+#include "profile.cpp"
+#include "command_cache.cpp"
+
+#define COMMAND_TIMEOUT_MS 1000
+#define COMMAND_OUTPUT_CAP (64 * 1024)
+// As execvp does when PATH isn't set.
+#define COMMAND_DEFAULT_PATH "/bin:/usr/bin"
+
+extern char** environ;
+
+struct Command_Result {
+    string out;
+    string err;
+    int code;
+    // Whether the command was killed for running past its deadline.
+    bool timed_out;
+};
+
+struct Command_Output {
+    int fd;
+    char* text;
+    int len;
+    int cap;
+};
+
+/// Reads whatever is available. Returns false once the pipe is
+/// closed.
+bool output_read(Command_Output* o) {
+    char discard[4096];
+    while (true) {
+        char* into = discard;
+        int room = sizeof(discard);
+        if (o->len < COMMAND_OUTPUT_CAP) {
+            if (o->cap - o->len < 1024) {
+                o->cap = o->cap == 0 ? 4096 : o->cap * 2;
+                o->text = (char*)realloc(o->text, o->cap + 1);
+            }
+            into = o->text + o->len;
+            room = o->cap - o->len;
+            if (room > COMMAND_OUTPUT_CAP - o->len) room = COMMAND_OUTPUT_CAP - o->len;
+        }
+
+        auto res = read(o->fd, into, room);
+        if (res > 0) {
+            if (into != discard) o->len += res;
+            continue;
+        }
+        if (res == -1 && errno == EINTR) continue;
+        return res == -1 && errno == EAGAIN;
+    }
+}
+
+string output_string(Command_Output* o) {
+    if (o->text == 0) o->text = (char*)malloc(1);
+    o->text[o->len] = 0;
+    return {o->text, o->len};
+}
+
+/// A handle that becomes readable when the process exits, or -1
+/// where the kernel has none.
+int pid_handle(pid_t pid) {
+#ifdef SYS_pidfd_open
+    return syscall(SYS_pidfd_open, pid, 0);
+#else
+    return -1;
+#endif
+}
+
+struct Command_Path {
+    string name;
+    // Empty if it wasn't found.
+    string path;
+};
+
+struct Command_Paths {
+    // The PATH the entries were found in.
+    string path_var;
+    // The state of the directories in it, when the entries are
+    // kept across prompts; see command_paths_warm.
+    u64 dirs_stamp;
+    bag<Command_Path> entries;
+} command_paths;
+
+/// Looks for an executable in each directory of PATH, as execvp
+/// does. An empty directory is the current one.
+string command_search(string path_var, string name) {
+    char path[PATH_MAX];
+    int start = 0;
+    while (start <= path_var.len) {
+        int end = start;
+        while (end < path_var.len && path_var.text[end] != ':') end++;
+        int dir_len = end - start;
+        if (dir_len == 0) snprintf(path, sizeof(path), FSTR, FARG(name));
+        else snprintf(path, sizeof(path), "%.*s/" FSTR, dir_len, path_var.text + start, FARG(name));
+
+        struct stat st;
+        if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && access(path, X_OK) == 0) {
+            auto found = to_string(path);
+            return copy(&found);
+        }
+        start = end + 1;
+    }
+    return {0};
+}
+
+void command_paths_reset(string path_var) {
+    auto t = &command_paths;
+    for (int i=0; i<t->entries.len; i++) {
+        free((void*)t->entries.items[i].name.text);
+        free((void*)t->entries.items[i].path.text);
+    }
+    free((void*)t->path_var.text);
+    if (t->entries.items == 0) t->entries = create_bag<Command_Path>(8);
+    t->entries.len = 0;
+    t->path_var = copy(&path_var);
+    t->dirs_stamp = 0;
+}
+
+/// Path of the executable a command names. Names with a slash
+/// are used as they are, the rest are looked up in PATH.
+optional<string> command_path(string name) {
+    if (index_of(&name, '/', 1) != -1) return ok(name);
+
+    auto path_env = getenv("PATH");
+    auto path_var = to_string(path_env ? path_env : COMMAND_DEFAULT_PATH);
+    auto t = &command_paths;
+    if (t->entries.items == 0 || !equal(&t->path_var, &path_var)) command_paths_reset(path_var);
+
+    for (int i=0; i<t->entries.len; i++) {
+        auto entry = &t->entries.items[i];
+        if (!equal(&entry->name, &name)) continue;
+        if (entry->path.len == 0) return error("Not found");
+        return ok(entry->path);
+    }
+
+    Command_Path entry = {copy(&name), command_search(path_var, name)};
+    bag_add(&t->entries, entry);
+    if (entry.path.len == 0) return error("Not found");
+    return ok(entry.path);
+}
+
+/// A hash of the mtimes of the directories in PATH, which change
+/// whenever a command is added to or removed from one of them.
+u64 command_paths_stamp(string path_var) {
+    bag<char> stamps = create_bag<char>(256);
+    char path[PATH_MAX];
+    int start = 0;
+    while (start <= path_var.len) {
+        int end = start;
+        while (end < path_var.len && path_var.text[end] != ':') end++;
+        snprintf(path, sizeof(path), "%.*s", end - start, path_var.text + start);
+
+        char stamp[64];
+        struct stat st;
+        if (stat(end > start ? path : ".", &st) == 0) {
+            snprintf(stamp, sizeof(stamp), "%lx.%lx:%lx ", (unsigned long)st.st_mtim.tv_sec,
+                (unsigned long)st.st_mtim.tv_nsec, (unsigned long)st.st_ino);
+        } else {
+            snprintf(stamp, sizeof(stamp), "- ");
+        }
+        for (int i=0; stamp[i] != 0; i++) bag_add(&stamps, stamp[i]);
+        start = end + 1;
+    }
+    auto text = string{stamps.items, stamps.len};
+    u64 h = hash(&text);
+    free(stamps.items);
+    return h;
+}
+
+/// Whether PATH has a directory relative to the current one,
+/// including an empty one.
+bool path_var_relative(string path_var) {
+    int start = 0;
+    while (start <= path_var.len) {
+        if (start == path_var.len || path_var.text[start] != '/') return true;
+        while (start < path_var.len && path_var.text[start] != ':') start++;
+        start++;
+    }
+    return false;
+}
+
+/// Looks commands up ahead of time, in a process that lives
+/// across prompts (the daemon), so that the processes it forks
+/// find them already looked up. The lookups are kept for as long
+/// as PATH and the directories in it stay the same.
+///
+/// The daemon's cwd isn't the prompt's, so a PATH with relative
+/// directories is left for each prompt to search itself.
+void command_paths_warm(const char* path_env, string* names, int len) {
+    auto path_var = to_string(path_env ? path_env : COMMAND_DEFAULT_PATH);
+    auto t = &command_paths;
+    if (path_var_relative(path_var)) {
+        command_paths_reset(path_var);
+        return;
+    }
+
+    u64 stamp = command_paths_stamp(path_var);
+    if (t->entries.items == 0 || !equal(&t->path_var, &path_var) || t->dirs_stamp != stamp) {
+        command_paths_reset(path_var);
+        t->dirs_stamp = stamp;
+    }
+
+    for (int i=0; i<len; i++) {
+        bool known = index_of(&names[i], '/', 1) != -1;
+        for (int j=0; j<t->entries.len && !known; j++) known = equal(&t->entries.items[j].name, &names[i]);
+        if (known) continue;
+        Command_Path entry = {copy(&names[i]), command_search(path_var, names[i])};
+        bag_add(&t->entries, entry);
+    }
+}
+
+/// Forgets where a command was found, after it went missing.
+void command_path_forget(string name) {
+    auto t = &command_paths;
+    for (int i=0; i<t->entries.len; i++) {
+        auto entry = t->entries.items[i];
+        if (!equal(&entry.name, &name)) continue;
+        free((void*)entry.name.text);
+        free((void*)entry.path.text);
+        bag_remove(&t->entries, i);
+        return;
+    }
+}
+
+/// Starts a command in its own process group, so that everything
+/// it starts can be killed along with it. That takes it out of the
+/// terminal's foreground group, so it mustn't read from the
+/// terminal either. Returns an errno value.
+int command_spawn(pid_t* pid, string name, char** argv, int out_fd, int err_fd) {
+    auto path = command_path(name);
+    if (path.error) return ENOENT;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, err_fd, STDERR_FILENO);
+
+    // The daemon ignores SIGPIPE, which commands would inherit.
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+
+    int res = posix_spawn(pid, path.value.text, &actions, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return res;
+}
+
+struct Command {
+    pid_t pid;
+    // Readable once the process exits, or -1.
+    int exited;
+    Command_Output outputs[2];
+    bool reading[2];
+    bool alive;
+    int status;
+    // 0 if there is none.
+    u64 deadline;
+    bool timed_out;
+    // Why it couldn't be started, if it couldn't.
+    string failed;
+    Command_Cache cache;
+    // Whether the result came from the cache, and nothing runs.
+    bool cached;
+};
+
+// Commands that were started, and not yet finished. While waiting
+// for any one of them, the output of all of them is read, so none
+// is held up by a full pipe.
+bag<Command*> commands_running;
+// Set (possibly by a signal handler) once no result is wanted
+// anymore. Whatever is running is then killed.
+volatile sig_atomic_t commands_cancelled;
+
+/// Kills every running command. They are still to be finished.
+void commands_kill() {
+    for (int i=0; i<commands_running.len; i++) {
+        auto c = commands_running.items[i];
+        if (c->alive || c->reading[0]) {
+            c->timed_out = true;
+            kill(-c->pid, SIGKILL);
+        }
+    }
+}
+
+void command_refresh(string* cmd_args, int len, int timeout_ms, Command_Cache* cache);
+
+bool command_done(Command* c) {
+    return c->cached || c->failed.len > 0 || c->timed_out || !(c->reading[0] || c->alive);
+}
+
+/// Starts a command without waiting for it. Its result is only
+/// read by command_finish, which must be called exactly once.
+/// When it runs for longer than timeout_ms (unless that's 0),
+/// its process group is killed. The command isn't run at all if
+/// its result is in the cache; the command takes the cache over.
+Command* command_start(string* cmd_args, int len, int timeout_ms = COMMAND_TIMEOUT_MS, Command_Cache cache = {0}) {
+    u64 started = now_ns();
+    auto c = (Command*)calloc(1, sizeof(Command));
+    c->exited = -1;
+    c->outputs[0].fd = -1;
+    c->outputs[1].fd = -1;
+    if (timeout_ms > 0) c->deadline = started + (u64)timeout_ms * 1000000;
+
+    c->cache = cache;
+    int code;
+    bool fresh;
+    auto cached = command_cache_load(&c->cache, &code, &fresh);
+    if (cached.error == 0) {
+        if (!fresh) command_refresh(cmd_args, len, timeout_ms, &c->cache);
+        c->cached = true;
+        c->outputs[0].text = (char*)cached.value.text;
+        c->outputs[0].len = cached.value.len;
+        c->status = W_EXITCODE(code, 0);
+        return c;
+    }
+
+    int size = 0;
+    for (int i=0; i<len; i++) size += cmd_args[i].len + 1;
+    auto cmd_text = (char*)malloc(size);
+    auto arr = (char**)malloc((len + 1) * sizeof(char*));
+
+    int offset = 0;
+    for (int i=0; i<len; i++) {
+        auto arg = cmd_args[i];
+        arr[i] = cmd_text + offset;
+        memcpy(cmd_text + offset, arg.text, arg.len);
+        offset += arg.len;
+        cmd_text[offset] = 0;
+        offset++;
+    }
+    arr[len] = 0;
+
+    int pipe_stdout[2];
+    int pipe_stderr[2];
+    assert(pipe2(pipe_stdout, O_CLOEXEC) == 0, "Failed to create output pipe!");
+    assert(pipe2(pipe_stderr, O_CLOEXEC) == 0, "Failed to create error pipe!");
+
+    auto name = to_string(arr[0]);
+    int spawned = command_spawn(&c->pid, name, arr, pipe_stdout[1], pipe_stderr[1]);
+    if (spawned == ENOENT || spawned == ENOTDIR) {
+        // It may have been found before, and since moved.
+        command_path_forget(name);
+        spawned = command_spawn(&c->pid, name, arr, pipe_stdout[1], pipe_stderr[1]);
+    }
+    if (spawned != 0) c->failed = stringf("Failed to run " FSTR ": %s", FARG(name), strerror(spawned));
+    free(cmd_text);
+    free(arr);
+
+    close(pipe_stdout[1]);
+    close(pipe_stderr[1]);
+
+    if (spawned != 0) {
+        close(pipe_stdout[0]);
+        close(pipe_stderr[0]);
+    } else {
+        c->outputs[0].fd = pipe_stdout[0];
+        c->outputs[1].fd = pipe_stderr[0];
+        for (auto& o : c->outputs) fcntl(o.fd, F_SETFL, O_NONBLOCK);
+        c->exited = pid_handle(c->pid);
+        c->reading[0] = c->reading[1] = true;
+        c->alive = true;
+        if (commands_running.items == 0) commands_running = create_bag<Command*>(8);
+        bag_add(&commands_running, c);
+    }
+
+    if (profiler.enabled) profiler.exec_ns += now_ns() - started;
+    return c;
+}
+
+/// Reads what a command wrote, and checks whether it's still
+/// running. A command that ran out of time is killed right away.
+void command_update(Command* c) {
+    if (command_done(c)) return;
+    for (int i=0; i<2; i++) {
+        if (c->reading[i]) c->reading[i] = output_read(&c->outputs[i]);
+    }
+    if (c->alive && waitpid(c->pid, &c->status, WNOHANG) == c->pid) c->alive = false;
+    if (!command_done(c) && c->deadline != 0 && now_ns() >= c->deadline) {
+        c->timed_out = true;
+        kill(-c->pid, SIGKILL);
+    }
+}
+
+/// Waits until the command is done, reading the output of every
+/// running command in the meantime.
+///
+/// That is until its output is closed, and the process is gone.
+/// A process it started in the background may hold the output open
+/// after it exits; that's waited for too, up to the deadline, as a
+/// shell would. Errors are only read while waiting for the rest.
+void command_wait(Command* target) {
+    while (!command_done(target)) {
+        if (commands_cancelled) {
+            commands_kill();
+            break;
+        }
+        auto running = &commands_running;
+        pollfd fds[running->len * 3];
+        int count = 0;
+        u64 deadline = 0;
+        bool check = false;
+        for (int i=0; i<running->len; i++) {
+            auto c = running->items[i];
+            if (command_done(c)) continue;
+            for (int j=0; j<2; j++) {
+                if (c->reading[j]) fds[count++] = {c->outputs[j].fd, POLLIN, 0};
+            }
+            if (c->alive && c->exited != -1) fds[count++] = {c->exited, POLLIN, 0};
+            if (c->alive && c->exited == -1 && !c->reading[0]) check = true;
+            if (c->deadline != 0 && (deadline == 0 || c->deadline < deadline)) deadline = c->deadline;
+        }
+
+        int wait_ms = -1;
+        if (deadline != 0) {
+            u64 now = now_ns();
+            wait_ms = now >= deadline ? 0 : (deadline - now + 999999) / 1000000;
+        }
+        // Without a pid handle, the process is checked on at
+        // least every few milliseconds once the pipes are closed.
+        if (check && (wait_ms == -1 || wait_ms > 5)) wait_ms = 5;
+
+        int res = poll(fds, count, wait_ms);
+        if (res == -1 && errno != EINTR) break;
+
+        for (int i=0; i<running->len; i++) command_update(running->items[i]);
+    }
+}
+
+/// Waits for a command started by command_start, and returns
+/// what it wrote.
+Command_Result command_finish(Command* c) {
+    u64 started = now_ns();
+    if (c->failed.len > 0) {
+        Command_Result failed = {to_string(""), c->failed, 127, false};
+        command_cache_free(&c->cache);
+        free(c);
+        return failed;
+    }
+
+    command_wait(c);
+    if (c->timed_out || c->alive) kill(-c->pid, SIGKILL);
+    if (c->alive) waitpid(c->pid, &c->status, 0);
+    if (c->exited != -1) close(c->exited);
+    for (auto& o : c->outputs) close(o.fd);
+
+    for (int i=0; i<commands_running.len; i++) {
+        if (commands_running.items[i] != c) continue;
+        bag_remove(&commands_running, i);
+        break;
+    }
+
+    if (profiler.enabled) profiler.exec_ns += now_ns() - started;
+
+    int status = c->status;
+    Command_Result result = {
+        .out=output_string(&c->outputs[0]),
+        .err=output_string(&c->outputs[1]),
+        .code=WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status),
+        .timed_out=c->timed_out,
+    };
+    if (!c->cached && !c->timed_out) command_cache_store(&c->cache, result.out, result.code);
+    command_cache_free(&c->cache);
+    free(c);
+    return result;
+}
+
+/// Kills a command whose result is no longer needed.
+void command_cancel(Command* c) {
+    if (c->failed.len > 0) {
+        free((void*)c->failed.text);
+        command_cache_free(&c->cache);
+        free(c);
+        return;
+    }
+    if (!command_done(c)) {
+        c->timed_out = true;
+        kill(-c->pid, SIGKILL);
+    }
+    auto res = command_finish(c);
+    free((void*)res.out.text);
+    free((void*)res.err.text);
+}
+
+/// Runs a command, and captures its output. When it runs for
+/// longer than timeout_ms (unless that's 0), its process group
+/// is killed.
+Command_Result run_command(string* cmd_args, int len, int timeout_ms = COMMAND_TIMEOUT_MS, Command_Cache cache = {0}) {
+    return command_finish(command_start(cmd_args, len, timeout_ms, cache));
+}
+
+/// Runs a command again in a detached process, to replace its
+/// out-of-date result in the cache for the next prompt. Does
+/// nothing if it's already being refreshed.
+void command_refresh(string* cmd_args, int len, int timeout_ms, Command_Cache* cache) {
+    int lock = command_cache_lock(cache);
+    if (lock == -1) return;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        // Out of the shell's session, and orphaned, so that
+        // nobody waits for it.
+        setsid();
+        if (fork() != 0) _exit(0);
+
+        // Whoever reads the prompt waits until every copy of its
+        // output is closed, and so would a daemon's clients. The
+        // lock is all that's kept.
+        int null = open("/dev/null", O_RDWR);
+        for (int fd=0; fd<3; fd++) dup2(null, fd);
+        if (lock != 3) dup2(lock, 3);
+        fcntl(3, F_SETFD, FD_CLOEXEC);
+#ifdef SYS_close_range
+        syscall(SYS_close_range, 4, ~0U, 0);
+#else
+        for (int fd=4; fd<sysconf(_SC_OPEN_MAX); fd++) close(fd);
+#endif
+        commands_running.len = 0;
+
+        Command_Cache refresh = *cache;
+        refresh.key = copy(&cache->key);
+        refresh.stamps = copy(&cache->stamps);
+        refresh.background = false;
+        run_command(cmd_args, len, timeout_ms, refresh);
+        command_cache_unlock(cache, 3);
+        _exit(0);
+    }
+
+    close(lock);
+    if (pid > 0) waitpid(pid, 0, 0);
+}
+
+#endif
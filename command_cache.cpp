@@ -0,0 +1,249 @@
+#ifndef subline_command_cache
+#define subline_command_cache
+
+// Results of stdout() commands, kept on disk across prompts.
+//
+// A result is kept for the command's arguments, run in the same
+// directory, with the same PATH and the same values of the other
+// environment variables it was said to depend on. It is used for
+// ttl seconds after the command ran, and only while the files it
+// watches (if any) are just as they were before it ran: a watched
+// file is known by its device, inode, size and mtime, or by being
+// absent.
+//
+// Every result is a file in the cache directory, named after a
+// hash of its key, and written with cache_write, so concurrent
+// prompts see either the old or the new result.
+//
+// Results that are refreshed in the background are used even when
+// they are out of date, while the command runs again, detached,
+// for the next prompt; see command_refresh. A lock next to the
+// result keeps more than one refresh of it from running at once,
+// and is deleted once the refresh is over.
+//
+// Results that haven't been written for a week are deleted when
+// another result is written. That's long past any sensible ttl,
+// and a result that's still wanted is only run again.
+
+#include <time.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "utils.cpp"
+#include "files.cpp"
+
+#define COMMAND_CACHE_VERSION "1"
+
+#define COMMAND_CACHE_MAX_AGE (7*24*60*60)
+
+struct Command_Cache {
+    // Empty when the result isn't to be cached.
+    string key;
+    // Seconds that a result is used for, or 0 for as long as
+    // the watched files don't change.
+    s64 ttl;
+    // The state of the watched files before the command ran.
+    string stamps;
+    // Whether a result that's out of date is still used, while
+    // it's refreshed in the background. Results without a ttl or
+    // watched files are then always out of date.
+    bool background;
+};
+
+/// Appends "name=value\0" to the key, for the named variable.
+void command_cache_env(bag<char>* key, const char* name, int len) {
+    char var[len+1];
+    memcpy(var, name, len);
+    var[len] = 0;
+    auto value = getenv(var);
+    for (int i=0; i<len; i++) bag_add(key, name[i]);
+    bag_add(key, '=');
+    for (int i=0; value != 0 && value[i] != 0; i++) bag_add(key, value[i]);
+    bag_add(key, '\0');
+}
+
+/// Describes a watched file. Relative paths are relative to the
+/// cwd, and "~/" is the home directory.
+void command_cache_stamp(bag<char>* stamps, string cwd, string path) {
+    char full[PATH_MAX];
+    auto home = getenv("HOME");
+    if (path.len >= 2 && path.text[0] == '~' && path.text[1] == '/' && home != 0) {
+        snprintf(full, sizeof(full), "%s/%.*s", home, path.len - 2, path.text + 2);
+    } else if (path.len > 0 && path.text[0] == '/') {
+        snprintf(full, sizeof(full), FSTR, FARG(path));
+    } else {
+        snprintf(full, sizeof(full), FSTR "/" FSTR, FARG(cwd), FARG(path));
+    }
+
+    char stamp[128];
+    struct stat st;
+    if (stat(full, &st) == 0) {
+        snprintf(stamp, sizeof(stamp), "%lx:%lx:%lx:%lx.%lx ",
+            (unsigned long)st.st_dev, (unsigned long)st.st_ino, (unsigned long)st.st_size,
+            (unsigned long)st.st_mtim.tv_sec, (unsigned long)st.st_mtim.tv_nsec);
+    } else {
+        snprintf(stamp, sizeof(stamp), "- ");
+    }
+    for (int i=0; stamp[i] != 0; i++) bag_add(stamps, stamp[i]);
+}
+
+/// The cache of a command's result. env and watch are lists of
+/// variable names and paths, separated by spaces.
+Command_Cache command_cache_open(string* args, int len, string cwd, string env, string watch, s64 ttl, bool background = false) {
+    bag<char> key = create_bag<char>(256);
+    for (int i=0; i<len; i++) {
+        for (int j=0; j<args[i].len; j++) bag_add(&key, args[i].text[j]);
+        bag_add(&key, '\0');
+    }
+    bag_add(&key, '\0');
+    for (int i=0; i<cwd.len; i++) bag_add(&key, cwd.text[i]);
+    bag_add(&key, '\0');
+    command_cache_env(&key, "PATH", 4);
+
+    bag<char> stamps = create_bag<char>(64);
+    for (int pass=0; pass<2; pass++) {
+        auto list = pass == 0 ? env : watch;
+        int start = 0;
+        for (int i=0; i<=list.len; i++) {
+            if (i < list.len && list.text[i] != ' ') continue;
+            if (i > start) {
+                if (pass == 0) command_cache_env(&key, list.text + start, i - start);
+                else command_cache_stamp(&stamps, cwd, string{list.text + start, i - start});
+            }
+            start = i + 1;
+        }
+    }
+
+    return {{key.items, key.len}, ttl, {stamps.items, stamps.len}, background};
+}
+
+void command_cache_free(Command_Cache* cache) {
+    free((void*)cache->key.text);
+    free((void*)cache->stamps.text);
+    *cache = {0};
+}
+
+string command_cache_path(Command_Cache* cache, string dir) {
+    return stringf(FSTR "/%016lx.cmd", FARG(dir), (unsigned long)hash(&cache->key));
+}
+
+string command_cache_lock_path(Command_Cache* cache) {
+    auto dir = cache_dir();
+    if (dir.error) return {0};
+    auto path = command_cache_path(cache, dir.value);
+    auto lock_path = stringf(FSTR ".lock", FARG(path));
+    free((void*)path.text);
+    free((void*)dir.value.text);
+    return lock_path;
+}
+
+/// Takes the lock on refreshing a result, unless someone else
+/// holds it. Returns the locked file, or -1. The lock is held
+/// until every copy of the file is closed.
+int command_cache_lock(Command_Cache* cache) {
+    auto lock_path = command_cache_lock_path(cache);
+    if (lock_path.len == 0) return -1;
+    int fd = open(lock_path.text, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd != -1 && flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        close(fd);
+        fd = -1;
+    }
+
+    // The file may have been deleted by a refresh that just
+    // finished, after it was opened; its lock is then worthless.
+    struct stat locked;
+    struct stat named;
+    if (fd != -1 && (fstat(fd, &locked) != 0 || stat(lock_path.text, &named) != 0 ||
+            locked.st_dev != named.st_dev || locked.st_ino != named.st_ino)) {
+        close(fd);
+        fd = -1;
+    }
+    free((void*)lock_path.text);
+    return fd;
+}
+
+/// Gives up the lock on refreshing a result, deleting it while
+/// it's still held.
+void command_cache_unlock(Command_Cache* cache, int fd) {
+    auto lock_path = command_cache_lock_path(cache);
+    if (lock_path.len > 0) unlink(lock_path.text);
+    free((void*)lock_path.text);
+    close(fd);
+}
+
+/// The output and exit code the command had. fresh is set if
+/// they're up to date; otherwise, they are only to be used when
+/// refreshed in the background.
+optional<string> command_cache_load(Command_Cache* cache, int* code, bool* fresh) {
+    if (cache->key.len == 0) return error("Not cached");
+    auto dir = cache_dir();
+    if (dir.error) return error("No cache directory");
+    auto path = command_cache_path(cache, dir.value);
+    free((void*)dir.value.text);
+
+    struct stat st;
+    bool exists = stat(path.text, &st) == 0;
+    *fresh = exists && (cache->ttl > 0 || cache->stamps.len > 0) && (cache->ttl == 0 || time(0) - st.st_mtime < cache->ttl);
+    bool usable = exists && (*fresh || cache->background);
+    auto file = usable ? read_file(path.text) : optional<string>(error("No cached result"));
+    free((void*)path.text);
+    if (file.error) return file;
+
+    // version, key length, key, stamps, exit code, output
+    auto text = file.value;
+    string fields[5];
+    int at = 0;
+    bool valid = true;
+    for (int i=0; i<5 && valid; i++) {
+        // The key holds NULs, so its length comes first.
+        int len = i == 2 ? atoi(fields[1].text) : -1;
+        if (i != 2) {
+            auto rest = slice(&text, at, text.len);
+            len = index_of(&rest, '\0', 1);
+        }
+        valid = len >= 0 && at + len < text.len && text.text[at + len] == 0;
+        if (valid) fields[i] = {text.text + at, len};
+        at += len + 1;
+    }
+    valid = valid && equal(&fields[0], COMMAND_CACHE_VERSION) && equal(&fields[2], &cache->key);
+    if (valid && !equal(&fields[3], &cache->stamps)) {
+        *fresh = false;
+        valid = cache->background;
+    }
+    if (!valid) {
+        free((void*)file.value.text);
+        return error("Stale result");
+    }
+
+    *code = atoi(fields[4].text);
+    auto out = slice(&text, at, text.len);
+    out = copy(&out);
+    free((void*)file.value.text);
+    return ok(out);
+}
+
+void command_cache_store(Command_Cache* cache, string out, int code) {
+    if (cache->key.len == 0) return;
+    auto header = stringf(COMMAND_CACHE_VERSION "%c%d%c", 0, cache->key.len, 0);
+    auto trailer = stringf("%c" FSTR "%c%d%c", 0, FARG(cache->stamps), 0, code, 0);
+    string parts[] = {header, cache->key, trailer, out};
+    auto data = concat(parts, 4);
+
+    auto dir = cache_dir();
+    if (dir.error == 0) {
+        auto path = command_cache_path(cache, dir.value);
+        auto name = path.text + dir.value.len + 1;
+        cache_write(name, data.text, data.len);
+        free((void*)path.text);
+        free((void*)dir.value.text);
+        cache_prune(".cmd", COMMAND_CACHE_MAX_AGE);
+        // Left behind by refreshes that were killed.
+        cache_prune(".cmd.lock", COMMAND_CACHE_MAX_AGE);
+    }
+    free((void*)header.text);
+    free((void*)trailer.text);
+    free((void*)data.text);
+}
+
+#endif
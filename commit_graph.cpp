@@ -0,0 +1,707 @@
+#ifndef subline_commit_graph
+#define subline_commit_graph
+
+// Reading git's commit-graph, and counting how far the current
+// branch is ahead of and behind its upstream.
+//
+// The commit-graph (objects/info/commit-graph, or a chain of
+// files listed in objects/info/commit-graphs/commit-graph-chain)
+// lists commits sorted by id, each with its parents and its
+// generation number: a commit's generation is always greater
+// than that of any of its ancestors. Walking commits in order
+// of decreasing generation means every commit is visited after
+// all of its descendants, so the walk can stop as soon as every
+// commit left is reachable from both tips.
+//
+// Commits made after the graph was written are not in it. Those
+// are read from the object store, and given generations of their
+// own, up to a limit (SUBLINE_AHEAD_BEHIND_LIMIT, 10000 by
+// default). Past the limit, or when an object can't be read, the
+// counts are unknown.
+//
+// Without a commit-graph at all, as in a fresh clone, numbering
+// every commit would mean reading the whole history. Commits are
+// then read only as the walk reaches them, and walked in order of
+// decreasing commit date instead, as git did before it had
+// generation numbers. Commits can share a date, so one may be
+// counted before a descendant that reaches it from the other tip;
+// it's then uncounted, along with its ancestors, and the walk
+// only stops once every commit left is older than every commit
+// counted. The limit still bounds the walk, and the counts can be
+// off when committer clocks were skewed.
+// Format: https://git-scm.com/docs/gitformat-commit-graph
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "utils.cpp"
+#include "files.cpp"
+#include "git.cpp"
+#include "git_objects.cpp"
+
+#define GRAPH_CHUNK_OIDF 0x4f494446
+#define GRAPH_CHUNK_OIDL 0x4f49444c
+#define GRAPH_CHUNK_CDAT 0x43444154
+#define GRAPH_CHUNK_EDGE 0x45444745
+
+#define GRAPH_DATA_WIDTH 36
+#define GRAPH_PARENT_NONE 0x70000000
+#define GRAPH_EXTRA_EDGES 0x80000000
+#define GRAPH_LAST_EDGE   0x80000000
+
+#define AHEAD_BEHIND_LIMIT 10000
+
+struct Graph_Layer {
+    u8* map;
+    u64 size;
+    // Position of this layer's first commit in the whole chain.
+    u32 base;
+    u32 count;
+    const u8* fanout;
+    const u8* oids;
+    const u8* data;
+    const u8* edges;
+    const u8* end;
+};
+
+struct Commit_Graph {
+    bag<Graph_Layer> layers;
+    u32 count;
+};
+
+bool graph_layer_load(const char* path, u32 base, Graph_Layer* out) {
+    auto file = map_file(path);
+    if (file.error) return false;
+
+    Graph_Layer layer = {0};
+    layer.map = (u8*)file.value.text;
+    layer.size = file.value.len;
+    layer.base = base;
+    layer.end = layer.map + layer.size;
+
+    auto m = layer.map;
+    // Header: signature, version 1, hash version 1 (SHA-1),
+    // chunk count, base graph count.
+    bool valid = layer.size >= 8 && memcmp(m, "CGPH", 4) == 0 && m[4] == 1 && m[5] == 1;
+    int chunks = valid ? m[6] : 0;
+    if (valid && (u64)(8 + (chunks + 1) * 12) > layer.size) valid = false;
+
+    for (int i=0; valid && i<chunks; i++) {
+        auto entry = m + 8 + i*12;
+        u32 id = be32(entry);
+        u64 offset = be64(entry + 4);
+        if (offset >= layer.size) {
+            valid = false;
+            break;
+        }
+        switch (id) {
+        case GRAPH_CHUNK_OIDF: layer.fanout = m + offset; break;
+        case GRAPH_CHUNK_OIDL: layer.oids = m + offset; break;
+        case GRAPH_CHUNK_CDAT: layer.data = m + offset; break;
+        case GRAPH_CHUNK_EDGE: layer.edges = m + offset; break;
+        }
+    }
+
+    if (valid) valid = layer.fanout && layer.oids && layer.data && layer.fanout + 256*4 <= layer.end;
+    if (valid) {
+        layer.count = be32(layer.fanout + 255*4);
+        valid = layer.oids + (u64)layer.count * 20 <= layer.end &&
+            layer.data + (u64)layer.count * GRAPH_DATA_WIDTH <= layer.end &&
+            fanout_valid(layer.fanout);
+    }
+
+    if (!valid) {
+        if (layer.size > 0) munmap(layer.map, layer.size);
+        return false;
+    }
+    *out = layer;
+    return true;
+}
+
+void commit_graph_free(Commit_Graph* graph) {
+    for (int i=0; i<graph->layers.len; i++) {
+        munmap(graph->layers.items[i].map, graph->layers.items[i].size);
+    }
+    free(graph->layers.items);
+    graph->layers = {0};
+    graph->count = 0;
+}
+
+/// Loads the commit-graph, if the repository has one. A graph
+/// with no commits is returned when it doesn't.
+Commit_Graph commit_graph_load(Git_State* git) {
+    Commit_Graph graph = {0};
+    graph.layers = create_bag<Graph_Layer>(4);
+    char path[PATH_MAX];
+
+    Graph_Layer layer;
+    git_path(git->common_dir, "objects/info/commit-graph", path);
+    if (graph_layer_load(path, 0, &layer)) {
+        bag_add(&graph.layers, layer);
+        graph.count = layer.count;
+        return graph;
+    }
+
+    git_path(git->common_dir, "objects/info/commit-graphs/commit-graph-chain", path);
+    auto chain = map_file(path);
+    if (chain.error) return graph;
+
+    // One graph per line, base first.
+    auto p = chain.value.text;
+    auto end = p + chain.value.len;
+    while (p + OID_HEX_LEN <= end) {
+        auto name = stringf("objects/info/commit-graphs/graph-%.40s.graph", p);
+        git_path(git->common_dir, name.text, path);
+        free((void*)name.text);
+
+        if (!graph_layer_load(path, graph.count, &layer)) {
+            // A chain with a missing layer is unusable.
+            commit_graph_free(&graph);
+            graph.layers = create_bag<Graph_Layer>(1);
+            break;
+        }
+        bag_add(&graph.layers, layer);
+        graph.count += layer.count;
+
+        p += OID_HEX_LEN;
+        while (p < end && (*p == '\n' || *p == '\r')) p++;
+    }
+
+    if (chain.value.len > 0) munmap((void*)chain.value.text, chain.value.len);
+    return graph;
+}
+
+/// Finds a commit's position in the graph, using the fanout
+/// table and a binary search over the sorted ids of each layer.
+bool graph_find(Commit_Graph* graph, Git_Oid* oid, u32* pos) {
+    u8 first = oid->hash[0];
+    for (int i=0; i<graph->layers.len; i++) {
+        auto layer = &graph->layers.items[i];
+        u32 lo = first == 0 ? 0 : be32(layer->fanout + (first-1)*4);
+        u32 hi = be32(layer->fanout + first*4);
+        while (lo < hi) {
+            u32 mid = lo + (hi - lo) / 2;
+            int cmp = memcmp(layer->oids + (u64)mid*20, oid->hash, 20);
+            if (cmp == 0) {
+                *pos = layer->base + mid;
+                return true;
+            }
+            if (cmp < 0) lo = mid + 1;
+            else hi = mid;
+        }
+    }
+    return false;
+}
+
+Graph_Layer* graph_layer(Commit_Graph* graph, u32 pos) {
+    for (int i=graph->layers.len-1; i>=0; i--) {
+        if (pos >= graph->layers.items[i].base) return &graph->layers.items[i];
+    }
+    return &graph->layers.items[0];
+}
+
+const u8* graph_data(Commit_Graph* graph, u32 pos) {
+    auto layer = graph_layer(graph, pos);
+    return layer->data + (u64)(pos - layer->base) * GRAPH_DATA_WIDTH;
+}
+
+/// The commit's topological level, which every version of the
+/// commit-graph stores, and which serves as its generation.
+u32 graph_generation(Commit_Graph* graph, u32 pos) {
+    return be32(graph_data(graph, pos) + 28) >> 2;
+}
+
+/// Appends the positions of a commit's parents. Returns false
+/// if the graph is inconsistent.
+bool graph_parents(Commit_Graph* graph, u32 pos, bag<u32>* out) {
+    auto layer = graph_layer(graph, pos);
+    auto data = graph_data(graph, pos);
+
+    u32 first = be32(data + 20);
+    u32 second = be32(data + 24);
+    if (first == GRAPH_PARENT_NONE) return true;
+    if (first >= graph->count) return false;
+    bag_add(out, first);
+
+    if (second == GRAPH_PARENT_NONE) return true;
+    if (!(second & GRAPH_EXTRA_EDGES)) {
+        if (second >= graph->count) return false;
+        bag_add(out, second);
+        return true;
+    }
+
+    // Octopus merges list their other parents in the EDGE chunk.
+    if (layer->edges == 0) return false;
+    auto edge = layer->edges + (u64)(second & ~GRAPH_EXTRA_EDGES) * 4;
+    while (edge + 4 <= layer->end) {
+        u32 parent = be32(edge);
+        if ((parent & ~GRAPH_LAST_EDGE) >= graph->count) return false;
+        bag_add(out, parent & ~GRAPH_LAST_EDGE);
+        if (parent & GRAPH_LAST_EDGE) return true;
+        edge += 4;
+    }
+    return false;
+}
+
+// Walk nodes are numbered: positions in the graph come first,
+// followed by the commits that were read from the object store.
+
+#define WALK_LEFT   1
+#define WALK_RIGHT  2
+#define WALK_BOTH   3
+#define WALK_QUEUED 4
+#define WALK_DONE   8
+
+struct Walk_Commit {
+    Git_Oid oid;
+    // The commit date, when walking by date.
+    u32 generation;
+    u8 flags;
+    // 0 when new, 1 while its ancestors are loaded, 2 once its
+    // generation is known.
+    u8 state;
+    bag<u32> parents;
+};
+
+struct Commit_Walk {
+    Git_State* git;
+    Commit_Graph graph;
+    u8* graph_flags;
+    bag<Walk_Commit> extra;
+    // Open-addressed table of extra commits, by id.
+    u32* table;
+    u32 table_cap;
+    int limit;
+    bag<u32> heap;
+    // Queued commits not yet known to be reachable from both tips.
+    int active;
+    // Whether there is no graph, and commits are ordered by date.
+    bool by_date;
+    // Commits reachable from only one tip.
+    int ahead;
+    int behind;
+    // The date of the oldest of those, when walking by date.
+    u32 oldest_counted;
+};
+
+u32 oid_bucket(Git_Oid* oid, u32 cap) {
+    u32 h;
+    memcpy(&h, oid->hash, 4);
+    return h & (cap - 1);
+}
+
+/// Looks up a commit read from the object store. Table slots
+/// hold the node id plus one, so 0 marks an empty slot.
+u32* walk_slot(Commit_Walk* walk, Git_Oid* oid) {
+    u32 i = oid_bucket(oid, walk->table_cap);
+    while (walk->table[i] != 0) {
+        auto commit = &walk->extra.items[walk->table[i] - 1 - walk->graph.count];
+        if (memcmp(commit->oid.hash, oid->hash, 20) == 0) break;
+        i = (i + 1) & (walk->table_cap - 1);
+    }
+    return &walk->table[i];
+}
+
+void walk_table_grow(Commit_Walk* walk) {
+    auto old = walk->table;
+    u32 old_cap = walk->table_cap;
+    walk->table_cap = old_cap * 2;
+    walk->table = (u32*)calloc(walk->table_cap, sizeof(u32));
+    for (u32 i=0; i<old_cap; i++) {
+        if (old[i] == 0) continue;
+        auto commit = &walk->extra.items[old[i] - 1 - walk->graph.count];
+        *walk_slot(walk, &commit->oid) = old[i];
+    }
+    free(old);
+}
+
+/// Finds the node for a commit, adding it as a new, unloaded
+/// commit if it's neither in the graph nor seen before.
+u32 walk_node(Commit_Walk* walk, Git_Oid* oid) {
+    u32 pos;
+    if (graph_find(&walk->graph, oid, &pos)) return pos;
+
+    auto slot = walk_slot(walk, oid);
+    if (*slot != 0) return *slot - 1;
+
+    Walk_Commit commit = {0};
+    commit.oid = *oid;
+    bag_add(&walk->extra, commit);
+    u32 id = walk->graph.count + walk->extra.len - 1;
+    *slot = id + 1;
+
+    if ((u32)walk->extra.len * 2 > walk->table_cap) walk_table_grow(walk);
+    return id;
+}
+
+Walk_Commit* walk_extra(Commit_Walk* walk, u32 id) {
+    return &walk->extra.items[id - walk->graph.count];
+}
+
+u32 walk_generation(Commit_Walk* walk, u32 id) {
+    if (id < walk->graph.count) return graph_generation(&walk->graph, id);
+    return walk_extra(walk, id)->generation;
+}
+
+u8* walk_flags(Commit_Walk* walk, u32 id) {
+    if (id < walk->graph.count) return &walk->graph_flags[id];
+    return &walk_extra(walk, id)->flags;
+}
+
+/// Reads a commit's parents and date, when walking by date.
+bool walk_load_dated(Commit_Walk* walk, u32 id) {
+    if (walk->extra.len > walk->limit) return false;
+    auto oid = walk_extra(walk, id)->oid;
+    auto obj = git_read_object(walk->git, &oid);
+    if (obj.error || obj.value.type != OBJ_COMMIT) {
+        if (obj.error == 0) git_object_free(&obj.value);
+        return false;
+    }
+
+    auto parent_oids = create_bag<Git_Oid>(2);
+    commit_parents(&obj.value.data, &parent_oids);
+    u64 date = commit_date(&obj.value.data);
+    git_object_free(&obj.value);
+
+    auto parents = create_bag<u32>(parent_oids.len > 0 ? parent_oids.len : 1);
+    for (int i=0; i<parent_oids.len; i++) {
+        bag_add(&parents, walk_node(walk, &parent_oids.items[i]));
+    }
+    free(parent_oids.items);
+
+    auto commit = walk_extra(walk, id);
+    commit->parents = parents;
+    commit->generation = (u32)date;
+    commit->state = 2;
+    return true;
+}
+
+/// Reads a commit that isn't in the graph, and every ancestor
+/// of it that isn't either, and numbers them with generations
+/// that are consistent with the graph's.
+bool walk_load(Commit_Walk* walk, u32 id) {
+    if (id < walk->graph.count || walk_extra(walk, id)->state == 2) return true;
+    if (walk->by_date) return walk_load_dated(walk, id);
+
+    auto stack = create_bag<u32>(16);
+    bag_add(&stack, id);
+    bool ok_walk = true;
+
+    while (stack.len > 0 && ok_walk) {
+        u32 top = stack.items[stack.len-1];
+        auto commit = walk_extra(walk, top);
+
+        if (commit->state == 0) {
+            if (walk->extra.len > walk->limit) { ok_walk = false; break; }
+
+            auto oid = commit->oid;
+            auto obj = git_read_object(walk->git, &oid);
+            if (obj.error || obj.value.type != OBJ_COMMIT) {
+                if (obj.error == 0) git_object_free(&obj.value);
+                ok_walk = false;
+                break;
+            }
+
+            auto parent_oids = create_bag<Git_Oid>(2);
+            commit_parents(&obj.value.data, &parent_oids);
+            git_object_free(&obj.value);
+
+            auto parents = create_bag<u32>(parent_oids.len > 0 ? parent_oids.len : 1);
+            for (int i=0; i<parent_oids.len; i++) {
+                bag_add(&parents, walk_node(walk, &parent_oids.items[i]));
+            }
+            free(parent_oids.items);
+
+            // walk_node() may have moved the extra commits.
+            commit = walk_extra(walk, top);
+            commit->parents = parents;
+            commit->state = 1;
+        }
+
+        // Generations are assigned once all parents have one.
+        bool ready = true;
+        u32 generation = 0;
+        for (int i=0; i<commit->parents.len; i++) {
+            u32 parent = commit->parents.items[i];
+            if (parent >= walk->graph.count) {
+                auto p = walk_extra(walk, parent);
+                if (p->state == 1) { ok_walk = false; break; }
+                if (p->state == 0) {
+                    ready = false;
+                    bag_add(&stack, parent);
+                    break;
+                }
+            }
+            u32 gen = walk_generation(walk, parent);
+            if (gen > generation) generation = gen;
+        }
+
+        if (ok_walk && ready) {
+            commit = walk_extra(walk, top);
+            commit->generation = generation + 1;
+            commit->state = 2;
+            stack.len--;
+        }
+    }
+
+    free(stack.items);
+    return ok_walk;
+}
+
+bool heap_before(Commit_Walk* walk, u32 a, u32 b) {
+    return walk_generation(walk, a) > walk_generation(walk, b);
+}
+
+void heap_push(Commit_Walk* walk, u32 id) {
+    bag_add(&walk->heap, id);
+    auto items = walk->heap.items;
+    int i = walk->heap.len - 1;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!heap_before(walk, items[i], items[parent])) break;
+        u32 tmp = items[i]; items[i] = items[parent]; items[parent] = tmp;
+        i = parent;
+    }
+}
+
+u32 heap_pop(Commit_Walk* walk) {
+    auto items = walk->heap.items;
+    u32 top = items[0];
+    items[0] = items[--walk->heap.len];
+    int len = walk->heap.len;
+    int i = 0;
+    while (true) {
+        int best = i;
+        int l = i*2 + 1;
+        int r = l + 1;
+        if (l < len && heap_before(walk, items[l], items[best])) best = l;
+        if (r < len && heap_before(walk, items[r], items[best])) best = r;
+        if (best == i) break;
+        u32 tmp = items[i]; items[i] = items[best]; items[best] = tmp;
+        i = best;
+    }
+    return top;
+}
+
+bool walk_parents(Commit_Walk* walk, u32 id, bag<u32>* out);
+
+/// Carries tips down to a commit that was already counted, and
+/// to its ancestors, uncounting those that turn out to be
+/// reachable from both. Only happens when walking by date.
+bool walk_remark(Commit_Walk* walk, u32 id, u8 tips) {
+    auto stack = create_bag<u32>(16);
+    auto parents = create_bag<u32>(4);
+    bag_add(&stack, id);
+    bool ok_walk = true;
+
+    while (stack.len > 0 && ok_walk) {
+        u32 top = stack.items[--stack.len];
+        auto flags = walk_flags(walk, top);
+        u8 before = *flags;
+        if ((before & tips) == tips) continue;
+        *flags |= tips;
+
+        bool both = (*flags & WALK_BOTH) == WALK_BOTH;
+        if (!(before & WALK_DONE)) {
+            // Still queued, so not counted yet.
+            if (both) walk->active--;
+            continue;
+        }
+        if (both && (before & WALK_LEFT)) walk->ahead--;
+        else if (both) walk->behind--;
+
+        // Its parents were marked when it was counted.
+        parents.len = 0;
+        ok_walk = walk_parents(walk, top, &parents);
+        for (int i=0; i<parents.len; i++) bag_add(&stack, parents.items[i]);
+    }
+
+    free(stack.items);
+    free(parents.items);
+    return ok_walk;
+}
+
+/// Marks a commit as reachable from the given tips, queueing
+/// it if it wasn't already.
+bool walk_mark(Commit_Walk* walk, u32 id, u8 tips) {
+    if (!walk_load(walk, id)) return false;
+    auto flags = walk_flags(walk, id);
+    u8 before = *flags;
+    if (before & WALK_DONE) return walk->by_date ? walk_remark(walk, id, tips) : true;
+
+    *flags |= tips;
+    if (!(before & WALK_QUEUED)) {
+        *flags |= WALK_QUEUED;
+        heap_push(walk, id);
+        if ((*flags & WALK_BOTH) != WALK_BOTH) walk->active++;
+    } else if ((before & WALK_BOTH) != WALK_BOTH && (*flags & WALK_BOTH) == WALK_BOTH) {
+        walk->active--;
+    }
+    return true;
+}
+
+void walk_init(Commit_Walk* walk, Git_State* git) {
+    *walk = {0};
+    walk->git = git;
+    walk->graph = commit_graph_load(git);
+    walk->by_date = walk->graph.count == 0;
+    walk->oldest_counted = UINT32_MAX;
+    walk->graph_flags = (u8*)calloc(walk->graph.count + 1, 1);
+    walk->extra = create_bag<Walk_Commit>(64);
+    walk->table_cap = 256;
+    walk->table = (u32*)calloc(walk->table_cap, sizeof(u32));
+    walk->heap = create_bag<u32>(64);
+
+    walk->limit = AHEAD_BEHIND_LIMIT;
+    auto limit = getenv("SUBLINE_AHEAD_BEHIND_LIMIT");
+    if (limit != 0 && atoi(limit) > 0) walk->limit = atoi(limit);
+}
+
+void walk_free(Commit_Walk* walk) {
+    for (int i=0; i<walk->extra.len; i++) free(walk->extra.items[i].parents.items);
+    free(walk->extra.items);
+    free(walk->table);
+    free(walk->heap.items);
+    free(walk->graph_flags);
+    commit_graph_free(&walk->graph);
+}
+
+/// Appends the nodes of a commit's parents.
+bool walk_parents(Commit_Walk* walk, u32 id, bag<u32>* out) {
+    if (id < walk->graph.count) return graph_parents(&walk->graph, id, out);
+    auto commit = walk_extra(walk, id);
+    for (int i=0; i<commit->parents.len; i++) bag_add(out, commit->parents.items[i]);
+    return true;
+}
+
+Git_Oid walk_oid(Commit_Walk* walk, u32 id) {
+    if (id >= walk->graph.count) return walk_extra(walk, id)->oid;
+    auto layer = graph_layer(&walk->graph, id);
+    Git_Oid oid;
+    memcpy(oid.hash, layer->oids + (u64)(id - layer->base) * 20, 20);
+    return oid;
+}
+
+struct Ahead_Behind {
+    bool known;
+    int ahead;
+    int behind;
+};
+
+/// Whether the walk must go on. When walking by date, commits
+/// that were counted may yet be reached from a commit as old as
+/// them.
+bool walk_pending(Commit_Walk* walk) {
+    if (walk->heap.len == 0) return false;
+    if (walk->active > 0) return true;
+    return walk->by_date && walk_generation(walk, walk->heap.items[0]) >= walk->oldest_counted;
+}
+
+/// Counts the commits reachable from only one of the tips. The
+/// counts are not known if the walk hit the limit, or could not
+/// read a commit.
+optional<Ahead_Behind> ahead_behind(Git_State* git, Git_Oid* left, Git_Oid* right) {
+    Ahead_Behind out = {true, 0, 0};
+    if (memcmp(left->hash, right->hash, 20) == 0) return ok(out);
+
+    Commit_Walk walk;
+    walk_init(&walk, git);
+
+    bool complete =
+        walk_mark(&walk, walk_node(&walk, left), WALK_LEFT) &&
+        walk_mark(&walk, walk_node(&walk, right), WALK_RIGHT);
+
+    auto parents = create_bag<u32>(4);
+    while (complete && walk_pending(&walk)) {
+        u32 id = heap_pop(&walk);
+        auto flags = walk_flags(&walk, id);
+        u8 tips = *flags & WALK_BOTH;
+        *flags |= WALK_DONE;
+
+        if (tips != WALK_BOTH) {
+            walk.active--;
+            if (tips == WALK_LEFT) walk.ahead++;
+            else walk.behind++;
+            u32 generation = walk_generation(&walk, id);
+            if (generation < walk.oldest_counted) walk.oldest_counted = generation;
+        }
+
+        parents.len = 0;
+        if (!walk_parents(&walk, id, &parents)) complete = false;
+        for (int i=0; complete && i<parents.len; i++) {
+            complete = walk_mark(&walk, parents.items[i], tips);
+        }
+    }
+
+    out.ahead = walk.ahead;
+    out.behind = walk.behind;
+    walk_free(&walk);
+    free(parents.items);
+
+    if (!complete) out = {false, 0, 0};
+    return ok(out);
+}
+
+/// How far HEAD is ahead of and behind the current branch's
+/// upstream. Fails if there is no upstream, or it doesn't exist.
+optional<Ahead_Behind> git_ahead_behind(Git_State* git) {
+    auto upstream = git_upstream_ref(git);
+    if (upstream.error) return error(upstream.error);
+
+    auto head = git_resolve_ref(git, "HEAD");
+    auto base = git_resolve_ref(git, upstream.value.text);
+    free((void*)upstream.value.text);
+    if (head.error) return error(head.error);
+    if (base.error) return error(base.error);
+
+    return ahead_behind(git, &head.value, &base.value);
+}
+
+/// The annotated tag on the most recent commit reachable from
+/// HEAD, found by walking back from HEAD in order of decreasing
+/// generation. Fails if there is none, or the walk hit the limit.
+optional<string> git_nearest_tag(Git_State* git) {
+    auto head = git_resolve_ref(git, "HEAD");
+    if (head.error) return error(head.error);
+
+    auto tags = git_annotated_tags(git);
+    if (tags.len == 0) {
+        free(tags.items);
+        return error("No annotated tags");
+    }
+
+    Commit_Walk walk;
+    walk_init(&walk, git);
+    auto parents = create_bag<u32>(4);
+
+    Git_Tag* found = 0;
+    bool complete = walk_mark(&walk, walk_node(&walk, &head.value), WALK_LEFT);
+    while (complete && found == 0 && walk.heap.len > 0) {
+        u32 id = heap_pop(&walk);
+        *walk_flags(&walk, id) |= WALK_DONE;
+
+        Git_Tag key;
+        key.commit = walk_oid(&walk, id);
+        found = (Git_Tag*)bsearch(&key, tags.items, tags.len, sizeof(Git_Tag), compare_tag_commit);
+
+        parents.len = 0;
+        if (!walk_parents(&walk, id, &parents)) complete = false;
+        for (int i=0; complete && i<parents.len; i++) {
+            complete = walk_mark(&walk, parents.items[i], WALK_LEFT);
+        }
+    }
+
+    string name = found ? found->name : string{0};
+    for (int i=0; i<tags.len; i++) {
+        if (&tags.items[i] != found) free((void*)tags.items[i].name.text);
+    }
+    free(tags.items);
+    free(parents.items);
+    walk_free(&walk);
+
+    if (found == 0) return error(complete ? "No tag reachable from HEAD" : "Walk incomplete");
+    return ok(name);
+}
+
+#endif
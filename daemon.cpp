@@ -0,0 +1,567 @@
+#ifndef subline_daemon
+#define subline_daemon
+
+// Persistent render daemon.
+//
+// Included from main.cpp, after eval() and friends, because
+// the daemon drives the same rendering machinery.
+//
+// A request is a stream of NUL-terminated fields:
+//      cwd \0 NAME=VALUE \0 ... NAME=VALUE \0 \0 script bytes
+// terminated by the client shutting down its write end.
+// The client passes its stdout and stderr along with the
+// request (SCM_RIGHTS), so the forked worker writes the prompt
+// (and any errors) straight to them. The client simply waits
+// for the socket to close.
+//
+// Parsed scripts (keyed by a hash of their text), git state
+// (keyed by cwd, and only computed for scripts that use it) and
+// where in PATH the script's commands are stay resident in the
+// daemon. Every request is rendered in a forked
+// worker, so a script calling exit() on an error never takes the
+// daemon down with it.
+//
+// The client hands over its environment and its terminal, so
+// both ends make sure the other runs as the same user, and the
+// socket is only ever put in a directory nobody else can write
+// to.
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <signal.h>
+
+extern char** environ;
+
+// Requests are read by the daemon itself, so a client that
+// stalls mustn't hold up everybody else's prompts for long.
+#define DAEMON_REQUEST_TIMEOUT_MS 250
+
+// Past these, new scripts are parsed by the worker, and new
+// repositories aren't remembered.
+#define DAEMON_MAX_SCRIPTS 64
+#define DAEMON_MAX_REPOS   256
+
+/// Directory for the socket when there's no XDG_RUNTIME_DIR.
+string socket_fallback_dir() {
+    return stringf("/tmp/subline-%d", getuid());
+}
+
+string socket_path() {
+    auto custom = env_var("SUBLINE_SOCKET");
+    if (custom.error == 0) return custom.value;
+    auto runtime = env_var("XDG_RUNTIME_DIR");
+    if (runtime.error == 0) return stringf(FSTR "/subline.sock", FARG(runtime.value));
+    auto dir = socket_fallback_dir();
+    auto path = stringf(FSTR "/subline.sock", FARG(dir));
+    free((void*)dir.text);
+    return path;
+}
+
+/// Whether the directory holding the socket is ours, and only
+/// ours to write to. Symlinks aren't followed.
+bool socket_dir_private(const char* socket) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s", socket);
+    auto slash = strrchr(dir, '/');
+    if (slash == 0) snprintf(dir, sizeof(dir), ".");
+    else if (slash == dir) dir[1] = 0;
+    else *slash = 0;
+
+    struct stat st;
+    return lstat(dir, &st) == 0 && S_ISDIR(st.st_mode) && st.st_uid == getuid() && (st.st_mode & 022) == 0;
+}
+
+optional<sockaddr_un> socket_address() {
+    auto path = socket_path();
+    sockaddr_un addr = {0};
+    addr.sun_family = AF_UNIX;
+    if (path.len >= (int)sizeof(addr.sun_path)) return error("Socket path too long");
+    fill_charp(path, addr.sun_path);
+    return ok(addr);
+}
+
+/// Whether the process at the other end of a socket runs as
+/// the same user.
+bool socket_peer_trusted(int sock) {
+    ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(sock, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) return false;
+    return cred.uid == getuid();
+}
+
+/// Connects to a running daemon.
+/// Returns -1 if there is no daemon to connect to, or it can't
+/// be trusted.
+int socket_connect() {
+    auto addr = socket_address();
+    if (addr.error) return -1;
+    if (!socket_dir_private(addr.value.sun_path)) return -1;
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1) return -1;
+    if (connect(sock, (sockaddr*)&addr.value, sizeof(addr.value)) != 0 || !socket_peer_trusted(sock)) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+struct Daemon_Request {
+    char* buffer;
+    string cwd;
+    char** env;
+    string script;
+    int out;
+    int err;
+};
+
+/// Value of a variable in the client's environment, or 0.
+const char* request_env(Daemon_Request* req, const char* name) {
+    int len = strlen(name);
+    for (int i=0; req->env[i] != 0; i++) {
+        if (strncmp(req->env[i], name, len) == 0 && req->env[i][len] == '=') return req->env[i] + len + 1;
+    }
+    return 0;
+}
+
+/// Closes the descriptors received with a request, if any.
+void close_request_fds(Daemon_Request* req) {
+    if (req->out != -1) close(req->out);
+    if (req->err != -1) close(req->err);
+    req->out = -1;
+    req->err = -1;
+}
+
+/// Reads an entire request, along with the two file
+/// descriptors that accompany it.
+optional<Daemon_Request> read_request(int sock) {
+    Daemon_Request req = {0};
+    req.out = -1;
+    req.err = -1;
+
+    size_t buffer_size = CHUNK_SIZE;
+    size_t total_size = 0;
+    req.buffer = (char*)malloc(buffer_size);
+
+    while (true) {
+        if (total_size == buffer_size) {
+            buffer_size *= 2;
+            req.buffer = (char*)realloc(req.buffer, buffer_size);
+        }
+
+        iovec iov = {req.buffer+total_size, buffer_size-total_size};
+        char control[CMSG_SPACE(sizeof(int)*2)];
+        msghdr msg = {0};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ssize_t bytes_read = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (bytes_read == -1 && errno == EINTR) continue;
+        if (bytes_read <= 0) {
+            if (bytes_read == 0) break;
+            close_request_fds(&req);
+            free(req.buffer);
+            return error("Failed to read request");
+        }
+
+        for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg != 0; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+            // Whatever was received is ours to close, even if it
+            // isn't the expected pair.
+            int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            int fds[2];
+            if (cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+                for (int i=0; i<count; i++) {
+                    int fd;
+                    memcpy(&fd, CMSG_DATA(cmsg) + i*sizeof(int), sizeof(int));
+                    close(fd);
+                }
+                continue;
+            }
+            // A later pair replaces an earlier one.
+            close_request_fds(&req);
+            memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+            req.out = fds[0];
+            req.err = fds[1];
+        }
+
+        total_size += bytes_read;
+    }
+
+    if (req.out == -1) {
+        free(req.buffer);
+        return error("Request did not include output descriptors");
+    }
+
+    auto data = string{req.buffer, (int)total_size};
+    int idx = 0;
+    int field = 0;
+    bag<char*> env = create_bag<char*>(64);
+
+    while (idx < data.len) {
+        int start = idx;
+        while (idx < data.len && data.text[idx] != 0) idx++;
+        if (idx == data.len) break;
+        idx++;
+
+        if (field == 0) {
+            req.cwd = string{data.text+start, idx-start-1};
+        } else if (idx-start == 1) {
+            break;
+        } else {
+            bag_add(&env, req.buffer+start);
+        }
+        field++;
+    }
+
+    if (field == 0) {
+        free(req.buffer);
+        free(env.items);
+        close_request_fds(&req);
+        return error("Malformed request");
+    }
+
+    bag_add(&env, (char*)0);
+    req.env = env.items;
+    req.script = slice(&data, idx, data.len);
+    return ok(req);
+}
+
+struct Script_Entry {
+    u64 hash;
+    Subline_Tokenizer* tokenizer;
+    bag<AST_Node*> statements;
+    u32 providers;
+    // Commands that stdout() runs, found in PATH before forking.
+    bag<string> commands;
+};
+
+struct Repo_Entry {
+    string cwd;
+    optional<Git_State> git;
+    timespec head_mtime;
+    // The directories from cwd up to the root of the worktree,
+    // any of which a new repository could be made in.
+    u64 dirs_stamp;
+};
+
+bag<Script_Entry> daemon_scripts;
+bag<Repo_Entry> daemon_repos;
+
+/// Finds or parses the script of a request.
+/// New scripts are first parsed in a throwaway child, so that
+/// a syntax error (which exits) is reported to the client's
+/// stderr instead of killing the daemon. Returns 0 when there's
+/// no room left for another script.
+optional<Script_Entry*> daemon_script(Daemon_Request* req) {
+    auto h = hash(&req->script);
+    for (int i=0; i<daemon_scripts.len; i++) {
+        auto entry = &daemon_scripts.items[i];
+        if (entry->hash == h) return ok(entry);
+    }
+    if (daemon_scripts.len >= DAEMON_MAX_SCRIPTS) return ok((Script_Entry*)0);
+
+    pid_t pid = fork();
+    if (pid == -1) return error("Fork failed");
+    if (pid == 0) {
+        dup2(req->err, STDERR_FILENO);
+        auto st = Subline_Tokenizer(req->script);
+        parse_script(&st);
+        _exit(0);
+    }
+
+    int status;
+    pid_t waited;
+    while ((waited = waitpid(pid, &status, 0)) == -1 && errno == EINTR) {}
+    if (waited == -1) return error("waitpid() failed");
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) return error("Script failed to parse");
+
+    Script_Entry entry;
+    entry.hash = h;
+    entry.tokenizer = (Subline_Tokenizer*)malloc(sizeof(Subline_Tokenizer));
+    *entry.tokenizer = Subline_Tokenizer(copy(&req->script));
+    entry.statements = parse_script(entry.tokenizer);
+    entry.providers = script_providers(&entry.statements);
+
+    bag<AST_Call*> calls = create_bag<AST_Call*>(4);
+    prefetch_calls(&entry.statements, &calls);
+    entry.commands = create_bag<string>(calls.len + 1);
+    for (int i=0; i<calls.len; i++) {
+        auto first = calls.items[i]->params->values.items[0];
+        if (first->kind != AT_STRING) continue;
+        bag_add(&entry.commands, unquote(replace_escapes(&to_value(first)->token)));
+    }
+    free(calls.items);
+
+    bag_add(&daemon_scripts, entry);
+    return ok(&daemon_scripts.items[daemon_scripts.len-1]);
+}
+
+bool head_mtime(Git_State* git, timespec* out) {
+    char path[PATH_MAX];
+    git_path(git->git_dir, "HEAD", path);
+    struct stat st;
+    if (stat(path, &st) != 0) return false;
+    *out = st.st_mtim;
+    return true;
+}
+
+/// A hash of the mtimes of cwd and its ancestors, up to but not
+/// including the root of the worktree. Making a repository in
+/// any of them changes it.
+u64 dirs_stamp(string cwd, string root) {
+    bag<char> stamps = create_bag<char>(128);
+    char path[PATH_MAX];
+    fill_charp(cwd, path);
+    int len = cwd.len;
+    while (len > root.len && len > 1) {
+        path[len] = 0;
+        char stamp[64];
+        struct stat st;
+        if (stat(path, &st) == 0) {
+            snprintf(stamp, sizeof(stamp), "%lx.%lx ", (unsigned long)st.st_mtim.tv_sec, (unsigned long)st.st_mtim.tv_nsec);
+        } else {
+            snprintf(stamp, sizeof(stamp), "- ");
+        }
+        for (int i=0; stamp[i] != 0; i++) bag_add(&stamps, stamp[i]);
+        while (len > 1 && path[len-1] != '/') len--;
+        if (len > 1) len--;
+    }
+    auto text = string{stamps.items, stamps.len};
+    u64 h = hash(&text);
+    free(stamps.items);
+    return h;
+}
+
+/// Returns the git state of a directory, reusing the result of
+/// an earlier request as long as the repository's HEAD is
+/// unchanged, and no repository was made in between. Negative
+/// results are not cached, since any ancestor could become a
+/// repository at any moment.
+optional<Git_State> daemon_git(string cwd) {
+    for (int i=0; i<daemon_repos.len; i++) {
+        auto entry = &daemon_repos.items[i];
+        if (!equal(&entry->cwd, &cwd)) continue;
+
+        timespec mtime;
+        if (head_mtime(&entry->git.value, &mtime)) {
+            if (mtime.tv_sec == entry->head_mtime.tv_sec && mtime.tv_nsec == entry->head_mtime.tv_nsec &&
+                    dirs_stamp(cwd, entry->git.value.dir) == entry->dirs_stamp) {
+                return entry->git;
+            }
+        }
+
+        // HEAD moved (or the repository is gone), so start over.
+        bag_remove(&daemon_repos, i);
+        break;
+    }
+
+    auto git = git_state(cwd);
+    if (git.error) return git;
+
+    Repo_Entry entry;
+    entry.cwd = copy(&cwd);
+    entry.git = git;
+    entry.dirs_stamp = dirs_stamp(cwd, git.value.dir);
+    if (daemon_repos.len < DAEMON_MAX_REPOS && head_mtime(&git.value, &entry.head_mtime)) {
+        bag_add(&daemon_repos, entry);
+    } else {
+        free((void*)entry.cwd.text);
+    }
+    return git;
+}
+
+void daemon_serve(int client) {
+    auto req_opt = read_request(client);
+    if (req_opt.error) {
+        warn("subline: %s\n", req_opt.error);
+        return;
+    }
+    auto req = req_opt.value;
+
+    auto script = daemon_script(&req);
+    if (script.error == 0) {
+        // Only scripts that can reach git info pay for it. Those
+        // that aren't kept are left to the worker entirely.
+        auto entry = script.value;
+        bool needs_git = entry != 0 && (entry->providers & PV_GIT);
+        optional<Git_State> git = {0};
+        string type = {0};
+        FS_POLICY policy = FSP_PROBE;
+        if (needs_git) {
+            auto type_opt = fs_type(req.cwd);
+            if (type_opt.error == 0) type = type_opt.value;
+            policy = fs_policy(type, request_env(&req, "SUBLINE_REMOTE_FS"));
+        }
+        // Repositories with any other policy are left to the
+        // child, so a hung mount never blocks the daemon itself.
+        bool looked_up = needs_git && policy == FSP_PROBE;
+        if (looked_up) git = daemon_git(req.cwd);
+        if (entry != 0 && entry->commands.len > 0) {
+            command_paths_warm(request_env(&req, "PATH"), entry->commands.items, entry->commands.len);
+        }
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            signal(SIGCHLD, SIG_DFL);
+            dup2(req.out, STDOUT_FILENO);
+            dup2(req.err, STDERR_FILENO);
+            environ = req.env;
+
+            char cwd[PATH_MAX];
+            fill_charp(req.cwd, cwd);
+            if (chdir(cwd) != 0) {
+                warn("subline: Failed to enter %s: %s\n", cwd, strerror(errno));
+                exit(1);
+            }
+
+            state.cwd = req.cwd;
+            state.loaded = PV_CWD;
+            if (needs_git) {
+                state.fs_type = type;
+                state.fs_policy = policy;
+                state.loaded |= PV_FS;
+            }
+            if (looked_up) {
+                state.git = git;
+                state.loaded |= PV_GIT;
+            }
+            if (entry == 0) {
+                auto st = Subline_Tokenizer(req.script);
+                auto stmts = load_script(&st);
+                render(&stmts);
+            } else {
+                render(&entry->statements);
+            }
+            exit(0);
+        }
+        if (pid == -1) warn("subline: Fork failed! %s\n", strerror(errno));
+        free((void*)type.text);
+    }
+
+    close(req.out);
+    close(req.err);
+    free(req.env);
+    free(req.buffer);
+}
+
+/// Only there to interrupt accept(), so that workers are reaped
+/// as soon as they exit.
+void daemon_child_exited(int) {}
+
+int daemon_main() {
+    auto addr_opt = socket_address();
+    addr_opt.die_on_error();
+    auto addr = addr_opt.value;
+
+    if (env_var("SUBLINE_SOCKET").error && env_var("XDG_RUNTIME_DIR").error) {
+        auto dir = socket_fallback_dir();
+        mkdir(dir.text, 0700);
+        free((void*)dir.text);
+    }
+    if (!socket_dir_private(addr.sun_path)) {
+        warn("subline: The directory of %s must belong to you, and be writable only by you\n", addr.sun_path);
+        return 1;
+    }
+
+    int existing = socket_connect();
+    if (existing != -1) {
+        close(existing);
+        warn("subline: A daemon is already listening on %s\n", addr.sun_path);
+        return 1;
+    }
+    unlink(addr.sun_path);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    assert(sock != -1, "Failed to create socket: %s\n", strerror(errno));
+    assert(bind(sock, (sockaddr*)&addr, sizeof(addr)) == 0, "Failed to bind %s: %s\n", addr.sun_path, strerror(errno));
+    assert(listen(sock, 64) == 0, "Failed to listen: %s\n", strerror(errno));
+
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction reap = {0};
+    reap.sa_handler = daemon_child_exited;
+    sigaction(SIGCHLD, &reap, 0);
+
+    daemon_scripts = create_bag<Script_Entry>(8);
+    daemon_repos = create_bag<Repo_Entry>(32);
+
+    timeval timeout = {DAEMON_REQUEST_TIMEOUT_MS / 1000, (DAEMON_REQUEST_TIMEOUT_MS % 1000) * 1000};
+    while (true) {
+        int client = accept4(sock, 0, 0, SOCK_CLOEXEC);
+
+        // Reap finished workers. Their results were already
+        // written to the client, so the status is of no interest.
+        while (waitpid(-1, 0, WNOHANG) > 0) {}
+
+        if (client == -1) continue;
+        if (!socket_peer_trusted(client)) {
+            close(client);
+            continue;
+        }
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        daemon_serve(client);
+        close(client);
+    }
+}
+
+/// Sends the script to the daemon and waits for it to render.
+/// Falls back to rendering in-process if no daemon is running.
+int client_main(string subline) {
+    int sock = socket_connect();
+    if (sock == -1) return render_local(subline);
+
+    string cwd;
+    REQUIRED(cwd, cwd_str());
+
+    int env_count = 0;
+    while (environ[env_count] != 0) env_count++;
+
+    int count = env_count + 3;
+    string fields[count];
+    fields[0] = string{cwd.text, cwd.len+1};
+    for (int i=0; i<env_count; i++) {
+        auto var = to_string(environ[i]);
+        fields[i+1] = string{var.text, var.len+1};
+    }
+    fields[env_count+1] = string{"", 1};
+    fields[env_count+2] = subline;
+    auto request = concat(fields, count);
+
+    int fds[2] = {STDOUT_FILENO, STDERR_FILENO};
+    char control[CMSG_SPACE(sizeof(fds))] = {0};
+    iovec iov = {(void*)request.text, (size_t)request.len};
+    msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    ssize_t sent = sendmsg(sock, &msg, 0);
+    if (sent == -1) {
+        close(sock);
+        return render_local(subline);
+    }
+
+    while (sent < request.len) {
+        ssize_t res = write(sock, request.text+sent, request.len-sent);
+        assert(res > 0, "Failed to send request: %s\n", strerror(errno));
+        sent += res;
+    }
+    shutdown(sock, SHUT_WR);
+
+    // The worker holds the socket until it is done rendering.
+    char buf[64];
+    while (read(sock, buf, sizeof(buf)) > 0) {}
+    close(sock);
+    return 0;
+}
+
+#endif
@@ -0,0 +1,440 @@
+#ifndef subline_emit_cpp
+#define subline_emit_cpp
+
+// Ahead-of-time compilation of a script into C++.
+//
+// Included from main.cpp, after do_call() and eval(), whose
+// behavior the generated code mirrors. Every node becomes a few
+// straight-line statements that store its value in a numbered
+// variable. Literals are decoded, colors are resolved and builtins
+// are picked while emitting, so the generated program never
+// tokenizes, parses or compares function names. cwd and git
+// info are computed on first use, just like when interpreting.
+//
+// The generated file includes main.cpp (with SUBLINE_NO_MAIN
+// defined) for the runtime, so it is built with something like:
+//      g++ -O2 -pthread -I/path/to/subline prompt.cpp -o prompt -lz
+
+struct Cpp_Prefetch {
+    Token* call;
+    // Number of the command's variable.
+    int id;
+};
+
+struct Cpp_Emitter {
+    int indent;
+    int counter;
+    // stdout() calls started at the top, see prefetch.cpp.
+    bag<Cpp_Prefetch> prefetched;
+};
+
+void emit_line(Cpp_Emitter* e, const char* fmt, ...) __attribute__ ((format (printf, 2, 3)));
+void emit_line(Cpp_Emitter* e, const char* fmt, ...) {
+    print("%*s", e->indent*4, "");
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stdout, fmt, args);
+    va_end(args);
+    print("\n");
+}
+
+/// Declares a new variable, and returns its name.
+string emit_var(Cpp_Emitter* e, const char* fmt, ...) __attribute__ ((format (printf, 2, 3)));
+string emit_var(Cpp_Emitter* e, const char* fmt, ...) {
+    auto name = stringf("v%d", e->counter++);
+    va_list args;
+    va_start(args, fmt);
+    char* value;
+    vasprintf(&value, fmt, args);
+    va_end(args);
+    emit_line(e, "string " FSTR " = %s;", FARG(name), value);
+    free(value);
+    return name;
+}
+
+/// Turns a string into a C++ expression that creates it.
+/// Anything that is not printable ASCII is written as
+/// an octal escape, which can never run into the next
+/// character the way hex escapes can.
+string cpp_string(string str) {
+    if (str.text == 0) return const_string("string{0}");
+
+    auto text = (char*)malloc(str.len*4 + 1);
+    int len = 0;
+    for (int i=0; i<str.len; i++) {
+        u8 ch = str.text[i];
+        if (ch == '"' || ch == '\\') {
+            text[len++] = '\\';
+            text[len++] = ch;
+        } else if (ch >= ' ' && ch < 127 && ch != '?') {
+            text[len++] = ch;
+        } else {
+            len += sprintf(text+len, "\\%03o", ch);
+        }
+    }
+    text[len] = 0;
+
+    auto out = stringf("string{\"%s\", %d}", text, str.len);
+    free(text);
+    return out;
+}
+
+string cpp_color(Color col) {
+    return stringf("Color{%s, %ld}", col.type == CT_HEX ? "CT_HEX" : "CT_SGR", (long)col.value);
+}
+
+string emit_node(Cpp_Emitter* e, AST_Node* node);
+
+/// Emits an array of the positional arguments of a stdout()
+/// call, and returns its number.
+int emit_command_args(Cpp_Emitter* e, Token* fn_name, bag<AST_Node*>* args, int* count) {
+    string strs[args->len];
+    *count = 0;
+    for (int i=0; i<args->len; i++) {
+        if (args->items[i]->kind == AT_PARAM_NAMED) continue;
+        strs[(*count)++] = emit_node(e, args->items[i]);
+    }
+    if (*count == 0) { FN_ERROR(fn_name, "expects a command%s", ""); }
+
+    int id = e->counter++;
+    emit_line(e, "string args%d[] = {", id);
+    for (int i=0; i<*count; i++) {
+        emit_line(e, "    " FSTR ",", FARG(strs[i]));
+    }
+    emit_line(e, "};");
+    return id;
+}
+
+/// An expression that starts a stdout() call, whose arguments
+/// are in args<id>. Mirrors stdout_start().
+string cpp_command_start(Token* fn_name, bag<AST_Node*>* args, int id, int count) {
+    auto timeout = command_timeout(fn_name, args);
+    auto cache = stdout_cache(fn_name, args);
+    if (!cache.enabled) return stringf("command_start(args%d, %d, %d)", id, count, timeout);
+    return stringf(
+        "command_start(args%d, %d, %d, command_cache_open(args%d, %d, *state_cwd(&state), " FSTR ", " FSTR ", %ld, %s))",
+        id, count, timeout, id, count, FARG(cpp_string(cache.env)), FARG(cpp_string(cache.watch)), (long)cache.ttl,
+        cache.background ? "true" : "false");
+}
+
+/// Mirrors do_call(), but resolves the builtin while emitting.
+string emit_call(Cpp_Emitter* e, Token* fn_name, bag<AST_Node*>* args) {
+    auto fn_name_str = token_text(fn_name);
+
+    if (equal(&fn_name_str, "text")) {
+        ARG_COUNT(1);
+        auto value = ARG_TYPE(0, AT_STRING, AT_COLOR, AT_IDENT);
+        emit_line(e, "text_apply(&state, " FSTR ");", FARG(cpp_color(string_to_color(value))));
+        return emit_var(e, "{0}");
+
+    } else if (equal(&fn_name_str, "bg")) {
+        ARG_COUNT(1);
+        auto value = ARG_TYPE(0, AT_STRING, AT_COLOR, AT_IDENT);
+        emit_line(e, "bg_apply(&state, " FSTR ");", FARG(cpp_color(string_to_color(value))));
+        return emit_var(e, "{0}");
+
+    } else if (equal(&fn_name_str, "cap")) {
+        ARG_COUNT(3);
+        auto cap_arg = emit_node(e, ARG_TYPE_RAW(0, AT_STRING, AT_IDENT));
+        auto text = cpp_color(string_to_color(ARG_NAMED("text", AT_IDENT, AT_STRING, AT_COLOR)));
+        auto bg = cpp_color(string_to_color(ARG_NAMED("bg", AT_IDENT, AT_STRING, AT_COLOR)));
+
+        emit_line(e, "text_apply(&state, " FSTR ");", FARG(bg));
+        emit_line(e, "print(FSTR, FARG(" FSTR "));", FARG(cap_arg));
+        emit_line(e, "text_apply(&state, " FSTR ");", FARG(text));
+        emit_line(e, "bg_apply(&state, " FSTR ");", FARG(bg));
+        return emit_var(e, "{0}");
+
+    } else if (equal(&fn_name_str, "arrow")) {
+        ARG_COUNT(3);
+        auto arrow_arg = emit_node(e, ARG_TYPE_RAW(0, AT_STRING, AT_IDENT));
+        auto text = cpp_color(string_to_color(ARG_NAMED("text", AT_IDENT, AT_STRING, AT_COLOR)));
+        auto bg = cpp_color(string_to_color(ARG_NAMED("bg", AT_IDENT, AT_STRING, AT_COLOR)));
+
+        emit_line(e, "text_apply(&state, state.style.bg);");
+        emit_line(e, "bg_apply(&state, " FSTR ");", FARG(bg));
+        emit_line(e, "print(FSTR, FARG(" FSTR "));", FARG(arrow_arg));
+        emit_line(e, "text_apply(&state, " FSTR ");", FARG(text));
+        emit_line(e, "bg_apply(&state, " FSTR ");", FARG(bg));
+        return emit_var(e, "{0}");
+
+    } else if (equal(&fn_name_str, "env")) {
+        ARG_COUNT(1);
+        auto value = ARG_TYPE(0, AT_IDENT, AT_STRING);
+        return emit_var(e, "env_value(" FSTR ")", FARG(cpp_string(value)));
+
+    } else if (equal(&fn_name_str, "stdout")) {
+        ARG_COUNT_MIN(1);
+        int id = -1;
+        for (int i=0; i<e->prefetched.len; i++) {
+            if (e->prefetched.items[i].call == fn_name) id = e->prefetched.items[i].id;
+        }
+        if (id != -1) {
+            emit_line(e, "auto res%d = command_finish(cmd%d);", id, id);
+        } else {
+            int count;
+            id = emit_command_args(e, fn_name, args, &count);
+            emit_line(e, "auto res%d = command_finish(" FSTR ");", id, FARG(cpp_command_start(fn_name, args, id, count)));
+        }
+        auto out = emit_var(e, "trim(&res%d.out)", id);
+
+        // Only evaluated when the command runs out of time.
+        auto fallback = named_param_find(args, "fallback");
+        emit_line(e, "if (res%d.timed_out) {", id);
+        e->indent++;
+        auto value = fallback.error ? emit_var(e, "{0}") : emit_node(e, fallback.value->value);
+        emit_line(e, FSTR " = " FSTR ";", FARG(out), FARG(value));
+        e->indent--;
+        emit_line(e, "}");
+        return out;
+
+    } else if (equal(&fn_name_str, "_")) {
+        return emit_var(e, "to_string(\" \")");
+
+    } else if (style_builtin(&fn_name_str) != 0) {
+        ARG_COUNT(0);
+        auto style = style_builtin(&fn_name_str);
+        for (int i=0; i<STYLE_BUILTINS; i++) {
+            if (&STYLE_BUILTIN[i] != style) continue;
+            // Looked up by index, so the generated code calls the
+            // very same function the interpreter would.
+            emit_line(e, "STYLE_BUILTIN[%d].apply(&state);", i);
+        }
+        return emit_var(e, "{0}");
+
+    } else if (equal(&fn_name_str, "dir")) {
+        ARG_COUNT(0);
+        return emit_var(e, "dir_string(&state)");
+
+    } else if (equal(&fn_name_str, "in-git-repo")) {
+        ARG_COUNT(0);
+        return emit_var(e, "state_git(&state)->error == 0 ? SBLN_TRUE : SBLN_FALSE");
+
+    } else if (equal(&fn_name_str, "git-branch")) {
+        ARG_COUNT(0);
+        return emit_var(e, "state_git_branch(&state)");
+
+    } else if (equal(&fn_name_str, "git-dirty")) {
+        ARG_COUNT(0);
+        return emit_var(e, "state_git_dirty(&state) ? SBLN_TRUE : SBLN_FALSE");
+
+    } else if (equal(&fn_name_str, "git-commit")) {
+        ARG_COUNT(0);
+        return emit_var(e, "state_git_commit(&state)");
+
+    } else if (equal(&fn_name_str, "git-subject")) {
+        ARG_COUNT(0);
+        return emit_var(e, "state_git_subject(&state)");
+
+    } else if (equal(&fn_name_str, "git-tag")) {
+        ARG_COUNT(0);
+        return emit_var(e, "state_git_tag(&state)");
+
+    } else if (equal(&fn_name_str, "git-untracked")) {
+        ARG_COUNT(0);
+        return emit_var(e, "state_git_untracked(&state, false) > 0 ? SBLN_TRUE : SBLN_FALSE");
+
+    } else if (equal(&fn_name_str, "git-untracked-count")) {
+        ARG_COUNT(0);
+        return emit_var(e, "to_string(state_git_untracked(&state, true))");
+
+    } else if (equal(&fn_name_str, "git-conflicts")) {
+        ARG_COUNT(0);
+        return emit_var(e, "state_git_conflicts(&state)");
+
+    } else if (equal(&fn_name_str, "git-staged")) {
+        ARG_COUNT(0);
+        return emit_var(e, "state_git_staged(&state)");
+
+    } else if (equal(&fn_name_str, "git-state")) {
+        ARG_COUNT(0);
+        return emit_var(e, "state_git_operation(&state)");
+
+    } else if (equal(&fn_name_str, "fs-remote")) {
+        ARG_COUNT(0);
+        return emit_var(e, "state_fs_remote(&state)");
+
+    } else if (equal(&fn_name_str, "vcs-root")) {
+        ARG_COUNT(0);
+        return emit_var(e, "state_vcs_root(&state)");
+
+    } else if (equal(&fn_name_str, "vcs-kind")) {
+        ARG_COUNT(0);
+        return emit_var(e, "state_vcs_kind(&state)");
+
+    } else if (equal(&fn_name_str, "vcs-branch")) {
+        ARG_COUNT(0);
+        return emit_var(e, "state_vcs_branch(&state)");
+
+    } else if (equal(&fn_name_str, "git-ahead")) {
+        ARG_COUNT(0);
+        return emit_var(e, "upstream_count(&state, true)");
+
+    } else if (equal(&fn_name_str, "git-behind")) {
+        ARG_COUNT(0);
+        return emit_var(e, "upstream_count(&state, false)");
+
+    } else if (equal(&fn_name_str, "git-root")) {
+        ARG_COUNT(0);
+        return emit_var(e, "state_git(&state)->error == 0 ? state.git.value.dir : string{0}");
+
+    } else if (equal(&fn_name_str, "git-dir")) {
+        ARG_COUNT(0);
+        return emit_var(e, "git_dir_string(&state)");
+
+    } else if (equal(&fn_name_str, "not")) {
+        ARG_COUNT(1);
+        auto val = emit_node(e, args->items[0]);
+        return emit_var(e, "equal(&" FSTR ", &SBLN_TRUE) ? SBLN_FALSE : SBLN_TRUE", FARG(val));
+
+    } else if (equal(&fn_name_str, "eq")) {
+        ARG_COUNT(2);
+        auto arg1 = emit_node(e, args->items[0]);
+        auto arg2 = emit_node(e, args->items[1]);
+        return emit_var(e, "equal(&" FSTR ", &" FSTR ") ? SBLN_TRUE : SBLN_FALSE", FARG(arg1), FARG(arg2));
+
+    } else if (equal(&fn_name_str, "starts")) {
+        ARG_COUNT(2);
+        auto arg1 = emit_node(e, args->items[0]);
+        auto arg2 = emit_node(e, args->items[1]);
+        return emit_var(e, "starts(&" FSTR ", &" FSTR ") ? SBLN_TRUE : SBLN_FALSE", FARG(arg1), FARG(arg2));
+
+    } else if (equal(&fn_name_str, "strip-prefix")) {
+        ARG_COUNT(2);
+        auto arg1 = emit_node(e, args->items[0]);
+        auto arg2 = emit_node(e, args->items[1]);
+        return emit_var(e, "strip_prefix(&" FSTR ", &" FSTR ")", FARG(arg1), FARG(arg2));
+    }
+
+    GENERIC_ERROR(fn_name, "Unhandled call: " FSTR, FARG(fn_name_str));
+}
+
+/// Mirrors eval(). Emits the statements that compute the value
+/// of the node, and returns the name of the variable holding it.
+string emit_node(Cpp_Emitter* e, AST_Node* node) {
+    switch (node->kind) {
+    case AT_IDENT: {
+        auto val = to_value(node);
+        return emit_call(e, &val->token, 0);
+    } break;
+
+    case AT_STRING: {
+        auto val = to_value(node);
+        return emit_var(e, FSTR, FARG(cpp_string(unquote(replace_escapes(&val->token)))));
+    } break;
+
+    case AT_COLOR:
+    case AT_NUMBER: {
+        return emit_var(e, FSTR, FARG(cpp_string(token_text(&to_value(node)->token))));
+    } break;
+
+    case AT_ENV: {
+        auto val = token_text(&to_value(node)->token);
+        val.text++; val.len--;
+        return emit_var(e, "env_value(" FSTR ")", FARG(cpp_string(val)));
+    } break;
+
+    case AT_CALL: {
+        auto val = to_call(node);
+        auto params = val->params->values;
+        return emit_call(e, &val->ident, &params);
+    } break;
+
+    case AT_BLOCK: {
+        auto block = to_block(node);
+        auto out = emit_var(e, "{0}");
+        int id = e->counter++;
+
+        emit_line(e, "{");
+        e->indent++;
+        emit_line(e, "auto old_style%d = state.style;", id);
+        if (block->params.error == 0) {
+            auto params = block->params.value;
+            for (int i=0; i<params->values.len; i++) {
+                emit_node(e, params->values.items[i]);
+            }
+        }
+        emit_line(e, "auto new_style%d = state.style;", id);
+        emit_line(e, "state.style = old_style%d;", id);
+        emit_line(e, "style_push(&state, new_style%d);", id);
+
+        for (int i=0; i<block->statements.len; i++) {
+            auto val = emit_node(e, block->statements.items[i]);
+            emit_line(e, "display(" FSTR ");", FARG(val));
+        }
+
+        emit_line(e, "style_pop(&state);");
+        e->indent--;
+        emit_line(e, "}");
+        return out;
+    } break;
+
+    case AT_IF: {
+        auto if_stmt = to_if(node);
+        auto out = emit_var(e, "{0}");
+        auto val = emit_node(e, if_stmt->condition);
+
+        emit_line(e, "if (equal(&" FSTR ", &SBLN_TRUE)) {", FARG(val));
+        e->indent++;
+        auto v = emit_node(e, if_stmt->body);
+        emit_line(e, "display(" FSTR ");", FARG(v));
+        emit_line(e, FSTR " = " FSTR ";", FARG(out), FARG(v));
+        e->indent--;
+
+        if (if_stmt->else_body.error == 0) {
+            emit_line(e, "} else {");
+            e->indent++;
+            auto v = emit_node(e, if_stmt->else_body.value);
+            emit_line(e, "display(" FSTR ");", FARG(v));
+            emit_line(e, FSTR " = " FSTR ";", FARG(out), FARG(v));
+            e->indent--;
+        }
+        emit_line(e, "}");
+        return out;
+    } break;
+
+    default: {
+        emit_line(e, "printf(\"[%%d]\", %d);", node->kind);
+        return emit_var(e, "{0}");
+    } break;
+    }
+}
+
+/// Writes a standalone C++ program that renders the script.
+void emit_cpp(const char* script_path, bag<AST_Node*>* stmts) {
+    Cpp_Emitter e = {0};
+
+    print("// Generated by subline --emit-cpp from %s\n", script_path);
+    print("// Build with: g++ -O2 -pthread -I/path/to/subline <this file> -o prompt -lz\n\n");
+    print("#define SUBLINE_NO_MAIN\n");
+    print("#include \"main.cpp\"\n\n");
+    print("int main() {\n");
+    e.indent++;
+    emit_line(&e, "state.style = default_style();");
+    emit_line(&e, "state.providers = 0x%x;", script_providers(stmts));
+    print("\n");
+
+    bag<AST_Call*> calls = create_bag<AST_Call*>(4);
+    prefetch_calls(stmts, &calls);
+    e.prefetched = create_bag<Cpp_Prefetch>(4);
+    for (int i=0; i<calls.len; i++) {
+        auto call = calls.items[i];
+        auto args = &call->params->values;
+        int count;
+        int id = emit_command_args(&e, &call->ident, args, &count);
+        emit_line(&e, "auto cmd%d = " FSTR ";", id, FARG(cpp_command_start(&call->ident, args, id, count)));
+        bag_add(&e.prefetched, Cpp_Prefetch{&call->ident, id});
+    }
+    if (calls.len > 0) print("\n");
+
+    for (int i=0; i<stmts->len; i++) {
+        auto val = emit_node(&e, stmts->items[i]);
+        emit_line(&e, "display(" FSTR ");", FARG(val));
+    }
+
+    print("\n");
+    emit_line(&e, "reset(&state);");
+    print("}\n");
+}
+
+#endif
@@ -0,0 +1,199 @@
+#ifndef subline_files
+#define subline_files
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "utils.cpp"
+
+bool dir_exists(char* path) {
+    DIR* dir = opendir(path);
+    if (dir != 0) {
+        closedir(dir);
+        return true;
+    }
+    return false;
+}
+
+/// Where subline keeps its caches: $XDG_CACHE_HOME/subline, or
+/// ~/.cache/subline. The directory may not exist yet.
+optional<string> cache_dir() {
+    auto cache_home = getenv("XDG_CACHE_HOME");
+    if (cache_home != 0 && cache_home[0] != 0) {
+        return ok(stringf("%s/subline", cache_home));
+    }
+    auto home = getenv("HOME");
+    if (home == 0) return error("Nowhere to put the cache");
+    return ok(stringf("%s/.cache/subline", home));
+}
+
+/// Writes a file in the cache directory, creating the directory
+/// if needed. The data goes to a temporary file that is renamed
+/// into place, so concurrent readers never see a partial file.
+bool cache_write(const char* name, const char* data, u64 size) {
+    auto dir = cache_dir();
+    if (dir.error) return false;
+    auto path = stringf(FSTR "/%s", FARG(dir.value), name);
+    auto tmp = stringf(FSTR ".%d.tmp", FARG(path), getpid());
+
+    int fd = open(tmp.text, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 && errno == ENOENT) {
+        auto parent = slice(&dir.value, 0, index_of(&dir.value, '/', -1));
+        auto parent_copy = copy(&parent);
+        mkdir(parent_copy.text, 0755);
+        mkdir(dir.value.text, 0755);
+        free((void*)parent_copy.text);
+        fd = open(tmp.text, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    }
+
+    bool complete = false;
+    if (fd != -1) {
+        u64 written = 0;
+        while (written < size) {
+            auto res = write(fd, data + written, size - written);
+            if (res <= 0) break;
+            written += res;
+        }
+        close(fd);
+        complete = written == size;
+        if (complete) rename(tmp.text, path.text);
+        else unlink(tmp.text);
+    }
+
+    free((void*)path.text);
+    free((void*)tmp.text);
+    free((void*)dir.value.text);
+    return complete;
+}
+
+/// Deletes the files in the cache directory whose names end in
+/// suffix, and that haven't been written for max_age seconds.
+/// The directory is only looked through once a day for each
+/// suffix, as noted by the mtime of a file named "<suffix>.pruned".
+void cache_prune(const char* suffix, s64 max_age) {
+    auto dir = cache_dir();
+    if (dir.error) return;
+    int dir_fd = open(dir.value.text, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free((void*)dir.value.text);
+    if (dir_fd == -1) return;
+
+    char marker[64];
+    snprintf(marker, sizeof(marker), "%s.pruned", suffix);
+    struct stat st;
+    time_t now = time(0);
+    if (fstatat(dir_fd, marker, &st, 0) == 0 && now - st.st_mtime < 24*60*60) {
+        close(dir_fd);
+        return;
+    }
+    int fd = openat(dir_fd, marker, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd != -1) close(fd);
+
+    DIR* entries = fdopendir(dup(dir_fd));
+    int suffix_len = strlen(suffix);
+    while (entries != 0) {
+        auto ent = readdir(entries);
+        if (ent == 0) break;
+        int len = strlen(ent->d_name);
+        if (len <= suffix_len || strcmp(ent->d_name + len - suffix_len, suffix) != 0) continue;
+        if (fstatat(dir_fd, ent->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+        if (S_ISREG(st.st_mode) && now - st.st_mtime > max_age) unlinkat(dir_fd, ent->d_name, 0);
+    }
+    if (entries != 0) closedir(entries);
+    close(dir_fd);
+}
+
+#define CHUNK_SIZE 1024
+
+string read_pipe(FILE* pipe) {
+    size_t buffer_size = CHUNK_SIZE;
+    char* pipe_text = (char*)malloc(buffer_size);
+
+    size_t total_size = 0;
+    ssize_t bytes_read;
+
+    while ((bytes_read = fread(pipe_text+total_size, 1, CHUNK_SIZE, pipe))) {
+        total_size += bytes_read;
+        if (total_size+CHUNK_SIZE > buffer_size) {
+            buffer_size *= 2;
+            pipe_text = (char*)realloc(pipe_text, buffer_size);
+        }
+    }
+    assert(bytes_read != -1, "Failed to read pipe!");
+
+    pipe_text[total_size] = 0;
+    return string{pipe_text, (int)total_size};
+}
+
+optional<string> read_pipe(int pipe) {
+    size_t buffer_size = CHUNK_SIZE;
+    char* pipe_text = (char*)malloc(buffer_size);
+
+    size_t total_size = 0;
+    ssize_t bytes_read;
+
+    while ((bytes_read = read(pipe, pipe_text+total_size, CHUNK_SIZE))) {
+        if (bytes_read == -1 && errno == EINTR) continue;
+        if (bytes_read == -1) {
+            free(pipe_text);
+            return error("Failed to read pipe");
+        }
+        total_size += bytes_read;
+        if (total_size+CHUNK_SIZE > buffer_size) {
+            buffer_size *= 2;
+            pipe_text = (char*)realloc(pipe_text, buffer_size);
+        }
+    }
+
+    pipe_text[total_size] = 0;
+    return ok(string{pipe_text, (int)total_size});
+}
+
+string read_file(FILE* file) {
+    fseek(file, 0, SEEK_END);
+    int size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* mem = (char*)malloc(size);
+    auto res = fread(mem, size+1, 1, file);
+    return string{mem, size};
+}
+
+optional<string> read_file(const char* path) {
+    auto file = fopen(path, "r");
+    if (file == 0) return error("Failed to open file");
+    string out = read_file(file);
+    fclose(file);
+    return ok(out);
+}
+
+/// Maps a file into memory, read-only. The returned
+/// string is a view of the mapping, and is not 0-terminated.
+optional<string> map_file(const char* path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return error("Failed to open file");
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return error("Failed to stat file");
+    }
+
+    if (st.st_size == 0) {
+        close(fd);
+        return ok(string{"", 0});
+    }
+
+    auto mem = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) return error("Failed to map file");
+    return ok(string{(const char*)mem, (int)st.st_size});
+}
+
+#endif
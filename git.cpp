@@ -0,0 +1,767 @@
+#ifndef subline_git
+#define subline_git
+
+// Finding git repositories and resolving their refs, without
+// running git.
+//
+// A worktree's .git is either the git directory itself, or a
+// file pointing to it ("gitdir: <path>"), as in linked worktrees
+// and submodules. The git directory of a linked worktree holds
+// its own HEAD and index, and names the directory shared with
+// the main worktree (refs, packed-refs and objects) in its
+// "commondir" file.
+//
+// Discovery walks up from the working directory, as git does,
+// stopping at GIT_CEILING_DIRECTORIES and at filesystem boundaries
+// (unless GIT_DISCOVERY_ACROSS_FILESYSTEM is set). Directories
+// known to hold no .git (or .hg, or .jj) are remembered in a
+// small cache in $XDG_CACHE_HOME/subline, keyed by their device,
+// inode and mtime, since looking up a name that doesn't exist is
+// what costs the most on network filesystems.
+
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "utils.cpp"
+#include "files.cpp"
+
+struct Object_Store;
+
+struct Git_State {
+    // Root of the worktree.
+    string dir;
+    // Directory holding HEAD and the index.
+    string git_dir;
+    // Directory holding refs and objects.
+    string common_dir;
+    string branch;
+    bool dirty;
+    int untracked;
+    int conflicts;
+    int staged;
+    string commit;
+    string subject;
+    string tag;
+    string operation;
+    // Opened on first use, see git_objects.
+    Object_Store* objects;
+};
+
+struct Git_Oid {
+    u8 hash[20];
+};
+
+#define OID_HEX_LEN 40
+#define SHORT_OID_LEN 7
+// Symbolic refs pointing to symbolic refs are followed at most
+// this many times, as in git.
+#define SYMREF_MAX_DEPTH 5
+
+/// Writes "<dir>/<name>" into out, which has PATH_MAX bytes.
+void git_path(string dir, const char* name, char* out) {
+    fill_charp(dir, out);
+    out[dir.len] = '/';
+    charp_set(out, name, dir.len + 1);
+}
+
+/// Reads a small file (HEAD, a loose ref, a .git file) into buf,
+/// without the trailing newline. Relative paths are looked up in
+/// the directory dirfd refers to. Returns the length, or -1.
+int read_small_at(int dirfd, const char* path, char* buf, int cap) {
+    int fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return -1;
+    int len = 0;
+    while (len < cap - 1) {
+        int want = cap - 1 - len;
+        auto res = read(fd, buf + len, want);
+        if (res <= 0) break;
+        len += res;
+        // A short read of a regular file is its end, so there is
+        // no need for another read() to return 0.
+        if (res < want) break;
+    }
+    close(fd);
+    while (len > 0 && (buf[len-1] == '\n' || buf[len-1] == '\r')) len--;
+    buf[len] = 0;
+    return len;
+}
+
+int read_small(const char* path, char* buf, int cap) {
+    return read_small_at(AT_FDCWD, path, buf, cap);
+}
+
+/// Resolves a path found in a .git or commondir file, which is
+/// relative to the directory the file is in.
+string git_relative(string base, const char* path, int len) {
+    if (len > 0 && path[0] == '/') return stringf("%.*s", len, path);
+    return stringf(FSTR "/%.*s", FARG(base), len, path);
+}
+
+/// Fills in the git and common directories of a worktree whose
+/// .git entry was found. Returns false if .git isn't usable.
+bool git_dirs(Git_State* git, char* dot_git, struct stat* st) {
+    if (S_ISDIR(st->st_mode)) {
+        git->git_dir = stringf(FSTR "/.git", FARG(git->dir));
+    } else if (S_ISREG(st->st_mode)) {
+        char buf[PATH_MAX];
+        int len = read_small(dot_git, buf, sizeof(buf));
+        if (len <= 8 || strncmp(buf, "gitdir: ", 8) != 0) return false;
+        git->git_dir = git_relative(git->dir, buf + 8, len - 8);
+    } else {
+        return false;
+    }
+
+    char path[PATH_MAX];
+    char buf[PATH_MAX];
+    git_path(git->git_dir, "commondir", path);
+    int len = read_small(path, buf, sizeof(buf));
+    if (len > 0) {
+        git->common_dir = git_relative(git->git_dir, buf, len);
+    } else {
+        git->common_dir = git->git_dir;
+    }
+    return true;
+}
+
+// Repositories of other version control systems are found by the
+// same walk, see vcs_discover.
+enum VCS_KIND {
+    VCS_GIT = 1 << 0,
+    VCS_HG  = 1 << 1,
+    VCS_JJ  = 1 << 2,
+};
+
+#define VCS_KINDS 3
+const char* VCS_NAMES[VCS_KINDS] = {"git", "hg", "jj"};
+const char* VCS_ENTRIES[VCS_KINDS] = {".git", ".hg", ".jj"};
+
+// Directories known not to contain the .git, .hg or .jj entry.
+// The cache is a small hash table, mapped from disk and replaced
+// as a whole when it changes; colliding entries simply replace
+// each other.
+#define DISCOVER_CACHE_VERSION 2
+#define DISCOVER_CACHE_SLOTS 1024
+#define DISCOVER_CACHE_PROBES 8
+// Directories modified this recently aren't cached: a .git made
+// in the same mtime tick wouldn't change the mtime.
+#define DISCOVER_CACHE_SETTLE 2
+
+struct Discover_Entry {
+    u64 dev;
+    u64 ino;
+    s64 sec;
+    u32 nsec;
+    // VCS_* bits of the entries known to be missing.
+    u32 absent;
+    // Checksum of the rest, so a torn entry is never trusted.
+    u32 check;
+    u32 padding;
+};
+
+struct Discover_Cache_Header {
+    char magic[8];
+    u32 version;
+    u32 slots;
+};
+
+const char DISCOVER_CACHE_MAGIC[8] = {'S','U','B','L','D','S','C',0};
+
+struct Discover_Cache {
+    Discover_Cache_Header* header;
+    Discover_Entry* entries;
+    u64 size;
+    // Entries to add once discovery is done.
+    Discover_Entry added[64];
+    int added_count;
+};
+
+u32 discover_check(Discover_Entry* e) {
+    u64 h = e->dev * 0x9E3779B97F4A7C15ull ^ e->ino * 0xC2B2AE3D27D4EB4Full ^ (u64)e->sec * 31 ^ e->nsec ^ (u64)e->absent << 40;
+    return (u32)(h ^ (h >> 32)) | 1;
+}
+
+u32 discover_slot(u64 dev, u64 ino) {
+    u64 h = dev * 0x9E3779B97F4A7C15ull ^ ino * 0xC2B2AE3D27D4EB4Full;
+    return (h >> 32) % DISCOVER_CACHE_SLOTS;
+}
+
+Discover_Entry discover_entry(struct stat* st, u32 absent) {
+    Discover_Entry e = {(u64)st->st_dev, (u64)st->st_ino, st->st_mtim.tv_sec, (u32)st->st_mtim.tv_nsec, absent, 0, 0};
+    e.check = discover_check(&e);
+    return e;
+}
+
+void discover_cache_load(Discover_Cache* cache) {
+    *cache = {0};
+    auto dir = cache_dir();
+    if (dir.error) return;
+    auto path = stringf(FSTR "/discover", FARG(dir.value));
+    auto file = map_file(path.text);
+    free((void*)path.text);
+    free((void*)dir.value.text);
+    if (file.error) return;
+
+    auto header = (Discover_Cache_Header*)file.value.text;
+    u64 size = sizeof(Discover_Cache_Header) + sizeof(Discover_Entry) * DISCOVER_CACHE_SLOTS;
+    bool valid = (u64)file.value.len == size &&
+        memcmp(header->magic, DISCOVER_CACHE_MAGIC, sizeof(DISCOVER_CACHE_MAGIC)) == 0 &&
+        header->version == DISCOVER_CACHE_VERSION &&
+        header->slots == DISCOVER_CACHE_SLOTS;
+    if (!valid) {
+        if (file.value.len > 0) munmap((void*)file.value.text, file.value.len);
+        return;
+    }
+    cache->header = header;
+    cache->entries = (Discover_Entry*)(header + 1);
+    cache->size = size;
+}
+
+/// VCS_* bits of the entries the directory is known not to
+/// have, as of its current mtime.
+u32 discover_cache_absent(Discover_Cache* cache, struct stat* st) {
+    if (cache->entries == 0) return 0;
+    auto e = discover_entry(st, 0);
+    u32 slot = discover_slot(e.dev, e.ino);
+    for (int i=0; i<DISCOVER_CACHE_PROBES; i++) {
+        auto c = &cache->entries[(slot + i) % DISCOVER_CACHE_SLOTS];
+        if (c->dev != e.dev || c->ino != e.ino) continue;
+        bool fresh = c->sec == e.sec && c->nsec == e.nsec && c->check == discover_check(c);
+        return fresh ? c->absent : 0;
+    }
+    return 0;
+}
+
+void discover_cache_add(Discover_Cache* cache, struct stat* st, u32 absent) {
+    if (cache->added_count == 64) return;
+    if (st->st_mtim.tv_sec > time(0) - DISCOVER_CACHE_SETTLE) return;
+    cache->added[cache->added_count++] = discover_entry(st, absent);
+}
+
+/// Writes the cache back if anything was added, and unmaps it.
+void discover_cache_close(Discover_Cache* cache) {
+    u64 size = sizeof(Discover_Cache_Header) + sizeof(Discover_Entry) * DISCOVER_CACHE_SLOTS;
+    if (cache->added_count > 0) {
+        auto data = (char*)calloc(1, size);
+        if (cache->entries) memcpy(data, cache->header, size);
+        auto header = (Discover_Cache_Header*)data;
+        memcpy(header->magic, DISCOVER_CACHE_MAGIC, sizeof(DISCOVER_CACHE_MAGIC));
+        header->version = DISCOVER_CACHE_VERSION;
+        header->slots = DISCOVER_CACHE_SLOTS;
+
+        auto entries = (Discover_Entry*)(header + 1);
+        for (int i=0; i<cache->added_count; i++) {
+            auto e = &cache->added[i];
+            u32 slot = discover_slot(e->dev, e->ino);
+            // The directory's own slot if it has one, otherwise the
+            // first free one, otherwise the first one probed.
+            u32 target = slot;
+            bool free_found = false;
+            for (int j=0; j<DISCOVER_CACHE_PROBES; j++) {
+                u32 at = (slot + j) % DISCOVER_CACHE_SLOTS;
+                if (entries[at].dev == e->dev && entries[at].ino == e->ino) { target = at; break; }
+                if (!free_found && entries[at].check == 0) { target = at; free_found = true; }
+            }
+            entries[target] = *e;
+        }
+
+        cache_write("discover", data, size);
+        free(data);
+    }
+    if (cache->entries) munmap(cache->header, cache->size);
+    *cache = {0};
+}
+
+/// Length of the longest of GIT_CEILING_DIRECTORIES that is a
+/// parent of the directory. Discovery doesn't look at it, or at
+/// anything above it. -1 if there is none.
+int ceiling_len(string dir) {
+    auto ceilings = getenv("GIT_CEILING_DIRECTORIES");
+    if (ceilings == 0) return -1;
+
+    int best = -1;
+    auto p = ceilings;
+    while (*p) {
+        auto end = strchr(p, ':');
+        if (end == 0) end = p + strlen(p);
+        int len = end - p;
+        while (len > 1 && p[len-1] == '/') len--;
+
+        // Only absolute paths count, as in git.
+        bool parent = len > 0 && p[0] == '/' && (
+            len == 1 ? dir.len > 1 :
+            dir.len > len && memcmp(dir.text, p, len) == 0 && dir.text[len] == '/');
+        int root_len = len == 1 ? 0 : len;
+        if (parent && root_len > best) best = root_len;
+
+        p = *end ? end + 1 : end;
+    }
+    return best;
+}
+
+bool env_true(const char* name) {
+    auto value = getenv(name);
+    if (value == 0) return false;
+    return strcasecmp(value, "1") == 0 || strcasecmp(value, "true") == 0 ||
+        strcasecmp(value, "yes") == 0 || strcasecmp(value, "on") == 0;
+}
+
+struct Vcs_Discovery {
+    // The nearest repository of each kind that was looked for.
+    optional<Git_State> git;
+    // Roots of the nearest Mercurial and Jujutsu repositories, or
+    // empty.
+    string hg;
+    string jj;
+};
+
+/// Finds the nearest repositories of the given kinds (VCS_* bits)
+/// that the directory is in, by looking for their entries in it
+/// and each of its parents. The walk stops once all of them were
+/// found.
+///
+/// Everything is looked up relative to a single handle on the
+/// directory ("../../.git"), so no path is resolved from the
+/// root more than once. A directory in the cache costs one
+/// fstatat, one that isn't costs one more per kind.
+Vcs_Discovery vcs_discover(string cwd, u32 kinds) {
+    Vcs_Discovery out = {error("Not inside of git repo"), {0}, {0}};
+    char path[PATH_MAX] = {0};
+    fill_charp(cwd, path);
+    int fd = open(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) return out;
+
+    int ceiling = ceiling_len(cwd);
+    bool cross = env_true("GIT_DISCOVERY_ACROSS_FILESYSTEM");
+
+    Discover_Cache cache;
+    discover_cache_load(&cache);
+
+    // Path of the current directory relative to cwd, as a run of
+    // "../", followed by room for the entry's name.
+    char rel[PATH_MAX];
+    int rel_len = 0;
+    // Length of the current directory's path; the root is empty.
+    int idx = cwd.len == 1 ? 0 : cwd.len;
+    dev_t dev = 0;
+    u32 missing = kinds;
+
+    for (int level=0; missing && idx > ceiling && rel_len + 8 < PATH_MAX; level++) {
+        struct stat st;
+        rel[rel_len] = 0;
+        int res = level == 0 ?
+            fstat(fd, &st) :
+            fstatat(fd, rel, &st, 0);
+        if (res != 0) break;
+
+        if (level == 0) dev = st.st_dev;
+        else if (st.st_dev != dev && !cross) break;
+
+        u32 known_absent = discover_cache_absent(&cache, &st);
+        u32 absent = known_absent;
+        for (int k=0; k<VCS_KINDS; k++) {
+            u32 kind = 1 << k;
+            if (!(missing & kind) || (known_absent & kind)) continue;
+
+            charp_set(rel, VCS_ENTRIES[k], rel_len);
+            struct stat entry_st;
+            if (fstatat(fd, rel, &entry_st, 0) != 0) {
+                if (errno == ENOENT) absent |= kind;
+                continue;
+            }
+
+            auto root = stringf("%.*s", idx, cwd.text);
+            if (kind == VCS_GIT) {
+                Git_State git = {0};
+                git.dir = root;
+                charp_set(path, "/.git", idx);
+                if (git_dirs(&git, path, &entry_st)) {
+                    out.git = ok(git);
+                    missing &= ~kind;
+                } else {
+                    free((void*)root.text);
+                }
+            } else if (S_ISDIR(entry_st.st_mode)) {
+                if (kind == VCS_HG) out.hg = root;
+                else out.jj = root;
+                missing &= ~kind;
+            } else {
+                free((void*)root.text);
+            }
+        }
+        if (absent != known_absent) discover_cache_add(&cache, &st, absent);
+
+        if (idx == 0) break;
+        while (idx > 0 && cwd.text[idx-1] != '/') idx--;
+        idx--;
+        memcpy(rel + rel_len, "../", 3);
+        rel_len += 3;
+    }
+
+    close(fd);
+    discover_cache_close(&cache);
+    return out;
+}
+
+/// Finds the git repository that the directory is in.
+optional<Git_State> git_discover(string cwd) {
+    return vcs_discover(cwd, VCS_GIT).git;
+}
+
+optional<string> git_root(string cwd) {
+    auto git = git_discover(cwd);
+    if (git.error) return error(git.error);
+    return ok(git.value.dir);
+}
+
+u8 hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return 0xff;
+}
+
+bool parse_oid(const char* hex, int len, Git_Oid* out) {
+    if (len < OID_HEX_LEN) return false;
+    for (int i=0; i<20; i++) {
+        u8 hi = hex_value(hex[i*2]);
+        u8 lo = hex_value(hex[i*2+1]);
+        if (hi == 0xff || lo == 0xff) return false;
+        out->hash[i] = hi << 4 | lo;
+    }
+    return true;
+}
+
+string oid_hex(Git_Oid* oid, int len) {
+    const char digits[] = "0123456789abcdef";
+    char hex[OID_HEX_LEN];
+    for (int i=0; i<20; i++) {
+        hex[i*2] = digits[oid->hash[i] >> 4];
+        hex[i*2+1] = digits[oid->hash[i] & 15];
+    }
+    return stringf("%.*s", len, hex);
+}
+
+/// Compares the ref of the packed-refs record starting at
+/// line with the one looked for.
+int packed_compare(const char* line, const char* end, const char* ref, int ref_len) {
+    auto name = line + OID_HEX_LEN + 1;
+    if (name > end) return 1;
+    for (int i=0; i<ref_len; i++) {
+        if (name + i >= end || name[i] == '\n') return -1;
+        if (name[i] != ref[i]) return (u8)name[i] < (u8)ref[i] ? -1 : 1;
+    }
+    if (name + ref_len < end && name[ref_len] != '\n') return 1;
+    return 0;
+}
+
+/// Looks a ref up in packed-refs. When the file says it is
+/// sorted (as every git since 2.x writes it), the lookup is a
+/// binary search over the mapped file; otherwise a scan.
+optional<Git_Oid> packed_ref(Git_State* git, const char* ref) {
+    char path[PATH_MAX];
+    git_path(git->common_dir, "packed-refs", path);
+    auto file = map_file(path);
+    if (file.error) return error(file.error);
+
+    auto text = file.value.text;
+    auto end = text + file.value.len;
+    int ref_len = strlen(ref);
+
+    auto start = text;
+    bool sorted = false;
+    if (file.value.len > 0 && text[0] == '#') {
+        auto eol = (const char*)memchr(text, '\n', end - text);
+        if (eol == 0) eol = end;
+        sorted = memmem(text, eol - text, " sorted", 7) != 0;
+        start = eol < end ? eol + 1 : end;
+    }
+
+    const char* found = 0;
+    if (sorted) {
+        auto lo = start;
+        auto hi = end;
+        while (lo < hi) {
+            auto mid = lo + (hi - lo) / 2;
+            // Back up to the start of the record. Peeled lines
+            // ("^<oid>") belong to the record before them.
+            while (mid > lo && mid[-1] != '\n') mid--;
+            if (*mid == '^') {
+                mid--;
+                while (mid > lo && mid[-1] != '\n') mid--;
+            }
+            auto next = (const char*)memchr(mid, '\n', end - mid);
+            next = next == 0 ? end : next + 1;
+            while (next < end && *next == '^') {
+                auto eol = (const char*)memchr(next, '\n', end - next);
+                next = eol == 0 ? end : eol + 1;
+            }
+
+            int cmp = packed_compare(mid, end, ref, ref_len);
+            if (cmp == 0) { found = mid; break; }
+            if (cmp < 0) lo = next;
+            else hi = mid;
+        }
+    } else {
+        for (auto line = start; line < end; ) {
+            if (*line != '^' && *line != '#' && packed_compare(line, end, ref, ref_len) == 0) {
+                found = line;
+                break;
+            }
+            auto eol = (const char*)memchr(line, '\n', end - line);
+            line = eol == 0 ? end : eol + 1;
+        }
+    }
+
+    Git_Oid oid;
+    bool ok_oid = found != 0 && parse_oid(found, end - found, &oid);
+    if (file.value.len > 0) munmap((void*)file.value.text, file.value.len);
+    if (!ok_oid) return error("Ref not found");
+    return ok(oid);
+}
+
+/// Whether a ref lives in the worktree's own git directory,
+/// rather than in the common one.
+bool per_worktree_ref(const char* ref) {
+    return strchr(ref, '/') == 0 ||
+        strncmp(ref, "refs/worktree/", 14) == 0 ||
+        strncmp(ref, "refs/bisect/", 12) == 0 ||
+        strncmp(ref, "refs/rewritten/", 15) == 0;
+}
+
+/// Reads a ref without following it. Sets *target to the ref it
+/// points to for symbolic refs, and *oid otherwise.
+bool read_ref(Git_State* git, const char* ref, char* target, Git_Oid* oid, bool* symbolic) {
+    char path[PATH_MAX];
+    char buf[256];
+    git_path(per_worktree_ref(ref) ? git->git_dir : git->common_dir, ref, path);
+
+    int len = read_small(path, buf, sizeof(buf));
+    if (len == -1) {
+        *symbolic = false;
+        auto packed = packed_ref(git, ref);
+        if (packed.error) return false;
+        *oid = packed.value;
+        return true;
+    }
+
+    if (len > 5 && strncmp(buf, "ref: ", 5) == 0) {
+        *symbolic = true;
+        memcpy(target, buf + 5, len - 5 + 1);
+        return true;
+    }
+
+    *symbolic = false;
+    return parse_oid(buf, len, oid);
+}
+
+/// Follows a ref (symbolic or not) to the commit it names.
+optional<Git_Oid> git_resolve_ref(Git_State* git, const char* ref) {
+    char name[256];
+    char target[256];
+    strncpy(name, ref, sizeof(name) - 1);
+    name[sizeof(name) - 1] = 0;
+
+    for (int depth=0; depth<SYMREF_MAX_DEPTH; depth++) {
+        Git_Oid oid;
+        bool symbolic;
+        if (!read_ref(git, name, target, &oid, &symbolic)) return error("Unresolved ref");
+        if (!symbolic) return ok(oid);
+        memcpy(name, target, sizeof(name));
+    }
+    return error("Symbolic refs nested too deeply");
+}
+
+/// The branch that HEAD points to, without its refs/heads/
+/// prefix. Fails if HEAD is detached.
+optional<string> git_branch_name(Git_State* git) {
+    char path[PATH_MAX];
+    char buf[256];
+    git_path(git->git_dir, "HEAD", path);
+    int len = read_small(path, buf, sizeof(buf));
+    if (len == -1) return error("Failed to read HEAD");
+    if (len <= 5 || strncmp(buf, "ref: ", 5) != 0) return error("HEAD is detached");
+
+    auto ref = string{buf + 5, len - 5};
+    if (starts(&ref, "refs/heads/")) ref = slice(&ref, sizeof("refs/heads/") - 1, ref.len);
+    return ok(copy(&ref));
+}
+
+/// Abbreviated id of the commit HEAD points to. Fails on
+/// branches with no commits yet.
+optional<string> git_commit(Git_State* git) {
+    auto oid = git_resolve_ref(git, "HEAD");
+    if (oid.error) return error(oid.error);
+    return ok(oid_hex(&oid.value, SHORT_OID_LEN));
+}
+
+bool exists_at(int dirfd, const char* name) {
+    struct stat st;
+    return fstatat(dirfd, name, &st, 0) == 0;
+}
+
+/// The operation in progress in the worktree, named as git's
+/// prompt (contrib/completion/git-prompt.sh) names it: REBASE,
+/// AM, MERGING, CHERRY-PICKING, REVERTING or BISECTING. Rebases
+/// and am sessions are followed by their progress, as in
+/// "REBASE 2/5". Empty when there is none.
+///
+/// The git directory is opened once, and everything is looked
+/// up relative to it: eight syscalls when nothing is going on,
+/// nine during a rebase, ten during an am session or a rebase
+/// with the apply backend.
+string git_operation(Git_State* git) {
+    char path[PATH_MAX];
+    fill_charp(git->git_dir, path);
+    int dir = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir == -1) return {0};
+
+    const char* name = 0;
+    const char* step_file = 0;
+    const char* total_file = 0;
+    if (exists_at(dir, "rebase-merge")) {
+        name = "REBASE";
+        step_file = "rebase-merge/msgnum";
+        total_file = "rebase-merge/end";
+    } else if (exists_at(dir, "rebase-apply")) {
+        // Left behind by the apply backend of git rebase, and by
+        // git am; the first marks itself with "rebasing".
+        name = exists_at(dir, "rebase-apply/rebasing") ? "REBASE" : "AM";
+        step_file = "rebase-apply/next";
+        total_file = "rebase-apply/last";
+    } else if (exists_at(dir, "MERGE_HEAD")) {
+        name = "MERGING";
+    } else if (exists_at(dir, "CHERRY_PICK_HEAD")) {
+        name = "CHERRY-PICKING";
+    } else if (exists_at(dir, "REVERT_HEAD")) {
+        name = "REVERTING";
+    } else if (exists_at(dir, "BISECT_LOG")) {
+        name = "BISECTING";
+    }
+
+    char step[32];
+    char total[32];
+    bool progress = step_file != 0 &&
+        read_small_at(dir, step_file, step, sizeof(step)) > 0 &&
+        read_small_at(dir, total_file, total, sizeof(total)) > 0;
+    close(dir);
+
+    if (name == 0) return {0};
+    if (progress) return stringf("%s %s/%s", name, step, total);
+    return stringf("%s", name);
+}
+
+bool equal_nocase(const char* a, int len, const char* b) {
+    for (int i=0; i<len; i++) {
+        if (b[i] == 0 || tolower((u8)a[i]) != tolower((u8)b[i])) return false;
+    }
+    return b[len] == 0;
+}
+
+/// Looks up a value in a git config file. Section and key names
+/// are matched case-insensitively, subsections exactly. Includes,
+/// escapes and multi-line values are not supported; the last
+/// matching value wins, as in git.
+optional<string> config_file_value(const char* path, const char* section, const char* subsection, const char* key) {
+    auto file = map_file(path);
+    if (file.error) return error(file.error);
+
+    auto p = file.value.text;
+    auto end = p + file.value.len;
+    bool in_section = false;
+    optional<string> out = error("Config value not found");
+
+    while (p < end) {
+        auto eol = (const char*)memchr(p, '\n', end - p);
+        if (eol == 0) eol = end;
+        auto line = string{p, (int)(eol - p)};
+        line = trim(&line);
+        p = eol + 1;
+
+        if (line.len == 0 || line.text[0] == '#' || line.text[0] == ';') continue;
+
+        if (line.text[0] == '[') {
+            // [section] or [section "subsection"]
+            int close = index_of(&line, ']', 1);
+            if (close == -1) continue;
+            auto header = slice(&line, 1, close);
+            int quote = index_of(&header, '"', 1);
+            auto name = quote == -1 ? header : slice(&header, 0, quote);
+            name = trim(&name);
+            in_section = equal_nocase(name.text, name.len, section);
+            if (quote == -1) {
+                in_section = in_section && subsection == 0;
+            } else {
+                int end_quote = index_of(&header, '"', 2);
+                if (end_quote == -1 || subsection == 0) {
+                    in_section = false;
+                } else {
+                    auto sub = slice(&header, quote + 1, end_quote);
+                    in_section = in_section && equal(&sub, subsection);
+                }
+            }
+            continue;
+        }
+
+        if (!in_section) continue;
+        int eq = index_of(&line, '=', 1);
+        auto name = eq == -1 ? line : slice(&line, 0, eq);
+        name = trim(&name);
+        if (!equal_nocase(name.text, name.len, key)) continue;
+
+        auto value = eq == -1 ? const_string("true") : slice(&line, eq + 1, line.len);
+        value = trim(&value);
+        if (value.len >= 2 && value.text[0] == '"' && value.text[value.len-1] == '"') {
+            value = slice(&value, 1, value.len - 1);
+        }
+        out = ok(copy(&value));
+    }
+
+    if (file.value.len > 0) munmap((void*)file.value.text, file.value.len);
+    return out;
+}
+
+/// Looks up a value in the repository's config file.
+optional<string> git_config(Git_State* git, const char* section, const char* subsection, const char* key) {
+    char path[PATH_MAX];
+    git_path(git->common_dir, "config", path);
+    return config_file_value(path, section, subsection, key);
+}
+
+/// The ref that the current branch's upstream is at, as
+/// configured by branch.<name>.remote and branch.<name>.merge.
+/// Assumes the remote's default fetch refspec.
+optional<string> git_upstream_ref(Git_State* git) {
+    auto branch = git_branch_name(git);
+    if (branch.error) return error(branch.error);
+
+    // git_branch_name returns a copy, which is 0-terminated.
+    auto remote = git_config(git, "branch", branch.value.text, "remote");
+    auto merge = git_config(git, "branch", branch.value.text, "merge");
+    free((void*)branch.value.text);
+    if (remote.error || merge.error) return error("No upstream");
+
+    auto merge_ref = merge.value;
+    if (equal(&remote.value, ".")) return ok(merge_ref);
+    if (!starts(&merge_ref, "refs/heads/")) return error("Unsupported upstream");
+
+    auto short_name = slice(&merge_ref, sizeof("refs/heads/") - 1, merge_ref.len);
+    return ok(stringf("refs/remotes/" FSTR "/" FSTR, FARG(remote.value), FARG(short_name)));
+}
+
+optional<Git_State> git_state(string cwd) {
+    auto git = git_discover(cwd);
+    if (git.error) return git;
+
+    auto branch = git_branch_name(&git.value);
+    git.value.branch = branch.error ? string{0} : branch.value;
+    return git;
+}
+
+#endif
@@ -0,0 +1,846 @@
+#ifndef subline_git_index
+#define subline_git_index
+
+// Reading git's index, and checking the worktree
+// against it without running git.
+//
+// Only repositories using SHA-1 object names are supported.
+// Index format: https://git-scm.com/docs/index-format
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "utils.cpp"
+#include "sha1.cpp"
+#include "git.cpp"
+
+#define INDEX_HEADER_SIZE 12
+#define INDEX_ENTRY_FIXED 62
+#define INDEX_OID_OFFSET 40
+
+#define INDEX_NAME_MASK     0x0fff
+#define INDEX_STAGE_MASK    0x3000
+#define INDEX_EXTENDED      0x4000
+#define INDEX_ASSUME_VALID  0x8000
+
+#define INDEX_INTENT_TO_ADD 0x2000
+#define INDEX_SKIP_WORKTREE 0x4000
+
+struct Index_Entry {
+    // Start of the entry in the index file. It begins with the
+    // cached stat data, followed by the object id.
+    const u8* data;
+    // Offset of the 0-terminated path in Git_Index::paths.
+    u32 path;
+    u16 flags;
+    u16 extended;
+};
+
+struct Git_Index {
+    u8* map;
+    u64 size;
+    u32 version;
+    bag<Index_Entry> entries;
+    // For version 4 indexes, paths are prefix-compressed and are
+    // rebuilt into a separate buffer. Otherwise this is the map.
+    char* paths;
+    // Offset of the first extension, right after the entries.
+    u64 extensions;
+    timespec mtime;
+};
+
+const char* index_path(Git_Index* index, Index_Entry* entry) {
+    return index->paths + entry->path;
+}
+
+int index_stage(Index_Entry* entry) {
+    return (entry->flags & INDEX_STAGE_MASK) >> 12;
+}
+
+/// Parses the offset varint used by version 4 indexes.
+u64 index_varint(const u8** p, const u8* end) {
+    u64 val = 0;
+    if (*p >= end) return 0;
+    u8 c = *(*p)++;
+    val = c & 127;
+    while ((c & 128) && *p < end) {
+        c = *(*p)++;
+        val = ((val + 1) << 7) + (c & 127);
+    }
+    return val;
+}
+
+void git_index_free(Git_Index* index) {
+    if (index->paths != (char*)index->map) free(index->paths);
+    munmap(index->map, index->size);
+    free(index->entries.items);
+}
+
+// A run of entries that can be parsed on its own: in version 4
+// indexes, the path of the first entry of a block is written in
+// full, whatever the entry before it.
+struct Index_Block {
+    Git_Index* index;
+    const u8* start;
+    u32 first;
+    u32 count;
+    // Rebuilt paths of a version 4 block, and their length.
+    char* paths;
+    u64 paths_len;
+    // Where the block's entries end, or 0 if they are corrupt.
+    const u8* end;
+};
+
+/// Parses the entries of one block into their place in the
+/// index's entries, which are allocated by the caller.
+void index_parse_block(Index_Block* block) {
+    auto index = block->index;
+    const u8* map = index->map;
+    auto end = map + index->size;
+
+    // Version 4 paths are rebuilt into a growing buffer, so
+    // entries store offsets rather than pointers.
+    u64 paths_len = 0;
+    u64 paths_cap = 0;
+    u64 prev_path = 0;
+    u64 prev_len = 0;
+    if (index->version == 4) {
+        paths_cap = 64 * (u64)block->count + 64;
+        block->paths = (char*)malloc(paths_cap);
+    }
+
+    auto p = block->start;
+    block->end = 0;
+    for (u32 i=0; i<block->count; i++) {
+        if (p + INDEX_ENTRY_FIXED > end) return;
+
+        auto entry = &index->entries.items[block->first + i];
+        entry->data = p;
+        entry->flags = be16(p+60);
+        entry->extended = 0;
+
+        auto name = p + INDEX_ENTRY_FIXED;
+        if (index->version >= 3 && (entry->flags & INDEX_EXTENDED)) {
+            entry->extended = be16(p+62);
+            name += 2;
+        }
+
+        if (index->version == 4) {
+            u64 strip = index_varint(&name, end);
+            auto suffix = name;
+            while (name < end && *name != 0) name++;
+            if (name >= end || (i > 0 && strip > prev_len)) return;
+
+            // Blocks are parsed without the path before them, so
+            // the first entry of a block stands on its own.
+            u64 keep = i > 0 ? prev_len - strip : 0;
+            u64 suffix_len = name - suffix;
+            if (paths_len + keep + suffix_len + 1 > paths_cap) {
+                while (paths_len + keep + suffix_len + 1 > paths_cap) paths_cap *= 2;
+                block->paths = (char*)realloc(block->paths, paths_cap);
+            }
+
+            memmove(block->paths + paths_len, block->paths + prev_path, keep);
+            memcpy(block->paths + paths_len + keep, suffix, suffix_len);
+            block->paths[paths_len + keep + suffix_len] = 0;
+
+            entry->path = paths_len;
+            prev_path = paths_len;
+            prev_len = keep + suffix_len;
+            paths_len += prev_len + 1;
+            p = name + 1;
+        } else {
+            u64 len = entry->flags & INDEX_NAME_MASK;
+            if (len == INDEX_NAME_MASK) {
+                len = 0;
+                while (name + len < end && name[len] != 0) len++;
+            }
+            if (name + len >= end) return;
+
+            entry->path = name - map;
+            // Entries are padded with 1-8 NULs to a multiple of 8 bytes.
+            p += ((name - p) + len + 8) & ~(u64)7;
+        }
+    }
+
+    block->paths_len = paths_len;
+    block->end = p;
+}
+
+#define INDEX_MAX_THREADS 16
+// Below this many entries, threads cost more than they save.
+#define INDEX_THREADED_MIN 10000
+
+struct Index_Parse {
+    Index_Block* blocks;
+    int count;
+    int next;
+};
+
+void* index_worker(void* arg) {
+    auto parse = (Index_Parse*)arg;
+    while (true) {
+        int i = __atomic_fetch_add(&parse->next, 1, __ATOMIC_RELAXED);
+        if (i >= parse->count) break;
+        index_parse_block(&parse->blocks[i]);
+    }
+    return 0;
+}
+
+/// Finds an extension by its signature, given where the
+/// extensions start.
+bool index_extension_at(const u8* p, const u8* end, const char* signature, const u8** data, u32* len) {
+    while (p + 8 <= end) {
+        u32 size = be32(p+4);
+        if (p + 8 + size > end) return false;
+        if (memcmp(p, signature, 4) == 0) {
+            *data = p + 8;
+            *len = size;
+            return true;
+        }
+        p += 8 + size;
+    }
+    return false;
+}
+
+/// Splits the entries into the blocks listed by the index entry
+/// offset table (IEOT), which git writes along with the end of
+/// index entry (EOIE) extension when index.threads is enabled.
+/// Returns the number of blocks, or 0 if there is no table.
+int index_offset_table(Git_Index* index, u32 count, bag<Index_Block>* blocks) {
+    const u8* map = index->map;
+    // EOIE sits right before the trailing checksum: its header,
+    // the offset of the first extension, and a hash.
+    if (index->size < INDEX_HEADER_SIZE + 20 + 8 + 24) return 0;
+    auto eoie = map + index->size - 20 - 8 - 24;
+    if (memcmp(eoie, "EOIE", 4) != 0 || be32(eoie+4) != 24) return 0;
+
+    u32 extensions = be32(eoie+8);
+    if (extensions < INDEX_HEADER_SIZE || extensions > index->size - 20) return 0;
+
+    const u8* table;
+    u32 len;
+    if (!index_extension_at(map + extensions, eoie, "IEOT", &table, &len)) return 0;
+    if (len < 4 || be32(table) != 1 || (len - 4) % 8 != 0) return 0;
+
+    u32 total = 0;
+    u32 prev_offset = 0;
+    for (u32 off=4; off<len; off+=8) {
+        Index_Block block = {0};
+        block.index = index;
+        u32 offset = be32(table + off);
+        block.count = be32(table + off + 4);
+        block.first = total;
+        if (offset < INDEX_HEADER_SIZE || offset >= extensions || offset < prev_offset || block.count > count - total) {
+            blocks->len = 0;
+            return 0;
+        }
+        block.start = map + offset;
+        prev_offset = offset;
+        total += block.count;
+        bag_add(blocks, block);
+    }
+    if (total != count) blocks->len = 0;
+    return blocks->len;
+}
+
+optional<Git_Index> git_index_load(const char* path) {
+    Git_Index index = {0};
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return error("Failed to open the index");
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < INDEX_HEADER_SIZE + 20) {
+        close(fd);
+        return error("Invalid index");
+    }
+
+    index.size = st.st_size;
+    index.mtime = st.st_mtim;
+    index.map = (u8*)mmap(0, index.size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (index.map == MAP_FAILED) return error("Failed to map the index");
+
+    const u8* map = index.map;
+    index.version = be32(map+4);
+    u32 count = be32(map+8);
+
+    if (memcmp(map, "DIRC", 4) != 0 || index.version < 2 || index.version > 4) {
+        munmap(index.map, index.size);
+        return error("Unsupported index");
+    }
+    // Every entry takes at least its fixed part and a NUL.
+    if ((u64)count * (INDEX_ENTRY_FIXED + 1) > index.size) {
+        munmap(index.map, index.size);
+        return error("Truncated index");
+    }
+
+    index.entries = create_bag<Index_Entry>(count > 0 ? count : 1);
+    index.entries.len = count;
+    index.paths = (char*)map;
+
+    auto blocks = create_bag<Index_Block>(16);
+    int threads = 1;
+    if (count >= INDEX_THREADED_MIN && index_offset_table(&index, count, &blocks) > 1) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (threads > INDEX_MAX_THREADS) threads = INDEX_MAX_THREADS;
+        if (threads > blocks.len) threads = blocks.len;
+        if (threads < 1) threads = 1;
+    } else {
+        blocks.len = 0;
+        bag_add(&blocks, {&index, map + INDEX_HEADER_SIZE, 0, count, 0, 0, 0});
+    }
+
+    // The calling thread is one of the workers.
+    Index_Parse parse = {blocks.items, blocks.len, 0};
+    pthread_t pool[INDEX_MAX_THREADS];
+    int started = 0;
+    for (int i=1; i<threads; i++) {
+        if (pthread_create(&pool[started], 0, index_worker, &parse) == 0) started++;
+    }
+    index_worker(&parse);
+    for (int i=0; i<started; i++) pthread_join(pool[i], 0);
+
+    bool complete = true;
+    u64 paths_len = 0;
+    for (int i=0; i<blocks.len; i++) {
+        if (blocks.items[i].end == 0) complete = false;
+        paths_len += blocks.items[i].paths_len;
+    }
+    index.extensions = complete ? blocks.items[blocks.len-1].end - map : 0;
+
+    // Version 4 blocks each rebuilt their own paths; they are
+    // joined into one buffer.
+    if (index.version == 4 && blocks.len == 1) {
+        index.paths = blocks.items[0].paths;
+    } else if (index.version == 4) {
+        index.paths = (char*)malloc(paths_len > 0 ? paths_len : 1);
+        u64 base = 0;
+        for (int i=0; i<blocks.len; i++) {
+            auto block = &blocks.items[i];
+            if (complete) {
+                memcpy(index.paths + base, block->paths, block->paths_len);
+                for (u32 j=0; j<block->count; j++) index.entries.items[block->first + j].path += base;
+            }
+            base += block->paths_len;
+            free(block->paths);
+        }
+    }
+    free(blocks.items);
+
+    if (!complete) {
+        git_index_free(&index);
+        return error("Truncated index");
+    }
+
+    return ok(index);
+}
+
+/// Finds an extension of the index, such as the cache tree.
+bool index_extension(Git_Index* index, const char* signature, const u8** data, u32* len) {
+    if (index->extensions == 0) return false;
+    return index_extension_at(index->map + index->extensions, index->map + index->size - 20, signature, data, len);
+}
+
+/// Hashes a file the way git hashes a blob.
+bool blob_matches(int dir_fd, const char* path, struct stat* st, const u8* oid) {
+    SHA1 sha = sha1_create();
+    char header[32];
+    int header_len = sprintf(header, "blob %ld", (long)st->st_size) + 1;
+    sha1_update(&sha, header, header_len);
+
+    if (S_ISLNK(st->st_mode)) {
+        char target[PATH_MAX];
+        auto len = readlinkat(dir_fd, path, target, sizeof(target));
+        if (len != st->st_size) return false;
+        sha1_update(&sha, target, len);
+    } else {
+        int fd = openat(dir_fd, path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+        if (fd == -1) return false;
+        if (st->st_size > 0) {
+            auto mem = mmap(0, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mem == MAP_FAILED) {
+                close(fd);
+                return false;
+            }
+            sha1_update(&sha, mem, st->st_size);
+            munmap(mem, st->st_size);
+        }
+        close(fd);
+    }
+
+    u8 digest[20];
+    sha1_final(&sha, digest);
+    return memcmp(digest, oid, 20) == 0;
+}
+
+enum ENTRY_STATUS {
+    ES_CLEAN, ES_MODIFIED,
+    // The stat data can't tell, the contents need to be hashed.
+    ES_UNSURE,
+};
+
+/// Compares the worktree copy of an entry with the index, using
+/// only stat data. Follows git's rules: cached stat data is
+/// trusted unless the entry is racily clean (modified no earlier
+/// than the index was written), and a stat mismatch with an
+/// unchanged size is left for the contents to settle.
+ENTRY_STATUS index_entry_status(Git_Index* index, Index_Entry* entry, int root_fd, struct stat* st) {
+    if (index_stage(entry) != 0) return ES_MODIFIED;
+    if (entry->flags & INDEX_ASSUME_VALID) return ES_CLEAN;
+    if (entry->extended & INDEX_SKIP_WORKTREE) return ES_CLEAN;
+    if (entry->extended & INDEX_INTENT_TO_ADD) return ES_MODIFIED;
+
+    auto d = entry->data;
+    u32 mode = be32(d+24);
+    // Submodules are not looked into.
+    if ((mode & S_IFMT) == 0160000) return ES_CLEAN;
+
+    if (fstatat(root_fd, index_path(index, entry), st, AT_SYMLINK_NOFOLLOW) != 0) return ES_MODIFIED;
+
+    if ((mode & S_IFMT) == S_IFLNK) {
+        if (!S_ISLNK(st->st_mode)) return ES_MODIFIED;
+    } else {
+        if (!S_ISREG(st->st_mode)) return ES_MODIFIED;
+        if ((mode & 0100) != (st->st_mode & 0100)) return ES_MODIFIED;
+    }
+
+    if (be32(d+36) != (u32)st->st_size) return ES_MODIFIED;
+
+    bool same_stat =
+        be32(d+0)  == (u32)st->st_ctim.tv_sec &&
+        be32(d+4)  == (u32)st->st_ctim.tv_nsec &&
+        be32(d+8)  == (u32)st->st_mtim.tv_sec &&
+        be32(d+12) == (u32)st->st_mtim.tv_nsec &&
+        be32(d+20) == (u32)st->st_ino &&
+        be32(d+28) == (u32)st->st_uid &&
+        be32(d+32) == (u32)st->st_gid;
+
+    bool racy =
+        be32(d+8) > (u32)index->mtime.tv_sec ||
+        (be32(d+8) == (u32)index->mtime.tv_sec && be32(d+12) >= (u32)index->mtime.tv_nsec);
+
+    if (same_stat && !racy) return ES_CLEAN;
+    return ES_UNSURE;
+}
+
+/// Whether the worktree copy of an entry differs from the index.
+bool index_entry_modified(Git_Index* index, Index_Entry* entry, int root_fd) {
+    struct stat st;
+    auto status = index_entry_status(index, entry, root_fd, &st);
+    if (status != ES_UNSURE) return status == ES_MODIFIED;
+    return !blob_matches(root_fd, index_path(index, entry), &st, entry->data + INDEX_OID_OFFSET);
+}
+
+// The verdict cache.
+//
+// The result of the last check is kept in subline-dirty, in
+// the git directory, keyed by the index checksum. It records:
+//
+//   - the verdict, and which entry made the worktree dirty. A
+//     dirty worktree usually stays dirty, so a repeat check is
+//     a single stat of that entry.
+//   - the mtime of every directory holding tracked files. The
+//     directories whose mtime moved are where files were last
+//     created, removed or renamed (which is also how most
+//     editors save), so their entries are checked first.
+//   - entries whose stat data could not be trusted, but whose
+//     contents were hashed and found clean, along with the stat
+//     data they had. These are not hashed again until their
+//     stat data changes.
+//
+// A directory's mtime does not move when a file in it is
+// written in place, so a clean verdict still stats every entry.
+// Stamping the directories would only add to that, so they are
+// stamped (and the cached stamps replaced) only when there is
+// no verdict yet or it was dirty.
+
+#define DIRTY_CACHE_VERSION 1
+#define DIRTY_VERIFIED_MAX 4096
+
+const char DIRTY_CACHE_MAGIC[8] = {'S','U','B','L','D','R','T',0};
+
+struct Dir_Stamp {
+    s64 sec;
+    s64 nsec;
+};
+
+struct Verified_Entry {
+    u32 entry;
+    u32 size;
+    u64 ino;
+    Dir_Stamp mtime;
+    Dir_Stamp ctime;
+};
+
+struct Dirty_Cache_Header {
+    char magic[8];
+    u32 version;
+    u32 dirty;
+    u8 checksum[20];
+    u32 entries;
+    u64 index_size;
+    Dir_Stamp index_mtime;
+    u32 dirty_entry;
+    u32 dir_count;
+    u32 verified_count;
+    u32 pad;
+};
+
+struct Dirty_Cache {
+    Dirty_Cache_Header header;
+    Dir_Stamp* dirs;
+    Verified_Entry* verified;
+};
+
+/// The checksum at the end of the index, which changes
+/// whenever git rewrites it.
+const u8* index_checksum(Git_Index* index) {
+    return index->map + index->size - 20;
+}
+
+Dirty_Cache_Header dirty_cache_key(Git_Index* index) {
+    Dirty_Cache_Header h = {0};
+    memcpy(h.magic, DIRTY_CACHE_MAGIC, sizeof(DIRTY_CACHE_MAGIC));
+    h.version = DIRTY_CACHE_VERSION;
+    memcpy(h.checksum, index_checksum(index), 20);
+    h.entries = index->entries.len;
+    h.index_size = index->size;
+    h.index_mtime = {index->mtime.tv_sec, index->mtime.tv_nsec};
+    return h;
+}
+
+/// Loads the cache, if it was written for this exact index.
+/// The returned arrays point into a mapping of the cache file.
+optional<Dirty_Cache> dirty_cache_load(const char* path, Git_Index* index, string* mapping) {
+    auto file = map_file(path);
+    if (file.error) return error(file.error);
+    *mapping = file.value;
+
+    if ((u64)file.value.len < sizeof(Dirty_Cache_Header)) return error("Invalid dirty cache");
+
+    Dirty_Cache cache;
+    memcpy(&cache.header, file.value.text, sizeof(Dirty_Cache_Header));
+    auto key = dirty_cache_key(index);
+    auto h = &cache.header;
+
+    if (memcmp(h->magic, key.magic, sizeof(key.magic)) != 0 ||
+        h->version != key.version ||
+        memcmp(h->checksum, key.checksum, 20) != 0 ||
+        h->entries != key.entries ||
+        h->index_size != key.index_size ||
+        h->index_mtime.sec != key.index_mtime.sec ||
+        h->index_mtime.nsec != key.index_mtime.nsec) {
+        return error("Stale dirty cache");
+    }
+
+    u64 size = sizeof(Dirty_Cache_Header)
+        + h->dir_count * sizeof(Dir_Stamp)
+        + h->verified_count * sizeof(Verified_Entry);
+    if ((u64)file.value.len != size || h->dirty_entry >= h->entries) {
+        return error("Invalid dirty cache");
+    }
+
+    cache.dirs = (Dir_Stamp*)(file.value.text + sizeof(Dirty_Cache_Header));
+    cache.verified = (Verified_Entry*)(cache.dirs + h->dir_count);
+    return ok(cache);
+}
+
+/// Written to a temporary file and renamed into place, so
+/// concurrent prompts never read a partial cache.
+void dirty_cache_store(const char* path, Dirty_Cache* cache) {
+    auto h = &cache->header;
+    auto tmp = stringf("%s.%d.tmp", path, getpid());
+    int fd = open(tmp.text, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) return;
+
+    struct { const void* data; u64 len; } parts[] = {
+        {h, sizeof(Dirty_Cache_Header)},
+        {cache->dirs, h->dir_count * sizeof(Dir_Stamp)},
+        {cache->verified, h->verified_count * sizeof(Verified_Entry)},
+    };
+
+    bool complete = true;
+    for (auto part : parts) {
+        u64 written = 0;
+        while (written < part.len) {
+            auto res = write(fd, (const char*)part.data + written, part.len - written);
+            if (res <= 0) break;
+            written += res;
+        }
+        if (written != part.len) complete = false;
+    }
+    close(fd);
+
+    if (complete) rename(tmp.text, path);
+    else unlink(tmp.text);
+}
+
+int compare_verified(const void* a, const void* b) {
+    auto x = ((const Verified_Entry*)a)->entry;
+    auto y = ((const Verified_Entry*)b)->entry;
+    return (x > y) - (x < y);
+}
+
+Verified_Entry verified_entry(u32 entry, struct stat* st) {
+    Verified_Entry v;
+    v.entry = entry;
+    v.size = st->st_size;
+    v.ino = st->st_ino;
+    v.mtime = {st->st_mtim.tv_sec, st->st_mtim.tv_nsec};
+    v.ctime = {st->st_ctim.tv_sec, st->st_ctim.tv_nsec};
+    return v;
+}
+
+bool same_verified(Verified_Entry* a, Verified_Entry* b) {
+    return a->entry == b->entry && a->size == b->size && a->ino == b->ino &&
+        a->mtime.sec == b->mtime.sec && a->mtime.nsec == b->mtime.nsec &&
+        a->ctime.sec == b->ctime.sec && a->ctime.nsec == b->ctime.nsec;
+}
+
+#define DIRTY_CHUNK 512
+#define DIRTY_MAX_THREADS 16
+// Below this many entries, threads cost more than they save.
+#define DIRTY_THREADED_MIN 4096
+
+struct Dirty_Check {
+    Git_Index* index;
+    int root_fd;
+    // Entries to check, in the order they should be checked.
+    u32* order;
+    int next_chunk;
+    int dirty;
+    u32 dirty_entry;
+
+    // Verified entries from the cache, sorted by entry.
+    Verified_Entry* known;
+    int known_count;
+    // Entries verified during this check.
+    Verified_Entry* verified;
+    int verified_count;
+};
+
+bool known_clean(Dirty_Check* check, Verified_Entry* v) {
+    int lo = 0;
+    int hi = check->known_count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (check->known[mid].entry < v->entry) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo < check->known_count && same_verified(&check->known[lo], v);
+}
+
+bool check_entry(Dirty_Check* check, u32 position) {
+    auto index = check->index;
+    auto entry = &index->entries.items[position];
+    struct stat st;
+
+    auto status = index_entry_status(index, entry, check->root_fd, &st);
+    if (status != ES_UNSURE) return status == ES_MODIFIED;
+
+    auto v = verified_entry(position, &st);
+    if (!known_clean(check, &v)) {
+        if (!blob_matches(check->root_fd, index_path(index, entry), &st, entry->data + INDEX_OID_OFFSET)) {
+            return true;
+        }
+    }
+
+    int slot = __atomic_fetch_add(&check->verified_count, 1, __ATOMIC_RELAXED);
+    if (slot < DIRTY_VERIFIED_MAX) check->verified[slot] = v;
+    return false;
+}
+
+void* dirty_worker(void* arg) {
+    auto check = (Dirty_Check*)arg;
+    int len = check->index->entries.len;
+
+    while (!__atomic_load_n(&check->dirty, __ATOMIC_RELAXED)) {
+        int chunk = __atomic_fetch_add(&check->next_chunk, 1, __ATOMIC_RELAXED);
+        int start = chunk * DIRTY_CHUNK;
+        if (start >= len) break;
+
+        int end = start + DIRTY_CHUNK;
+        if (end > len) end = len;
+        for (int i=start; i<end; i++) {
+            if (check_entry(check, check->order[i])) {
+                // Only the first worker to find a modification records it.
+                int expected = 0;
+                if (__atomic_compare_exchange_n(&check->dirty, &expected, 1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                    check->dirty_entry = check->order[i];
+                }
+                return 0;
+            }
+        }
+    }
+    return 0;
+}
+
+/// Length of the directory part of an entry's path.
+int dirname_len(const char* path) {
+    int last = 0;
+    for (int i=0; path[i] != 0; i++) {
+        if (path[i] == '/') last = i;
+    }
+    return last;
+}
+
+/// Splits the entries into runs of consecutive entries that share
+/// a directory, and stamps each run with its directory's mtime.
+/// A directory whose files are interleaved with a subdirectory's
+/// gets one run per stretch of its files.
+void dir_runs(Git_Index* index, int root_fd, bag<u32>* runs, bag<Dir_Stamp>* stamps) {
+    const char* prev = 0;
+    int prev_len = -1;
+    char dir[PATH_MAX];
+
+    for (int i=0; i<index->entries.len; i++) {
+        auto path = index_path(index, &index->entries.items[i]);
+        int len = dirname_len(path);
+        if (len == prev_len && memcmp(path, prev, len) == 0) continue;
+
+        prev = path;
+        prev_len = len;
+        bag_add(runs, (u32)i);
+
+        if (len == 0) {
+            dir[0] = '.';
+            dir[1] = 0;
+        } else {
+            memcpy(dir, path, len);
+            dir[len] = 0;
+        }
+
+        struct stat st;
+        Dir_Stamp stamp = {-1, -1};
+        if (fstatat(root_fd, dir, &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            stamp = {st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+        }
+        bag_add(stamps, stamp);
+    }
+}
+
+/// Whether any tracked file in the worktree differs from the
+/// index. Entries are checked in chunks by a pool of threads,
+/// all of which stop as soon as one modification is found.
+optional<bool> git_dirty(Git_State* git) {
+    char path[PATH_MAX];
+    fill_charp(git->dir, path);
+
+    int root_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd == -1) return error("Failed to open the repository");
+
+    git_path(git->git_dir, "index", path);
+    auto index_opt = git_index_load(path);
+    if (index_opt.error) {
+        close(root_fd);
+        return error(index_opt.error);
+    }
+    auto index = index_opt.value;
+    int len = index.entries.len;
+
+    git_path(git->git_dir, "subline-dirty", path);
+    string mapping = {0};
+    auto cache = dirty_cache_load(path, &index, &mapping);
+
+    if (cache.error == 0 && cache.value.header.dirty) {
+        auto entry = &index.entries.items[cache.value.header.dirty_entry];
+        if (index_entry_modified(&index, entry, root_fd)) {
+            if (mapping.len > 0) munmap((void*)mapping.text, mapping.len);
+            close(root_fd);
+            git_index_free(&index);
+            return ok(true);
+        }
+    }
+
+    bool stamp_dirs = cache.error != 0 || cache.value.header.dirty;
+    auto runs = create_bag<u32>(64);
+    auto stamps = create_bag<Dir_Stamp>(64);
+    if (stamp_dirs) dir_runs(&index, root_fd, &runs, &stamps);
+    bool same_dirs = cache.error == 0 && cache.value.header.dir_count == (u32)runs.len;
+
+    // Entries in directories that changed go first.
+    auto order = (u32*)malloc(sizeof(u32) * (len > 0 ? len : 1));
+    int ordered = 0;
+    bool dirs_moved = false;
+    if (!stamp_dirs) {
+        for (int i=0; i<len; i++) order[ordered++] = i;
+    }
+    for (int pass=0; pass<2 && stamp_dirs; pass++) {
+        for (int r=0; r<runs.len; r++) {
+            bool moved = !same_dirs ||
+                cache.value.dirs[r].sec != stamps.items[r].sec ||
+                cache.value.dirs[r].nsec != stamps.items[r].nsec;
+            if (moved) dirs_moved = true;
+            if (moved != (pass == 0)) continue;
+
+            u32 end = r+1 < runs.len ? runs.items[r+1] : len;
+            for (u32 i=runs.items[r]; i<end; i++) order[ordered++] = i;
+        }
+    }
+
+    Dirty_Check check = {0};
+    check.index = &index;
+    check.root_fd = root_fd;
+    check.order = order;
+    check.verified = (Verified_Entry*)malloc(sizeof(Verified_Entry) * DIRTY_VERIFIED_MAX);
+    if (cache.error == 0) {
+        check.known = cache.value.verified;
+        check.known_count = cache.value.header.verified_count;
+    }
+
+    int threads = 1;
+    if (len >= DIRTY_THREADED_MIN) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+        if (threads > DIRTY_MAX_THREADS) threads = DIRTY_MAX_THREADS;
+        if (threads < 1) threads = 1;
+    }
+
+    // The calling thread is one of the workers.
+    pthread_t pool[DIRTY_MAX_THREADS];
+    int started = 0;
+    for (int i=1; i<threads; i++) {
+        if (pthread_create(&pool[started], 0, dirty_worker, &check) == 0) started++;
+    }
+    dirty_worker(&check);
+    for (int i=0; i<started; i++) {
+        pthread_join(pool[i], 0);
+    }
+
+    bool dirty = check.dirty != 0;
+    int verified = check.verified_count < DIRTY_VERIFIED_MAX ? check.verified_count : DIRTY_VERIFIED_MAX;
+    qsort(check.verified, verified, sizeof(Verified_Entry), compare_verified);
+
+    // An idle repository keeps its cache as it is.
+    bool unchanged = cache.error == 0 && !dirs_moved && !dirty &&
+        cache.value.header.dirty == 0 && (u32)verified == cache.value.header.verified_count &&
+        (verified == 0 || memcmp(check.verified, cache.value.verified, sizeof(Verified_Entry) * verified) == 0);
+
+    if (!unchanged) {
+        Dirty_Cache out;
+        out.header = dirty_cache_key(&index);
+        out.header.dirty = dirty;
+        out.header.dirty_entry = dirty ? check.dirty_entry : 0;
+        out.header.dir_count = stamp_dirs ? runs.len : cache.value.header.dir_count;
+        out.header.verified_count = verified;
+        out.dirs = stamp_dirs ? stamps.items : cache.value.dirs;
+        out.verified = check.verified;
+        dirty_cache_store(path, &out);
+    }
+
+    if (mapping.len > 0) munmap((void*)mapping.text, mapping.len);
+    free(check.verified);
+    free(order);
+    free(runs.items);
+    free(stamps.items);
+    close(root_fd);
+    git_index_free(&index);
+    return ok(dirty);
+}
+
+#endif
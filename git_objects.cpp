@@ -0,0 +1,754 @@
+#ifndef subline_git_objects
+#define subline_git_objects
+
+// Reading objects from a repository's object store.
+//
+// Loose objects live in objects/xx/yyyy... (named after their
+// id), and are zlib-compressed: a "<type> <size>\0" header,
+// followed by the contents.
+//
+// Most objects are in packs instead. Every objects/pack/*.pack
+// comes with an .idx listing the ids of the objects in it, in
+// sorted order, behind a 256-entry fanout table (the number of
+// ids whose first byte is at most n), along with each object's
+// offset in the pack. Packed objects are zlib-compressed too,
+// but may be stored as a delta against another object, named
+// either by its offset in the same pack (OFS_DELTA) or its id
+// (REF_DELTA). Chains of deltas share their bases, so recently
+// used bases are kept in a small cache.
+// Formats: https://git-scm.com/docs/gitformat-pack
+
+#include <zlib.h>
+#include <dirent.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "utils.cpp"
+#include "files.cpp"
+#include "git.cpp"
+
+// Numbered as in pack files.
+enum OBJECT_TYPE {
+    OBJ_NONE   = 0,
+    OBJ_COMMIT = 1,
+    OBJ_TREE   = 2,
+    OBJ_BLOB   = 3,
+    OBJ_TAG    = 4,
+    OBJ_OFS_DELTA = 6,
+    OBJ_REF_DELTA = 7,
+};
+
+struct Git_Object {
+    OBJECT_TYPE type;
+    // Allocated with malloc, and 0-terminated.
+    string data;
+};
+
+void git_object_free(Git_Object* obj) {
+    free((void*)obj->data.text);
+    obj->data = {0};
+}
+
+OBJECT_TYPE object_type(const char* name, int len) {
+    if (len == 6 && memcmp(name, "commit", 6) == 0) return OBJ_COMMIT;
+    if (len == 4 && memcmp(name, "tree", 4) == 0) return OBJ_TREE;
+    if (len == 4 && memcmp(name, "blob", 4) == 0) return OBJ_BLOB;
+    if (len == 3 && memcmp(name, "tag", 3) == 0) return OBJ_TAG;
+    return OBJ_NONE;
+}
+
+optional<Git_Object> read_loose(Git_State* git, Git_Oid* oid) {
+    char path[PATH_MAX];
+    auto hex = oid_hex(oid, OID_HEX_LEN);
+    auto name = stringf("objects/%.2s/%.38s", hex.text, hex.text + 2);
+    git_path(git->common_dir, name.text, path);
+    free((void*)hex.text);
+    free((void*)name.text);
+
+    auto file = map_file(path);
+    if (file.error) return error("Object not found");
+    auto in = (const u8*)file.value.text;
+    u64 in_len = file.value.len;
+
+    // Inflate just enough to read the header, then the rest
+    // straight into a buffer of the right size.
+    u8 header[64];
+    z_stream z = {0};
+    inflateInit(&z);
+    z.next_in = (Bytef*)in;
+    z.avail_in = in_len;
+    z.next_out = header;
+    z.avail_out = sizeof(header);
+    inflate(&z, Z_SYNC_FLUSH);
+    u64 got = sizeof(header) - z.avail_out;
+
+    Git_Object obj = {OBJ_NONE};
+    auto nul = (const u8*)memchr(header, 0, got);
+    auto space = (const u8*)memchr(header, ' ', got);
+    u64 size = 0;
+    u8* buf = 0;
+    bool inflated = false;
+
+    if (nul != 0 && space != 0 && space < nul) {
+        obj.type = object_type((const char*)header, space - header);
+        size = strtoull((const char*)space + 1, 0, 10);
+        u64 extra = got - (nul - header + 1);
+
+        if (obj.type != OBJ_NONE && extra <= size) {
+            buf = (u8*)malloc(size + 1);
+            memcpy(buf, nul + 1, extra);
+            z.next_out = buf + extra;
+            z.avail_out = size - extra;
+            int res = Z_OK;
+            while (res == Z_OK && z.avail_out > 0) res = inflate(&z, Z_FINISH);
+            inflated = z.avail_out == 0;
+        }
+    }
+
+    inflateEnd(&z);
+    if (in_len > 0) munmap((void*)in, in_len);
+    if (!inflated) {
+        free(buf);
+        return error("Corrupt loose object");
+    }
+
+    buf[size] = 0;
+    obj.data = {(const char*)buf, (int)size};
+    return ok(obj);
+}
+
+#define IDX_SIGNATURE 0xff744f63
+#define IDX_HEADER_SIZE 8
+#define IDX_LARGE_OFFSET 0x80000000
+
+// Bases of deltas that were recently resolved, indexed by their
+// pack and offset. Slots are overwritten on collision, and the
+// whole cache is dropped once it holds more than its limit.
+#define DELTA_CACHE_SLOTS 256
+#define DELTA_CACHE_LIMIT (32 << 20)
+
+struct Pack {
+    u8* idx;
+    u64 idx_size;
+    u32 count;
+    // Mapped on first use.
+    u8* data;
+    u64 size;
+    string path;
+};
+
+struct Delta_Cache_Entry {
+    Pack* pack;
+    u64 offset;
+    OBJECT_TYPE type;
+    string data;
+};
+
+struct Object_Store {
+    bag<Pack*> packs;
+    Delta_Cache_Entry cache[DELTA_CACHE_SLOTS];
+    u64 cached;
+};
+
+/// Whether a 256-entry fanout table never decreases. Its last
+/// entry is the number of ids, so every search bound it gives is
+/// then within the table of ids.
+bool fanout_valid(const u8* fanout) {
+    for (int i=1; i<256; i++) {
+        if (be32(fanout + (i-1)*4) > be32(fanout + i*4)) return false;
+    }
+    return true;
+}
+
+bool pack_load_idx(const char* path, Pack* pack) {
+    auto file = map_file(path);
+    if (file.error) return false;
+    auto m = (u8*)file.value.text;
+    u64 size = file.value.len;
+
+    // Only version 2 indexes are supported; git hasn't written
+    // version 1 by default since 2009.
+    bool valid = size >= IDX_HEADER_SIZE + 256*4 && be32(m) == IDX_SIGNATURE && be32(m+4) == 2;
+    if (valid) {
+        pack->count = be32(m + IDX_HEADER_SIZE + 255*4);
+        valid = IDX_HEADER_SIZE + 256*4 + (u64)pack->count * (20 + 4 + 4) <= size &&
+            fanout_valid(m + IDX_HEADER_SIZE);
+    }
+    if (!valid) {
+        if (size > 0) munmap(m, size);
+        return false;
+    }
+    pack->idx = m;
+    pack->idx_size = size;
+    return true;
+}
+
+/// Lists the repository's packs. Nothing is read from them yet.
+Object_Store* git_objects(Git_State* git) {
+    if (git->objects != 0) return git->objects;
+
+    auto store = (Object_Store*)calloc(1, sizeof(Object_Store));
+    store->packs = create_bag<Pack*>(8);
+    git->objects = store;
+
+    char path[PATH_MAX];
+    git_path(git->common_dir, "objects/pack", path);
+    DIR* dir = opendir(path);
+    if (dir == 0) return store;
+
+    int base = strlen(path);
+    while (auto ent = readdir(dir)) {
+        int len = strlen(ent->d_name);
+        if (len < 5 || strcmp(ent->d_name + len - 4, ".idx") != 0) continue;
+        if (base + 1 + len >= PATH_MAX) continue;
+        path[base] = '/';
+        memcpy(path + base + 1, ent->d_name, len + 1);
+
+        Pack pack = {0};
+        if (!pack_load_idx(path, &pack)) continue;
+        memcpy(path + base + 1 + len - 4, ".pack", 6);
+        pack.path = stringf("%s", path);
+
+        auto copy = (Pack*)malloc(sizeof(Pack));
+        *copy = pack;
+        bag_add(&store->packs, copy);
+    }
+    closedir(dir);
+    path[base] = 0;
+    return store;
+}
+
+/// Finds an object's offset in a pack: the fanout table narrows
+/// the search to ids starting with the same byte, then a binary
+/// search finds the id itself.
+bool pack_find(Pack* pack, Git_Oid* oid, u64* offset) {
+    auto fanout = pack->idx + IDX_HEADER_SIZE;
+    auto names = fanout + 256*4;
+    auto offsets = names + (u64)pack->count * (20 + 4);
+    auto large = offsets + (u64)pack->count * 4;
+
+    u8 first = oid->hash[0];
+    u32 lo = first == 0 ? 0 : be32(fanout + (first-1)*4);
+    u32 hi = be32(fanout + first*4);
+    while (lo < hi) {
+        u32 mid = lo + (hi - lo) / 2;
+        int cmp = memcmp(names + (u64)mid*20, oid->hash, 20);
+        if (cmp < 0) { lo = mid + 1; continue; }
+        if (cmp > 0) { hi = mid; continue; }
+
+        u32 off = be32(offsets + (u64)mid*4);
+        if (off & IDX_LARGE_OFFSET) {
+            auto entry = large + (u64)(off & ~IDX_LARGE_OFFSET) * 8;
+            if (entry + 8 > pack->idx + pack->idx_size) return false;
+            *offset = be64(entry);
+        } else {
+            *offset = off;
+        }
+        return true;
+    }
+    return false;
+}
+
+bool pack_map(Pack* pack) {
+    if (pack->data != 0) return true;
+    auto file = map_file(pack->path.text);
+    if (file.error || file.value.len < 12 || memcmp(file.value.text, "PACK", 4) != 0) {
+        if (file.error == 0 && file.value.len > 0) munmap((void*)file.value.text, file.value.len);
+        return false;
+    }
+    pack->data = (u8*)file.value.text;
+    pack->size = file.value.len;
+    return true;
+}
+
+bool store_find(Object_Store* store, Git_Oid* oid, Pack** pack, u64* offset) {
+    for (int i=0; i<store->packs.len; i++) {
+        if (pack_find(store->packs.items[i], oid, offset) && pack_map(store->packs.items[i])) {
+            *pack = store->packs.items[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+struct Pack_Entry {
+    OBJECT_TYPE type;
+    u64 size;
+    // The compressed data, after the header (and delta base).
+    const u8* data;
+    u64 base_offset;
+    Git_Oid base_oid;
+};
+
+/// Parses the header of the object at the given offset.
+bool pack_entry(Pack* pack, u64 offset, Pack_Entry* out) {
+    auto p = pack->data + offset;
+    auto end = pack->data + pack->size;
+    if (offset < 12 || p >= end) return false;
+
+    u8 c = *p++;
+    out->type = (OBJECT_TYPE)((c >> 4) & 7);
+    out->size = c & 15;
+    int shift = 4;
+    while ((c & 128) && p < end && shift < 64) {
+        c = *p++;
+        out->size |= (u64)(c & 127) << shift;
+        shift += 7;
+    }
+
+    if (out->type == OBJ_OFS_DELTA) {
+        if (p >= end) return false;
+        c = *p++;
+        u64 rel = c & 127;
+        while ((c & 128) && p < end) {
+            c = *p++;
+            rel = ((rel + 1) << 7) + (c & 127);
+        }
+        if (rel > offset) return false;
+        out->base_offset = offset - rel;
+    } else if (out->type == OBJ_REF_DELTA) {
+        if (p + 20 > end) return false;
+        memcpy(out->base_oid.hash, p, 20);
+        p += 20;
+    } else if (out->type < OBJ_COMMIT || out->type > OBJ_TAG) {
+        return false;
+    }
+
+    out->data = p;
+    return p <= end;
+}
+
+/// Inflates exactly size bytes from a pack. The result is
+/// 0-terminated, for convenience.
+u8* pack_inflate(Pack* pack, const u8* data, u64 size) {
+    auto out = (u8*)malloc(size + 1);
+    z_stream z = {0};
+    inflateInit(&z);
+    z.next_in = (Bytef*)data;
+    z.avail_in = pack->data + pack->size - data;
+    z.next_out = out;
+    z.avail_out = size;
+    int res = Z_OK;
+    while (res == Z_OK && z.avail_out > 0) res = inflate(&z, Z_FINISH);
+    // An empty object still has to be a valid stream.
+    if (size == 0) res = inflate(&z, Z_FINISH);
+    bool complete = z.avail_out == 0 && (res == Z_STREAM_END || res == Z_OK || res == Z_BUF_ERROR);
+    inflateEnd(&z);
+    if (!complete) {
+        free(out);
+        return 0;
+    }
+    out[size] = 0;
+    return out;
+}
+
+u64 delta_varint(const u8** p, const u8* end) {
+    u64 val = 0;
+    int shift = 0;
+    while (*p < end && shift < 64) {
+        u8 c = *(*p)++;
+        val |= (u64)(c & 127) << shift;
+        shift += 7;
+        if (!(c & 128)) break;
+    }
+    return val;
+}
+
+/// Applies a delta to its base. Returns the result, or 0 if the
+/// delta doesn't fit the base.
+u8* apply_delta(const u8* base, u64 base_size, const u8* delta, u64 delta_size, u64* out_size) {
+    auto p = delta;
+    auto end = delta + delta_size;
+    if (delta_varint(&p, end) != base_size) return 0;
+    u64 size = delta_varint(&p, end);
+
+    auto out = (u8*)malloc(size + 1);
+    u64 len = 0;
+    while (p < end) {
+        u8 op = *p++;
+        if (op & 0x80) {
+            // Copy from the base: which bytes of offset and size
+            // are present is given by the low bits of op.
+            u64 offset = 0;
+            u64 count = 0;
+            for (int i=0; i<4; i++) {
+                if ((op & (1 << i)) && p < end) offset |= (u64)*p++ << (i*8);
+            }
+            for (int i=0; i<3; i++) {
+                if ((op & (16 << i)) && p < end) count |= (u64)*p++ << (i*8);
+            }
+            if (count == 0) count = 0x10000;
+            if (offset + count > base_size || len + count > size) break;
+            memcpy(out + len, base + offset, count);
+            len += count;
+        } else if (op != 0) {
+            // Insert the next op bytes of the delta.
+            if (p + op > end || len + op > size) break;
+            memcpy(out + len, p, op);
+            p += op;
+            len += op;
+        } else {
+            break;
+        }
+    }
+
+    if (p != end || len != size) {
+        free(out);
+        return 0;
+    }
+    out[size] = 0;
+    *out_size = size;
+    return out;
+}
+
+Delta_Cache_Entry* cache_slot(Object_Store* store, Pack* pack, u64 offset) {
+    u64 h = offset * 0x9E3779B97F4A7C15ull ^ (u64)(uintptr_t)pack;
+    return &store->cache[(h >> 32) % DELTA_CACHE_SLOTS];
+}
+
+void cache_store(Object_Store* store, Pack* pack, u64 offset, OBJECT_TYPE type, const u8* data, u64 size) {
+    if (size > DELTA_CACHE_LIMIT / 4) return;
+    if (store->cached + size > DELTA_CACHE_LIMIT) {
+        for (int i=0; i<DELTA_CACHE_SLOTS; i++) {
+            free((void*)store->cache[i].data.text);
+            store->cache[i] = {0};
+        }
+        store->cached = 0;
+    }
+
+    auto slot = cache_slot(store, pack, offset);
+    store->cached -= slot->data.len;
+    free((void*)slot->data.text);
+
+    auto copy = (char*)malloc(size + 1);
+    memcpy(copy, data, size);
+    copy[size] = 0;
+    *slot = {pack, offset, type, {copy, (int)size}};
+    store->cached += size;
+}
+
+struct Delta_Link {
+    Pack* pack;
+    u64 offset;
+};
+
+#define DELTA_MAX_DEPTH 10000
+
+optional<Git_Object> read_packed(Git_State* git, Pack* pack, u64 offset) {
+    auto store = git_objects(git);
+    auto chain = create_bag<Delta_Link>(8);
+
+    // Follow the chain of deltas down to a base, which is either
+    // stored whole or was cached by an earlier read.
+    OBJECT_TYPE type = OBJ_NONE;
+    u8* data = 0;
+    u64 size = 0;
+    while (chain.len < DELTA_MAX_DEPTH) {
+        auto cached = cache_slot(store, pack, offset);
+        if (cached->pack == pack && cached->offset == offset && cached->data.text != 0) {
+            type = cached->type;
+            size = cached->data.len;
+            data = (u8*)malloc(size + 1);
+            memcpy(data, cached->data.text, size + 1);
+            break;
+        }
+
+        Pack_Entry entry;
+        if (!pack_entry(pack, offset, &entry)) break;
+
+        if (entry.type == OBJ_OFS_DELTA) {
+            bag_add(&chain, {pack, offset});
+            offset = entry.base_offset;
+        } else if (entry.type == OBJ_REF_DELTA) {
+            bag_add(&chain, {pack, offset});
+            if (!store_find(store, &entry.base_oid, &pack, &offset)) break;
+        } else {
+            type = entry.type;
+            size = entry.size;
+            data = pack_inflate(pack, entry.data, size);
+            break;
+        }
+    }
+
+    // Apply the deltas, from the base up. Every intermediate
+    // result is the base of the next delta, so it is cached.
+    for (int i=chain.len-1; i>=0 && data != 0; i--) {
+        auto link = chain.items[i];
+        Pack_Entry entry;
+        pack_entry(link.pack, link.offset, &entry);
+        auto delta = pack_inflate(link.pack, entry.data, entry.size);
+        if (delta == 0) {
+            free(data);
+            data = 0;
+            break;
+        }
+
+        // i+1 is where data came from.
+        auto base = i+1 < chain.len ? chain.items[i+1] : Delta_Link{pack, offset};
+        cache_store(store, base.pack, base.offset, type, data, size);
+
+        u64 out_size;
+        auto out = apply_delta(data, size, delta, entry.size, &out_size);
+        free(delta);
+        free(data);
+        data = out;
+        size = out_size;
+    }
+
+    free(chain.items);
+    if (data == 0 || type == OBJ_NONE) {
+        free(data);
+        return error("Corrupt packed object");
+    }
+
+    Git_Object obj;
+    obj.type = type;
+    obj.data = {(const char*)data, (int)size};
+    return ok(obj);
+}
+
+/// Reads an object, by id. Packs are searched first, since
+/// that's where most objects are.
+optional<Git_Object> git_read_object(Git_State* git, Git_Oid* oid) {
+    Pack* pack;
+    u64 offset;
+    if (store_find(git_objects(git), oid, &pack, &offset)) {
+        return read_packed(git, pack, offset);
+    }
+    return read_loose(git, oid);
+}
+
+/// Follows tags to the object they point to.
+optional<Git_Oid> git_peel(Git_State* git, Git_Oid* oid, OBJECT_TYPE* type) {
+    auto current = *oid;
+    for (int depth=0; depth<SYMREF_MAX_DEPTH; depth++) {
+        auto obj = git_read_object(git, &current);
+        if (obj.error) return error(obj.error);
+        *type = obj.value.type;
+
+        bool is_tag = obj.value.type == OBJ_TAG;
+        bool valid = !is_tag ||
+            (starts(&obj.value.data, "object ") && parse_oid(obj.value.data.text + 7, obj.value.data.len - 7, &current));
+        git_object_free(&obj.value);
+
+        if (!valid) return error("Corrupt tag");
+        if (!is_tag) return ok(current);
+    }
+    return error("Tags nested too deeply");
+}
+
+/// The message of a commit or a tag, after its headers.
+string object_message(string* data) {
+    auto p = data->text;
+    auto end = data->text + data->len;
+    while (p < end) {
+        if (*p == '\n') return string{p + 1, (int)(end - p - 1)};
+        auto eol = (const char*)memchr(p, '\n', end - p);
+        if (eol == 0) break;
+        p = eol + 1;
+    }
+    return {0};
+}
+
+/// The subject of a commit: its message's first paragraph,
+/// joined into one line, as git log --format=%s shows it.
+string commit_subject(string* commit) {
+    auto message = object_message(commit);
+    auto out = (char*)malloc(message.len + 1);
+    int len = 0;
+    int i = 0;
+    while (i < message.len) {
+        int eol = i;
+        while (eol < message.len && message.text[eol] != '\n') eol++;
+        auto line = string{message.text + i, eol - i};
+        line = trim(&line);
+        if (line.len == 0) {
+            if (len > 0) break;
+        } else {
+            if (len > 0) out[len++] = ' ';
+            memcpy(out + len, line.text, line.len);
+            len += line.len;
+        }
+        i = eol + 1;
+    }
+    out[len] = 0;
+    return {out, len};
+}
+
+/// Subject of the commit HEAD points to.
+optional<string> git_subject(Git_State* git) {
+    auto head = git_resolve_ref(git, "HEAD");
+    if (head.error) return error(head.error);
+
+    auto obj = git_read_object(git, &head.value);
+    if (obj.error) return error(obj.error);
+    if (obj.value.type != OBJ_COMMIT) {
+        git_object_free(&obj.value);
+        return error("HEAD is not a commit");
+    }
+
+    auto subject = commit_subject(&obj.value.data);
+    git_object_free(&obj.value);
+    return ok(subject);
+}
+
+struct Git_Tag {
+    // The commit the tag points to, once peeled.
+    Git_Oid commit;
+    string name;
+};
+
+int compare_tag_name(const void* a, const void* b) {
+    return strcmp(((Git_Tag*)a)->name.text, ((Git_Tag*)b)->name.text);
+}
+
+int compare_tag_commit(const void* a, const void* b) {
+    return memcmp(((Git_Tag*)a)->commit.hash, ((Git_Tag*)b)->commit.hash, 20);
+}
+
+/// Adds the tag if it is annotated and points to a commit.
+void add_annotated(Git_State* git, bag<Git_Tag>* out, const char* name, Git_Oid* oid) {
+    auto obj = git_read_object(git, oid);
+    if (obj.error) return;
+    bool is_tag = obj.value.type == OBJ_TAG;
+    git_object_free(&obj.value);
+    if (!is_tag) return;
+
+    OBJECT_TYPE type;
+    auto commit = git_peel(git, oid, &type);
+    if (commit.error || type != OBJ_COMMIT) return;
+    bag_add(out, {commit.value, stringf("%s", name)});
+}
+
+void loose_tags(Git_State* git, char* path, int path_len, char* name, int name_len, bag<Git_Tag>* out) {
+    DIR* dir = opendir(path);
+    if (dir == 0) return;
+    while (auto ent = readdir(dir)) {
+        if (ent->d_name[0] == '.') continue;
+        int len = strlen(ent->d_name);
+        if (path_len + 1 + len >= PATH_MAX || name_len + 1 + len >= PATH_MAX) continue;
+        path[path_len] = '/';
+        memcpy(path + path_len + 1, ent->d_name, len + 1);
+        // Names are relative to refs/tags, so only nested ones
+        // have a slash.
+        int sub_len = name_len;
+        if (name_len > 0) name[sub_len++] = '/';
+        memcpy(name + sub_len, ent->d_name, len + 1);
+
+        char buf[256];
+        int read = read_small(path, buf, sizeof(buf));
+        Git_Oid oid;
+        // Directories can be opened, but not read.
+        if (read <= 0) {
+            loose_tags(git, path, path_len + 1 + len, name, sub_len + len, out);
+        } else if (parse_oid(buf, read, &oid)) {
+            add_annotated(git, out, name, &oid);
+        }
+    }
+    closedir(dir);
+    path[path_len] = 0;
+    name[name_len] = 0;
+}
+
+/// Lists the annotated tags that point to commits, sorted by
+/// the commit. Tag names are given without refs/tags/.
+bag<Git_Tag> git_annotated_tags(Git_State* git) {
+    auto tags = create_bag<Git_Tag>(16);
+    char path[PATH_MAX];
+    char name[PATH_MAX] = {0};
+    git_path(git->common_dir, "refs/tags", path);
+    loose_tags(git, path, strlen(path), name, 0, &tags);
+
+    // Loose refs take precedence over packed ones.
+    int loose = tags.len;
+    qsort(tags.items, loose, sizeof(Git_Tag), compare_tag_name);
+
+    git_path(git->common_dir, "packed-refs", path);
+    auto file = map_file(path);
+    if (file.error == 0) {
+        auto line = file.value.text;
+        auto end = line + file.value.len;
+
+        // When packed-refs is peeled, annotated tags are the ones
+        // followed by the commit they peel to ("^<oid>"), so tag
+        // objects don't need to be read.
+        bool peeled = false;
+        if (line < end && *line == '#') {
+            auto eol = (const char*)memchr(line, '\n', end - line);
+            if (eol == 0) eol = end;
+            peeled = memmem(line, eol - line, " peeled", 7) != 0 || memmem(line, eol - line, " fully-peeled", 13) != 0;
+            line = eol < end ? eol + 1 : end;
+        }
+
+        while (line < end) {
+            auto eol = (const char*)memchr(line, '\n', end - line);
+            if (eol == 0) eol = end;
+            auto next = eol < end ? eol + 1 : end;
+            auto peel = next < end && *next == '^' ? next + 1 : 0;
+
+            auto ref = line + OID_HEX_LEN + 1;
+            Git_Oid oid;
+            if (ref < eol && strncmp(ref, "refs/tags/", 10) == 0 && parse_oid(line, eol - line, &oid)) {
+                auto tag = Git_Tag{{0}, stringf("%.*s", (int)(eol - ref - 10), ref + 10)};
+                bool shadowed = bsearch(&tag, tags.items, loose, sizeof(Git_Tag), compare_tag_name) != 0;
+                if (shadowed) {
+                    free((void*)tag.name.text);
+                } else if (!peeled) {
+                    add_annotated(git, &tags, tag.name.text, &oid);
+                    free((void*)tag.name.text);
+                } else if (peel && parse_oid(peel, end - peel, &tag.commit)) {
+                    // The peeled id may still be a tree or a blob.
+                    bag_add(&tags, tag);
+                } else {
+                    free((void*)tag.name.text);
+                }
+            }
+
+            line = next;
+            while (line < end && *line == '^') {
+                auto peel_end = (const char*)memchr(line, '\n', end - line);
+                line = peel_end == 0 ? end : peel_end + 1;
+            }
+        }
+        if (file.value.len > 0) munmap((void*)file.value.text, file.value.len);
+    }
+
+    qsort(tags.items, tags.len, sizeof(Git_Tag), compare_tag_commit);
+    return tags;
+}
+
+/// The committer date of a commit, in seconds since the epoch,
+/// or 0 if it has none.
+u64 commit_date(string* commit) {
+    auto p = commit->text;
+    auto end = commit->text + commit->len;
+    while (p < end && *p != '\n') {
+        auto eol = (const char*)memchr(p, '\n', end - p);
+        if (eol == 0) eol = end;
+        if (eol - p > 10 && memcmp(p, "committer ", 10) == 0) {
+            // The date follows the email, which may not hold a '>'.
+            auto email_end = (const char*)memrchr(p, '>', eol - p);
+            if (email_end == 0) return 0;
+            return strtoull(email_end + 1, 0, 10);
+        }
+        p = eol + 1;
+    }
+    return 0;
+}
+
+/// Parses the parents out of a commit's contents.
+void commit_parents(string* commit, bag<Git_Oid>* out) {
+    auto p = commit->text;
+    auto end = commit->text + commit->len;
+    while (p < end && *p != '\n') {
+        auto eol = (const char*)memchr(p, '\n', end - p);
+        if (eol == 0) eol = end;
+        Git_Oid oid;
+        if (eol - p > 7 && memcmp(p, "parent ", 7) == 0 && parse_oid(p + 7, eol - p - 7, &oid)) {
+            bag_add(out, oid);
+        }
+        p = eol + 1;
+    }
+}
+
+#endif
@@ -0,0 +1,379 @@
+#ifndef subline_gitignore
+#define subline_gitignore
+
+// Matching paths against .gitignore rules, without running git.
+//
+// Rules come from .gitignore files in the worktree, which apply
+// to the directory they are in, from .git/info/exclude, and from
+// core.excludesFile. Within a file the last matching rule wins,
+// and files deeper in the worktree take precedence over the ones
+// above them. Patterns without a slash (other than a trailing one)
+// match the name of a file at any depth; others are anchored to
+// the directory of the file they are in.
+//
+// Rules are compiled as they are read. Patterns that are plain
+// names (build, .DS_Store) are kept sorted, so they cost a binary
+// search no matter how many there are, and so are the ones that
+// are a single * followed by a name (*.o). Others are matched by
+// a small glob matcher, after checking the literal text before
+// their first wildcard.
+// Format: https://git-scm.com/docs/gitignore
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.cpp"
+#include "files.cpp"
+#include "git.cpp"
+
+#define RULE_NEGATE   1
+// Only matches directories (a trailing slash).
+#define RULE_DIR_ONLY 2
+// Matches the name of a file at any depth (no other slash).
+#define RULE_BASENAME 4
+
+enum IGNORE_MATCH {
+    IM_NONE = 0,
+    IM_IGNORED,
+    // Matched by a negated rule: ignored by no rule below it.
+    IM_INCLUDED,
+};
+
+struct Ignore_Rule {
+    // Without the !, the leading and the trailing slash.
+    string pattern;
+    u8 flags;
+    // Position in the file the rule came from.
+    int index;
+    // Length of the text before the first wildcard.
+    int prefix;
+};
+
+struct Ignore_List {
+    // Rules of the directory above, or of the lower-precedence
+    // sources for the rules of the root directory.
+    Ignore_List* parent;
+    // Directory the rules apply to, relative to the root of the
+    // worktree, with a trailing slash. Empty for the root.
+    string base;
+    // Rules that are plain names, and rules of the form *<name>
+    // (by the name after the *), sorted by name and then index.
+    bag<Ignore_Rule> names;
+    bag<Ignore_Rule> suffixes;
+    // Everything else, in order.
+    bag<Ignore_Rule> globs;
+    int count;
+};
+
+bool glob_special(char c) {
+    return c == '*' || c == '?' || c == '[' || c == '\\';
+}
+
+/// Matches text against a [...] class starting at *p, and moves
+/// *p past it. Returns -1 if the class isn't closed.
+int glob_class(const char** p, const char* end, char c) {
+    auto q = *p + 1;
+    bool negate = q < end && (*q == '!' || *q == '^');
+    if (negate) q++;
+
+    bool matched = false;
+    bool first = true;
+    while (q < end && (*q != ']' || first)) {
+        first = false;
+        char lo = *q;
+        if (lo == '\\' && q+1 < end) lo = *++q;
+        q++;
+        char hi = lo;
+        if (q+1 < end && *q == '-' && q[1] != ']') {
+            hi = q[1];
+            if (hi == '\\' && q+2 < end) { q++; hi = q[1]; }
+            q += 2;
+        }
+        if ((u8)c >= (u8)lo && (u8)c <= (u8)hi) matched = true;
+    }
+    if (q >= end) return -1;
+    *p = q + 1;
+    return matched != negate;
+}
+
+/// Matches text against a glob, the way git's wildmatch does
+/// with WM_PATHNAME: wildcards don't match slashes, except for
+/// a ** between slashes, which matches any number of directories.
+bool glob_match(const char* start, const char* p, const char* pend, const char* s, const char* send) {
+    while (p < pend) {
+        char c = *p;
+        if (c == '*') {
+            auto q = p;
+            while (q < pend && *q == '*') q++;
+            bool any_depth = q - p >= 2 && (p == start || p[-1] == '/') && (q == pend || *q == '/');
+            if (any_depth) {
+                if (q == pend) return true;
+                // "**/" matches nothing, or any run of directories.
+                q++;
+                for (auto t = s; ; ) {
+                    if (glob_match(start, q, pend, t, send)) return true;
+                    auto slash = (const char*)memchr(t, '/', send - t);
+                    if (slash == 0) return false;
+                    t = slash + 1;
+                }
+            }
+            if (q == pend) return memchr(s, '/', send - s) == 0;
+            for (auto t = s; t <= send; t++) {
+                if (glob_match(start, q, pend, t, send)) return true;
+                if (t < send && *t == '/') return false;
+            }
+            return false;
+        }
+
+        if (s >= send) return false;
+        if (c == '?') {
+            if (*s == '/') return false;
+            p++;
+            s++;
+            continue;
+        }
+        if (c == '[') {
+            if (*s == '/') return false;
+            int res = glob_class(&p, pend, *s);
+            if (res == 0) return false;
+            // An unclosed [ is taken literally.
+            if (res == -1) {
+                if (*s != '[') return false;
+                p++;
+            }
+            s++;
+            continue;
+        }
+        if (c == '\\' && p+1 < pend) c = *++p;
+        if (*s != c) return false;
+        p++;
+        s++;
+    }
+    return s == send;
+}
+
+int compare_rule(const Ignore_Rule* a, const char* name, int len) {
+    int n = a->pattern.len < len ? a->pattern.len : len;
+    int cmp = memcmp(a->pattern.text, name, n);
+    if (cmp != 0) return cmp;
+    return a->pattern.len - len;
+}
+
+int compare_rules(const void* a, const void* b) {
+    auto x = (const Ignore_Rule*)a;
+    auto y = (const Ignore_Rule*)b;
+    int cmp = compare_rule(x, y->pattern.text, y->pattern.len);
+    if (cmp != 0) return cmp;
+    return x->index - y->index;
+}
+
+/// Compiles the rules of one ignore file.
+void ignore_parse(Ignore_List* list, const char* text, int len) {
+    auto p = text;
+    auto end = text + len;
+    while (p < end) {
+        auto eol = (const char*)memchr(p, '\n', end - p);
+        if (eol == 0) eol = end;
+        auto line = p;
+        auto line_end = eol;
+        p = eol < end ? eol + 1 : end;
+
+        if (line_end > line && line_end[-1] == '\r') line_end--;
+        // Trailing spaces are dropped, unless escaped.
+        while (line_end > line && line_end[-1] == ' ' && !(line_end - 1 > line && line_end[-2] == '\\')) line_end--;
+        if (line_end == line || *line == '#') continue;
+
+        Ignore_Rule rule = {0};
+        rule.index = list->count++;
+        if (*line == '!') {
+            rule.flags |= RULE_NEGATE;
+            line++;
+        } else if (*line == '\\' && line+1 < line_end && (line[1] == '!' || line[1] == '#')) {
+            line++;
+        }
+        if (line_end > line && line_end[-1] == '/') {
+            rule.flags |= RULE_DIR_ONLY;
+            line_end--;
+        }
+        if (line_end == line) continue;
+
+        if (memchr(line, '/', line_end - line) == 0) rule.flags |= RULE_BASENAME;
+        else if (*line == '/') line++;
+        if (line_end == line) continue;
+
+        rule.pattern = stringf("%.*s", (int)(line_end - line), line);
+        while (rule.prefix < rule.pattern.len && !glob_special(rule.pattern.text[rule.prefix])) rule.prefix++;
+
+        bool literal = rule.prefix == rule.pattern.len;
+        bool suffix = rule.pattern.len > 1 && rule.pattern.text[0] == '*';
+        for (int i=1; suffix && i<rule.pattern.len; i++) {
+            if (glob_special(rule.pattern.text[i])) suffix = false;
+        }
+
+        if ((rule.flags & RULE_BASENAME) && literal) {
+            bag_add(&list->names, rule);
+        } else if ((rule.flags & RULE_BASENAME) && suffix) {
+            free((void*)rule.pattern.text);
+            rule.pattern = stringf("%.*s", (int)(line_end - line - 1), line + 1);
+            bag_add(&list->suffixes, rule);
+        } else {
+            bag_add(&list->globs, rule);
+        }
+    }
+}
+
+/// Creates a list of rules for the directory base (a path
+/// relative to the worktree, with a trailing slash) from the
+/// contents of an ignore file.
+Ignore_List* ignore_list(Ignore_List* parent, string base, const char* text, int len) {
+    auto list = (Ignore_List*)calloc(1, sizeof(Ignore_List));
+    list->parent = parent;
+    list->base = copy(&base);
+    list->names = create_bag<Ignore_Rule>(8);
+    list->suffixes = create_bag<Ignore_Rule>(8);
+    list->globs = create_bag<Ignore_Rule>(8);
+    ignore_parse(list, text, len);
+    qsort(list->names.items, list->names.len, sizeof(Ignore_Rule), compare_rules);
+    qsort(list->suffixes.items, list->suffixes.len, sizeof(Ignore_Rule), compare_rules);
+    return list;
+}
+
+void ignore_list_free(Ignore_List* list) {
+    bag<Ignore_Rule>* kinds[] = {&list->names, &list->suffixes, &list->globs};
+    for (auto kind : kinds) {
+        for (int i=0; i<kind->len; i++) free((void*)kind->items[i].pattern.text);
+        free(kind->items);
+    }
+    free((void*)list->base.text);
+    free(list);
+}
+
+/// The last rule with the given name, in a sorted array of
+/// rules. Returns -1 if there is none.
+int last_named(bag<Ignore_Rule>* rules, const char* name, int len, bool is_dir, int after) {
+    int lo = 0;
+    int hi = rules->len;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (compare_rule(&rules->items[mid], name, len) <= 0) lo = mid + 1;
+        else hi = mid;
+    }
+    // lo is past the last rule with this name; walk back over
+    // the ones that only apply to directories.
+    for (int i=lo-1; i>=0 && compare_rule(&rules->items[i], name, len) == 0; i--) {
+        auto rule = &rules->items[i];
+        if (rule->index <= after) break;
+        if ((rule->flags & RULE_DIR_ONLY) && !is_dir) continue;
+        return i;
+    }
+    return -1;
+}
+
+bool rule_matches(Ignore_Rule* rule, const char* rel, int rel_len, const char* name, int name_len, bool is_dir) {
+    if ((rule->flags & RULE_DIR_ONLY) && !is_dir) return false;
+    auto text = rule->flags & RULE_BASENAME ? name : rel;
+    int len = rule->flags & RULE_BASENAME ? name_len : rel_len;
+    if (len < rule->prefix || memcmp(text, rule->pattern.text, rule->prefix) != 0) return false;
+    auto pat = rule->pattern.text;
+    return glob_match(pat, pat + rule->prefix, pat + rule->pattern.len, text + rule->prefix, text + len);
+}
+
+/// Matches a path (relative to the worktree) against the rules
+/// of one list only.
+IGNORE_MATCH ignore_match_list(Ignore_List* list, const char* path, int len, bool is_dir) {
+    if (len < list->base.len || memcmp(path, list->base.text, list->base.len) != 0) return IM_NONE;
+    auto rel = path + list->base.len;
+    int rel_len = len - list->base.len;
+    auto name = rel;
+    for (int i=rel_len-1; i>=0; i--) {
+        if (rel[i] == '/') { name = rel + i + 1; break; }
+    }
+    int name_len = rel + rel_len - name;
+
+    Ignore_Rule* best = 0;
+    int found = last_named(&list->names, name, name_len, is_dir, -1);
+    if (found != -1) best = &list->names.items[found];
+
+    // Every suffix of the name could be the name after a *.
+    for (int i=0; i<name_len; i++) {
+        found = last_named(&list->suffixes, name + i, name_len - i, is_dir, best ? best->index : -1);
+        if (found != -1) best = &list->suffixes.items[found];
+    }
+
+    for (int i=list->globs.len-1; i>=0; i--) {
+        auto rule = &list->globs.items[i];
+        if (best && rule->index < best->index) break;
+        if (rule_matches(rule, rel, rel_len, name, name_len, is_dir)) {
+            best = rule;
+            break;
+        }
+    }
+
+    if (best == 0) return IM_NONE;
+    return best->flags & RULE_NEGATE ? IM_INCLUDED : IM_IGNORED;
+}
+
+/// Whether a path is ignored, by the rules of the list or of
+/// any of its parents. Paths in ignored directories are not
+/// considered; callers are expected not to look inside them.
+bool ignored(Ignore_List* list, const char* path, int len, bool is_dir) {
+    for (; list != 0; list = list->parent) {
+        auto match = ignore_match_list(list, path, len, is_dir);
+        if (match != IM_NONE) return match == IM_IGNORED;
+    }
+    return false;
+}
+
+/// Reads an ignore file into a new list, or returns the parent
+/// if it can't be read.
+Ignore_List* ignore_file(Ignore_List* parent, const char* path, string base) {
+    auto file = map_file(path);
+    if (file.error) return parent;
+    auto list = ignore_list(parent, base, file.value.text, file.value.len);
+    if (file.value.len > 0) munmap((void*)file.value.text, file.value.len);
+    return list;
+}
+
+/// The rules that apply to the whole worktree, other than its
+/// top-level .gitignore: core.excludesFile (or git's default
+/// for it), then .git/info/exclude.
+Ignore_List* git_global_ignores(Git_State* git) {
+    char path[PATH_MAX];
+    Ignore_List* list = 0;
+    string root = {0};
+
+    // The repository's config, then the user's.
+    auto home = getenv("HOME");
+    auto xdg = getenv("XDG_CONFIG_HOME");
+    auto excludes = git_config(git, "core", 0, "excludesfile");
+    if (excludes.error && home) {
+        snprintf(path, PATH_MAX, "%s/.gitconfig", home);
+        excludes = config_file_value(path, "core", 0, "excludesfile");
+    }
+    if (excludes.error) {
+        if (xdg && xdg[0]) snprintf(path, PATH_MAX, "%s/git/config", xdg);
+        else if (home) snprintf(path, PATH_MAX, "%s/.config/git/config", home);
+        if ((xdg && xdg[0]) || home) excludes = config_file_value(path, "core", 0, "excludesfile");
+    }
+    if (excludes.error == 0) {
+        auto value = excludes.value;
+        if (value.len > 1 && value.text[0] == '~' && value.text[1] == '/' && home) {
+            snprintf(path, PATH_MAX, "%s%.*s", home, value.len - 1, value.text + 1);
+        } else {
+            snprintf(path, PATH_MAX, "%.*s", value.len, value.text);
+        }
+        free((void*)value.text);
+        list = ignore_file(list, path, root);
+    } else if (xdg && xdg[0]) {
+        snprintf(path, PATH_MAX, "%s/git/ignore", xdg);
+        list = ignore_file(list, path, root);
+    } else if (home) {
+        snprintf(path, PATH_MAX, "%s/.config/git/ignore", home);
+        list = ignore_file(list, path, root);
+    }
+
+    git_path(git->common_dir, "info/exclude", path);
+    return ignore_file(list, path, root);
+}
+
+#endif
@@ -0,0 +1,272 @@
+#ifndef subline_index_diff
+#define subline_index_diff
+
+// Comparing the index with HEAD, without running git: how many
+// paths are staged, and how many have unresolved conflicts.
+//
+// Conflicted paths are the ones with entries in stages 1-3. Staged
+// paths are found by walking HEAD's tree alongside the index, which
+// is sorted the same way. Most of the index usually matches HEAD,
+// and the cache tree extension (TREE) records the tree id of every
+// directory of the index that is still valid; any such directory
+// whose id matches HEAD's is skipped without reading a single
+// object.
+// Format: https://git-scm.com/docs/index-format#_cache_tree
+
+#include <string.h>
+
+#include "utils.cpp"
+#include "git.cpp"
+#include "git_index.cpp"
+#include "git_objects.cpp"
+
+#define MODE_TREE 040000
+
+struct Cache_Tree {
+    string name;
+    // Number of index entries the tree covers, or -1 when the
+    // tree is out of date, and its id is unknown.
+    int entries;
+    int subtrees;
+    Git_Oid oid;
+    // Nodes in this tree, including itself. Subtrees follow their
+    // parent, one after the other.
+    int size;
+};
+
+/// Parses one node of the cache tree and its subtrees.
+const u8* cache_tree_parse(const u8* p, const u8* end, bag<Cache_Tree>* out) {
+    auto name = p;
+    while (p < end && *p != 0) p++;
+    if (p >= end) return 0;
+
+    Cache_Tree node = {0};
+    node.name = {(const char*)name, (int)(p - name)};
+    p++;
+
+    auto eol = (const u8*)memchr(p, '\n', end - p);
+    if (eol == 0) return 0;
+    node.entries = atoi((const char*)p);
+    auto space = (const u8*)memchr(p, ' ', eol - p);
+    if (space == 0) return 0;
+    node.subtrees = atoi((const char*)space + 1);
+    p = eol + 1;
+
+    if (node.entries >= 0) {
+        if (p + 20 > end) return 0;
+        memcpy(node.oid.hash, p, 20);
+        p += 20;
+    }
+
+    int at = out->len;
+    bag_add(out, node);
+    for (int i=0; i<node.subtrees && p != 0; i++) p = cache_tree_parse(p, end, out);
+    out->items[at].size = out->len - at;
+    return p;
+}
+
+/// The node of a subtree of the given node, or -1.
+int cache_tree_child(bag<Cache_Tree>* tree, int node, const char* name, int len) {
+    if (node < 0) return -1;
+    int child = node + 1;
+    for (int i=0; i<tree->items[node].subtrees && child < tree->len; i++) {
+        auto c = &tree->items[child];
+        if (c->name.len == len && memcmp(c->name.text, name, len) == 0) return child;
+        child += c->size;
+    }
+    return -1;
+}
+
+struct Index_Diff {
+    Git_State* git;
+    Git_Index* index;
+    bag<Cache_Tree> cache;
+    int staged;
+    bool failed;
+};
+
+bool entry_present(Index_Entry* entry) {
+    return index_stage(entry) == 0 && !(entry->extended & INDEX_INTENT_TO_ADD);
+}
+
+/// Skips past every stage of the path at i.
+u32 skip_path(Git_Index* index, u32 i, u32 hi) {
+    auto path = index_path(index, &index->entries.items[i]);
+    i++;
+    while (i < hi && strcmp(index_path(index, &index->entries.items[i]), path) == 0) i++;
+    return i;
+}
+
+/// Counts the files in a tree, all of which were deleted.
+void diff_deleted(Index_Diff* diff, Git_Oid* oid) {
+    auto obj = git_read_object(diff->git, oid);
+    if (obj.error || obj.value.type != OBJ_TREE) {
+        if (obj.error == 0) git_object_free(&obj.value);
+        diff->failed = true;
+        return;
+    }
+    auto p = obj.value.data.text;
+    auto end = p + obj.value.data.len;
+    while (p < end && !diff->failed) {
+        auto nul = (const char*)memchr(p, 0, end - p);
+        if (nul == 0 || nul + 21 > end) break;
+        bool is_tree = strtol(p, 0, 8) == MODE_TREE;
+        Git_Oid child;
+        memcpy(child.hash, nul + 1, 20);
+        if (is_tree) diff_deleted(diff, &child);
+        else diff->staged++;
+        p = nul + 21;
+    }
+    git_object_free(&obj.value);
+}
+
+/// Compares a tree with the index entries [lo, hi), all of which
+/// are under prefix (which is prefix_len long).
+void diff_tree(Index_Diff* diff, Git_Oid* oid, int prefix_len, u32 lo, u32 hi, int cache) {
+    auto index = diff->index;
+    if (cache >= 0) {
+        auto node = &diff->cache.items[cache];
+        if (node->entries >= 0 && memcmp(node->oid.hash, oid->hash, 20) == 0) return;
+    }
+
+    auto obj = git_read_object(diff->git, oid);
+    if (obj.error || obj.value.type != OBJ_TREE) {
+        if (obj.error == 0) git_object_free(&obj.value);
+        diff->failed = true;
+        return;
+    }
+
+    u32 i = lo;
+    auto p = obj.value.data.text;
+    auto end = p + obj.value.data.len;
+    while (p < end && !diff->failed) {
+        auto space = (const char*)memchr(p, ' ', end - p);
+        auto nul = space ? (const char*)memchr(space, 0, end - space) : 0;
+        if (nul == 0 || nul + 21 > end) {
+            diff->failed = true;
+            break;
+        }
+        u32 mode = strtol(p, 0, 8);
+        auto name = space + 1;
+        int name_len = nul - name;
+        Git_Oid child;
+        memcpy(child.hash, nul + 1, 20);
+        p = nul + 21;
+        bool is_tree = mode == MODE_TREE;
+
+        // Entries sorting before this one were added. Trees sort
+        // as if their name ended with a slash, as in the index.
+        int cmp = 1;
+        while (i < hi) {
+            auto rel = index_path(index, &index->entries.items[i]) + prefix_len;
+            cmp = strncmp(rel, name, name_len);
+            if (cmp == 0) {
+                char next = rel[name_len];
+                if (is_tree) cmp = next == '/' ? 0 : (u8)next < '/' ? -1 : 1;
+                else cmp = next == 0 ? 0 : 1;
+            }
+            if (cmp >= 0) break;
+            if (entry_present(&index->entries.items[i])) diff->staged++;
+            i = skip_path(index, i, hi);
+        }
+
+        if (is_tree) {
+            u32 j = i;
+            while (j < hi) {
+                auto rel = index_path(index, &index->entries.items[j]) + prefix_len;
+                if (strncmp(rel, name, name_len) != 0 || rel[name_len] != '/') break;
+                j++;
+            }
+            auto first = i < j ? index_path(index, &index->entries.items[i]) : 0;
+            if (j == i) {
+                diff_deleted(diff, &child);
+            } else if (j == i+1 && (int)strlen(first) == prefix_len + name_len + 1) {
+                // A sparse index keeps directories outside of the
+                // sparse checkout as a single entry, with a tree id.
+                if (memcmp(index->entries.items[i].data + INDEX_OID_OFFSET, child.hash, 20) != 0) diff->failed = true;
+            } else {
+                diff_tree(diff, &child, prefix_len + name_len + 1, i, j, cache_tree_child(&diff->cache, cache, name, name_len));
+            }
+            i = j;
+        } else if (cmp == 0) {
+            auto entry = &index->entries.items[i];
+            if (index_stage(entry) == 0) {
+                bool same = be32(entry->data + 24) == mode && memcmp(entry->data + INDEX_OID_OFFSET, child.hash, 20) == 0;
+                if (!same) diff->staged++;
+            }
+            i = skip_path(index, i, hi);
+        } else {
+            diff->staged++;
+        }
+    }
+
+    for (; i < hi; i = skip_path(index, i, hi)) {
+        if (entry_present(&index->entries.items[i])) diff->staged++;
+    }
+    git_object_free(&obj.value);
+}
+
+struct Index_Counts {
+    int conflicts;
+    // Only counted when asked for, as it means reading HEAD. -1
+    // if HEAD's tree couldn't be read.
+    int staged;
+};
+
+/// Counts the conflicted paths in the index, and, if staged is
+/// set, the paths whose staged version differs from HEAD's. A
+/// rename counts as a deletion and an addition. Conflicted paths
+/// don't count as staged.
+Index_Counts git_index_counts(Git_State* git, bool staged) {
+    char path[PATH_MAX];
+    git_path(git->git_dir, "index", path);
+    auto index_opt = git_index_load(path);
+    Git_Index index = {0};
+    if (index_opt.error == 0) index = index_opt.value;
+    u32 len = index.entries.len;
+
+    Index_Counts counts = {0, 0};
+    for (u32 i=0; i<len; ) {
+        if (index_stage(&index.entries.items[i]) != 0) counts.conflicts++;
+        i = skip_path(&index, i, len);
+    }
+
+    if (staged) {
+        Index_Diff diff = {0};
+        diff.git = git;
+        diff.index = &index;
+        diff.cache = create_bag<Cache_Tree>(64);
+
+        const u8* ext;
+        u32 ext_len;
+        if (index_extension(&index, "TREE", &ext, &ext_len)) {
+            if (cache_tree_parse(ext, ext + ext_len, &diff.cache) == 0) diff.cache.len = 0;
+        }
+
+        auto head = git_resolve_ref(git, "HEAD");
+        if (head.error) {
+            // Nothing was committed yet: everything is staged.
+            for (u32 i=0; i<len; i = skip_path(&index, i, len)) {
+                if (entry_present(&index.entries.items[i])) diff.staged++;
+            }
+        } else {
+            Git_Oid tree;
+            auto commit = git_read_object(git, &head.value);
+            bool valid = commit.error == 0 && commit.value.type == OBJ_COMMIT &&
+                starts(&commit.value.data, "tree ") &&
+                parse_oid(commit.value.data.text + 5, commit.value.data.len - 5, &tree);
+            if (commit.error == 0) git_object_free(&commit.value);
+
+            if (valid) diff_tree(&diff, &tree, 0, 0, len, diff.cache.len > 0 ? 0 : -1);
+            else diff.failed = true;
+        }
+
+        counts.staged = diff.failed ? -1 : diff.staged;
+        free(diff.cache.items);
+    }
+
+    if (index_opt.error == 0) git_index_free(&index);
+    return counts;
+}
+
+#endif
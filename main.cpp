@@ -1,6 +1,22 @@
 #include "utils.cpp"
 #include "tokenizer.cpp"
 #include "ast.cpp"
+#include "ast_cache.cpp"
+#include "profile.cpp"
+#include "providers.cpp"
+#include "files.cpp"
+#include "git.cpp"
+#include "git_index.cpp"
+#include "gitignore.cpp"
+#include "untracked.cpp"
+#include "watch.cpp"
+#include "git_objects.cpp"
+#include "commit_graph.cpp"
+#include "index_diff.cpp"
+#include "remote_fs.cpp"
+#include "vcs.cpp"
+#include "command.cpp"
+#include "prefetch.cpp"
 
 #include <cstdio>
 #include <initializer_list>
@@ -9,6 +25,9 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 
 optional<string> cwd_str() {
@@ -38,110 +57,6 @@ string path_frag(
     return {path.text+start_index, end_index-start_index};
 }
 
-bool dir_exists(char* path) {
-    DIR* dir = opendir(path);
-    if (dir != 0) {
-        closedir(dir);
-        return true;
-    }
-    return false;
-}
-
-#define CHUNK_SIZE 1024
-
-string read_pipe(FILE* pipe) {
-    size_t buffer_size = CHUNK_SIZE;
-    char* pipe_text = (char*)malloc(buffer_size);
-
-    size_t total_size = 0;
-    ssize_t bytes_read;
-
-    while ((bytes_read = fread(pipe_text+total_size, 1, CHUNK_SIZE, pipe))) {
-        total_size += bytes_read;
-        if (total_size+CHUNK_SIZE > buffer_size) {
-            buffer_size += CHUNK_SIZE;
-            pipe_text = (char*)realloc(pipe_text, buffer_size);
-        }
-    }
-    assert(bytes_read != -1, "Failed to read pipe!");
-
-    pipe_text[total_size] = 0;
-    return to_string(pipe_text);
-}
-
-string read_pipe(int pipe) {
-    size_t buffer_size = CHUNK_SIZE;
-    char* pipe_text = (char*)malloc(buffer_size);
-
-    size_t total_size = 0;
-    ssize_t bytes_read;
-
-    while ((bytes_read = read(pipe, pipe_text+total_size, CHUNK_SIZE))) {
-        total_size += bytes_read;
-        if (total_size+CHUNK_SIZE > buffer_size) {
-            buffer_size += CHUNK_SIZE;
-            pipe_text = (char*)realloc(pipe_text, buffer_size);
-        }
-    }
-    assert(bytes_read != -1, "Failed to read pipe!");
-
-    pipe_text[total_size] = 0;
-    return to_string(pipe_text);
-}
-
-string read_file(FILE* file) {
-    fseek(file, 0, SEEK_END);
-    int size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    char* mem = (char*)malloc(size);
-    auto res = fread(mem, size+1, 1, file);
-    return string{mem, size};
-}
-
-optional<string> read_file(const char* path) {
-    auto file = fopen(path, "r");
-    if (file == 0) return error("Failed to open file");
-    string out = read_file(file);
-    fclose(file);
-    return ok(out);
-}
-
-optional<string> git_root(string root) {
-    int nth = 0;
-    char path[PATH_MAX] = {0};
-    fill_charp(root, path);
-    int idx = root.len;
-
-    while (true) {
-        charp_set(path, "/.git", idx);
-        if (dir_exists(path)) {
-            return ok(slice(&root, 0, idx));
-        }
-        idx = index_of(&root, '/', -1-nth);
-        if (idx == -1) break;
-        nth--;
-    }
-    return error("Not inside of git repo");
-}
-
-optional<string> git_branch_name(string root) {
-    char path[PATH_MAX];
-    fill_charp(root, path);
-    charp_set(path, "/.git/HEAD", root.len);
-    path[root.len + sizeof("/.git/HEAD") - 1] = 0;
-
-    // @TODO: str needs to be freed
-    auto str = read_file(path);
-    if (str.error) { return str; }
-
-    auto idx = index_of(&str.value, '/', -1);
-    if (idx == -1) { return error("Failed to find ref in .git/HEAD"); }
-
-    auto branch = slice(&str.value, idx+1, str.value.len);
-    branch = trim(&branch);
-    return ok(copy(&branch));
-}
-
 optional<string> env_var(const char* name) {
     auto val = getenv(name);
     if (val == 0) return error("Env var not present");
@@ -242,11 +157,6 @@ int red(Color col) { assert(col.type==CT_HEX, "Expected a hex color!"); return (
 int green(Color col) { assert(col.type==CT_HEX, "Expected a hex color!"); return (col.value >> 8) & 0xff; }
 int blue(Color col) { assert(col.type==CT_HEX, "Expected a hex color!"); return col.value & 0xff; }
 
-struct Git_State {
-    string dir;
-    string branch;
-};
-
 enum INTENSITY {
     INT_DIM=-1,
     INT_NORMAL=0,
@@ -263,12 +173,415 @@ struct Display_Style {
 };
 
 struct Subline_State {
+    // PV_* bits of the providers that were already computed.
+    // Everything else is computed on first use.
+    u32 loaded;
+    // PV_* bits of the providers the script can use, or 0 if
+    // that isn't known.
+    u32 providers;
     string cwd;
+    string fs_type;
+    FS_POLICY fs_policy;
+    // Whether git probes ran out of time, see state_git_remote.
+    bool fs_timed_out;
     optional<Git_State> git;
+    // The nearest repository of any kind, see state_vcs. The
+    // kind is 0 outside of repositories.
+    VCS_KIND vcs_kind;
+    string vcs_root;
+    string vcs_branch;
+    optional<Watch_State> watch;
+    bool has_upstream;
+    Ahead_Behind upstream;
     Display_Style style;
     bag<Display_Style> style_stack;
+    // stdout() calls started before rendering, see state_prefetch.
+    bag<Prefetch> prefetched;
+    // Whether slow builtins are left out for now, and how many
+    // were, see render_async.
+    bool deferring;
+    int deferred;
 };
 
+string* state_cwd(Subline_State* s) {
+    if (!(s->loaded & PV_CWD)) {
+        REQUIRED(s->cwd, cwd_str());
+        s->loaded |= PV_CWD;
+    }
+    return &s->cwd;
+}
+
+/// Policy for git probes on the cwd's filesystem.
+FS_POLICY state_fs_policy(Subline_State* s) {
+    if (!(s->loaded & PV_FS)) {
+        auto type = fs_type(*state_cwd(s));
+        s->fs_type = type.error ? string{0} : type.value;
+        s->fs_policy = fs_policy(s->fs_type, getenv("SUBLINE_REMOTE_FS"));
+        s->fs_timed_out = false;
+        s->loaded |= PV_FS;
+    }
+    return s->fs_policy;
+}
+
+void state_git_remote(Subline_State* s, FS_POLICY policy);
+void state_vcs(Subline_State* s);
+
+/// The git repository the cwd is in. The branch and the
+/// rest are not filled in, see state_git_branch and others.
+optional<Git_State>* state_git(Subline_State* s) {
+    if (!(s->loaded & PV_GIT_ROOT)) {
+        bool profiled = profiling();
+        if (profiled) profile_enter();
+        auto policy = state_fs_policy(s);
+        if (policy != FSP_PROBE) state_git_remote(s, policy);
+        // Scripts that also look for other repositories find
+        // them all in the same walk.
+        else if (s->providers & PV_VCS) state_vcs(s);
+        else s->git = git_discover(*state_cwd(s));
+        s->loaded |= PV_GIT_ROOT;
+        if (profiled) profile_exit(profile_builtin(to_string("git_root")));
+    }
+    return &s->git;
+}
+
+/// Finds the nearest repository of any kind the cwd is in. A
+/// Jujutsu repository backed by a git repository in the same
+/// directory counts as a Jujutsu one.
+void state_vcs(Subline_State* s) {
+    if (s->loaded & PV_VCS_ROOT) return;
+    auto policy = state_fs_policy(s);
+    if (policy != FSP_PROBE) {
+        state_git_remote(s, policy);
+        return;
+    }
+
+    bool has_git = s->loaded & PV_GIT_ROOT;
+    u32 kinds = VCS_HG | VCS_JJ | (has_git ? 0 : VCS_GIT);
+    bool profiled = profiling();
+    if (profiled) profile_enter();
+    auto found = vcs_discover(*state_cwd(s), kinds);
+    if (profiled) profile_exit(profile_builtin(to_string("vcs_root")));
+    if (!has_git) {
+        s->git = found.git;
+        s->loaded |= PV_GIT_ROOT;
+    }
+
+    s->vcs_kind = (VCS_KIND)0;
+    s->vcs_root = {0};
+    if (s->git.error == 0) {
+        s->vcs_kind = VCS_GIT;
+        s->vcs_root = s->git.value.dir;
+    }
+    if (found.hg.text && (s->vcs_kind == 0 || found.hg.len > s->vcs_root.len)) {
+        s->vcs_kind = VCS_HG;
+        s->vcs_root = found.hg;
+    }
+    if (found.jj.text && (s->vcs_kind == 0 || found.jj.len >= s->vcs_root.len)) {
+        s->vcs_kind = VCS_JJ;
+        s->vcs_root = found.jj;
+    }
+    s->loaded |= PV_VCS_ROOT;
+}
+
+/// Name of the nearest repository's kind: git, hg or jj.
+string state_vcs_kind(Subline_State* s) {
+    state_vcs(s);
+    if (s->vcs_kind == 0) return {0};
+    return to_string(VCS_NAMES[__builtin_ctz(s->vcs_kind)]);
+}
+
+string state_vcs_root(Subline_State* s) {
+    state_vcs(s);
+    return s->vcs_root;
+}
+
+/// State published by a --watch-repo watcher of the current
+/// repository, if there is one and it is up to date.
+optional<Watch_State>* state_watch(Subline_State* s) {
+    if (!(s->loaded & PV_GIT_WATCH)) {
+        auto git = state_git(s);
+        if (git->error) s->watch = error(git->error);
+        else s->watch = watch_state_load(&git->value);
+        s->loaded |= PV_GIT_WATCH;
+    }
+    return &s->watch;
+}
+
+string state_git_branch(Subline_State* s) {
+    auto git = state_git(s);
+    if (git->error) return {0};
+    if (!(s->loaded & PV_GIT_BRANCH)) {
+        auto watch = state_watch(s);
+        if (watch->error == 0) {
+            git->value.branch = watch->value.has_branch ? watch->value.branch : string{0};
+        } else {
+            auto branch = git_branch_name(&git->value);
+            git->value.branch = branch.error ? string{0} : branch.value;
+        }
+        s->loaded |= PV_GIT_BRANCH;
+    }
+    return git->value.branch;
+}
+
+/// Whether tracked files in the worktree differ from the
+/// index. False outside of git repositories.
+bool state_git_dirty(Subline_State* s) {
+    auto git = state_git(s);
+    if (git->error) return false;
+    if (!(s->loaded & PV_GIT_DIRTY)) {
+        auto watch = state_watch(s);
+        if (watch->error == 0 && watch->value.dirty != WD_UNKNOWN) {
+            git->value.dirty = watch->value.dirty == WD_DIRTY;
+        } else {
+            auto dirty = git_dirty(&git->value);
+            git->value.dirty = dirty.error == 0 && dirty.value;
+        }
+        s->loaded |= PV_GIT_DIRTY;
+    }
+    return git->value.dirty;
+}
+
+/// Commits HEAD is ahead of and behind its upstream.
+Ahead_Behind* state_git_ahead_behind(Subline_State* s) {
+    auto git = state_git(s);
+    if (!(s->loaded & PV_GIT_UPSTREAM)) {
+        s->upstream = {false, 0, 0};
+        if (git->error == 0) {
+            auto counts = git_ahead_behind(&git->value);
+            if (counts.error == 0) s->upstream = counts.value;
+            s->has_upstream = counts.error == 0;
+        }
+        s->loaded |= PV_GIT_UPSTREAM;
+    }
+    return &s->upstream;
+}
+
+/// A count of commits for git-ahead or git-behind. Empty
+/// without an upstream, "?" when it couldn't be counted.
+string upstream_count(Subline_State* s, bool ahead) {
+    auto counts = state_git_ahead_behind(s);
+    if (!s->has_upstream) return {0};
+    if (!counts->known) return const_string("?");
+    return to_string(ahead ? counts->ahead : counts->behind);
+}
+
+/// Abbreviated id of the commit HEAD points to.
+string state_git_commit(Subline_State* s) {
+    auto git = state_git(s);
+    if (git->error) return {0};
+    if (!(s->loaded & PV_GIT_COMMIT)) {
+        auto commit = git_commit(&git->value);
+        git->value.commit = commit.error ? string{0} : commit.value;
+        s->loaded |= PV_GIT_COMMIT;
+    }
+    return git->value.commit;
+}
+
+/// Subject of the commit HEAD points to.
+string state_git_subject(Subline_State* s) {
+    auto git = state_git(s);
+    if (git->error) return {0};
+    if (!(s->loaded & PV_GIT_SUBJECT)) {
+        auto subject = git_subject(&git->value);
+        git->value.subject = subject.error ? string{0} : subject.value;
+        s->loaded |= PV_GIT_SUBJECT;
+    }
+    return git->value.subject;
+}
+
+/// Nearest annotated tag reachable from HEAD.
+string state_git_tag(Subline_State* s) {
+    auto git = state_git(s);
+    if (git->error) return {0};
+    if (!(s->loaded & PV_GIT_TAG)) {
+        auto tag = git_nearest_tag(&git->value);
+        git->value.tag = tag.error ? string{0} : tag.value;
+        s->loaded |= PV_GIT_TAG;
+    }
+    return git->value.tag;
+}
+
+/// Operation in progress (rebase, merge, ...) in the worktree.
+string state_git_operation(Subline_State* s) {
+    auto git = state_git(s);
+    if (git->error) return {0};
+    if (!(s->loaded & PV_GIT_OPERATION)) {
+        git->value.operation = git_operation(&git->value);
+        s->loaded |= PV_GIT_OPERATION;
+    }
+    return git->value.operation;
+}
+
+/// Untracked files in the worktree. Unless count_all is set,
+/// stops at the first one, and returns at most 1.
+int state_git_untracked(Subline_State* s, bool count_all) {
+    auto git = state_git(s);
+    if (git->error) return 0;
+    u32 needed = count_all ? PV_GIT_UNTRACKED_COUNT : PV_GIT_UNTRACKED;
+    if (!(s->loaded & (needed | PV_GIT_UNTRACKED_COUNT))) {
+        auto count = git_untracked(&git->value, count_all);
+        git->value.untracked = count.error ? 0 : count.value;
+        s->loaded |= needed;
+    }
+    return git->value.untracked;
+}
+
+/// Conflicted and staged paths in the index. The staged count
+/// is -1 if HEAD's tree couldn't be read.
+Git_State* state_git_index_counts(Subline_State* s, bool staged) {
+    auto git = state_git(s);
+    if (git->error) return 0;
+    u32 needed = staged ? PV_GIT_STAGED : PV_GIT_CONFLICTS;
+    if (!(s->loaded & (needed | PV_GIT_STAGED))) {
+        auto counts = git_index_counts(&git->value, staged);
+        git->value.conflicts = counts.conflicts;
+        git->value.staged = counts.staged;
+        s->loaded |= needed;
+    }
+    return &git->value;
+}
+
+string state_git_conflicts(Subline_State* s) {
+    auto git = state_git_index_counts(s, false);
+    return to_string(git ? git->conflicts : 0);
+}
+
+/// "?" when the staged paths couldn't be counted.
+string state_git_staged(Subline_State* s) {
+    auto git = state_git_index_counts(s, true);
+    if (git && git->staged < 0) return const_string("?");
+    return to_string(git ? git->staged : 0);
+}
+
+string state_git_branch(Subline_State* s);
+
+/// Branch of the nearest repository: for Mercurial, the active
+/// bookmark or the branch, for Jujutsu, the bookmarks on the
+/// working-copy commit or its parents.
+string state_vcs_branch(Subline_State* s) {
+    state_vcs(s);
+    if (!(s->loaded & PV_VCS_BRANCH)) {
+        optional<string> branch = error("Not inside of a repository");
+        if (s->vcs_kind == VCS_GIT) branch = ok(state_git_branch(s));
+        else if (s->vcs_kind == VCS_HG) branch = hg_branch(s->vcs_root);
+        else if (s->vcs_kind == VCS_JJ) branch = jj_branch(s->vcs_root);
+        s->vcs_branch = branch.error ? string{0} : branch.value;
+        s->loaded |= PV_VCS_BRANCH;
+    }
+    return s->vcs_branch;
+}
+
+/// Computes the repository providers among the given ones.
+void state_load_git(Subline_State* s, u32 providers) {
+    state_git(s);
+    if (providers & PV_VCS_ROOT) state_vcs(s);
+    if (providers & PV_VCS_BRANCH) state_vcs_branch(s);
+    if (providers & PV_GIT_BRANCH) state_git_branch(s);
+    if (providers & PV_GIT_DIRTY) state_git_dirty(s);
+    if (providers & PV_GIT_COMMIT) state_git_commit(s);
+    if (providers & PV_GIT_UPSTREAM) state_git_ahead_behind(s);
+    if (providers & PV_GIT_SUBJECT) state_git_subject(s);
+    if (providers & PV_GIT_TAG) state_git_tag(s);
+    if (providers & PV_GIT_OPERATION) state_git_operation(s);
+    if (providers & PV_GIT_UNTRACKED_COUNT) state_git_untracked(s, true);
+    else if (providers & PV_GIT_UNTRACKED) state_git_untracked(s, false);
+    if (providers & PV_GIT_STAGED) state_git_index_counts(s, true);
+    else if (providers & PV_GIT_CONFLICTS) state_git_index_counts(s, false);
+}
+
+/// Git state computed on a helper thread, see state_git_remote.
+struct Remote_Probe {
+    Subline_State state;
+    u32 providers;
+};
+
+void remote_probe_run(void* arg) {
+    auto probe = (Remote_Probe*)arg;
+    state_load_git(&probe->state, probe->providers);
+}
+
+void remote_probe_discard(void* arg) {
+    free(arg);
+}
+
+/// Fills in the git state on a filesystem whose policy isn't
+/// FSP_PROBE. Everything the script can use is computed at once,
+/// on a helper thread, within the deadline; whatever wasn't is
+/// left empty, and is never looked up from this thread.
+void state_git_remote(Subline_State* s, FS_POLICY policy) {
+    auto cwd = *state_cwd(s);
+    s->git = error("Not inside of git repo");
+    s->vcs_kind = (VCS_KIND)0;
+    s->vcs_root = {0};
+    s->vcs_branch = {0};
+    u32 wanted = (s->providers ? s->providers : PV_GIT) & (PV_GIT_ALL | PV_VCS);
+
+    bool probe_now = policy == FSP_DEADLINE;
+    if (policy == FSP_CACHE) {
+        // Only the repositories and their branches are cached.
+        // A script that only asks for vcs-root or vcs-kind still
+        // looks up the branch, so that the entry also serves
+        // scripts that use vcs-branch.
+        wanted &= PV_GIT | PV_VCS;
+        if (wanted & PV_VCS_ROOT) wanted |= PV_VCS_BRANCH;
+        Git_State git;
+        Cached_VCS vcs;
+        bool found;
+        s64 age;
+        if (repo_cache_load(cwd, &git, &vcs, &found, &age)) {
+            if (found) s->git = ok(git);
+            s->vcs_kind = (VCS_KIND)vcs.kind;
+            s->vcs_root = vcs.root;
+            s->vcs_branch = vcs.branch;
+            probe_now = age >= env_int("SUBLINE_REMOTE_TTL", REMOTE_TTL) ||
+                ((wanted & PV_VCS) && !vcs.known);
+        } else {
+            probe_now = true;
+        }
+    }
+
+    if (probe_now) {
+        auto probe = (Remote_Probe*)calloc(1, sizeof(Remote_Probe));
+        probe->state.cwd = cwd;
+        probe->state.loaded = PV_CWD | PV_FS;
+        probe->state.fs_policy = FSP_PROBE;
+        probe->state.providers = wanted;
+        probe->providers = wanted;
+
+        int timeout = env_int("SUBLINE_REMOTE_TIMEOUT", REMOTE_TIMEOUT_MS);
+        if (run_with_deadline(remote_probe_run, remote_probe_discard, probe, timeout)) {
+            s->git = probe->state.git;
+            s->has_upstream = probe->state.has_upstream;
+            s->upstream = probe->state.upstream;
+            s->vcs_kind = probe->state.vcs_kind;
+            s->vcs_root = probe->state.vcs_root;
+            s->vcs_branch = probe->state.vcs_branch;
+            if (policy == FSP_CACHE) {
+                Cached_VCS vcs = {0};
+                if (wanted & PV_VCS) vcs = {true, s->vcs_kind, s->vcs_root, s->vcs_branch};
+                repo_cache_store(cwd, &s->git, &vcs);
+            }
+            free(probe);
+        } else {
+            // A stale cached repository is still better than none.
+            s->fs_timed_out = true;
+        }
+    }
+
+    s->watch = error("Not watched");
+    s->loaded |= PV_GIT_ALL | (wanted & PV_VCS);
+}
+
+/// The policy git probes follow on the cwd's filesystem, or
+/// "timeout" if they ran out of time. Empty on local filesystems.
+string state_fs_remote(Subline_State* s) {
+    auto policy = state_fs_policy(s);
+    if (policy == FSP_PROBE && !fs_is_remote(s->fs_type)) return {0};
+    if (policy == FSP_DEADLINE || policy == FSP_CACHE) state_git(s);
+    if (s->fs_timed_out) return to_string("timeout");
+    return to_string(FS_POLICY_NAMES[policy]);
+}
+
 #define ESCAPE "\33["
 #define SGR1(arg) printf(ESCAPE "%ldm", (s64)arg)
 
@@ -306,6 +619,34 @@ STYLE_FN(strike_disable, 29, strike, true);
 
 void style_apply(Subline_State* s, Display_Style old_style, Display_Style new_style);
 
+struct Style_Builtin {
+    const char* name;
+    void (*apply)(Subline_State* s);
+};
+
+const Style_Builtin STYLE_BUILTIN[] = {
+    {"bold", bold_enable},
+    {"regular", bold_dim_disable},
+    {"dim", dim_enable},
+    {"italic", italic_enable},
+    {"normal", italic_disable},
+    {"underline", underline_enable},
+    {"no-underline", underline_disable},
+    {"strike", strike_disable},
+    {"no-strike", strike_enable},
+};
+int STYLE_BUILTINS = sizeof(STYLE_BUILTIN) / sizeof(Style_Builtin);
+
+/// Finds the argumentless display function with the given name.
+const Style_Builtin* style_builtin(const string* name) {
+    for (int i=0; i<STYLE_BUILTINS; i++) {
+        if (equal(name, STYLE_BUILTIN[i].name)) {
+            return &STYLE_BUILTIN[i];
+        }
+    }
+    return 0;
+}
+
 void text_apply(Subline_State* s, Color col) {
     if (col.type == CT_SGR) {
         if (col.value == -1) {
@@ -479,73 +820,139 @@ string arg_type_named(
     return unquote(token_text(&to_value(arg)->token));
 }
 
-struct Command_Result {
-    string out;
-    string err;
-    int code;
-};
-
-Command_Result run_command(string* cmd_args, int len) {
-    int offset = 0;
-    int idx = 0;
-    char cmd_text[1024];
-    char* arr[len+1];
+/// The deadline of a stdout() call: its timeout= argument,
+/// in milliseconds, if it has one.
+int command_timeout(Token* fn_name, bag<AST_Node*>* args) {
+    if (named_param_idx(args, "timeout") == -1) return COMMAND_TIMEOUT_MS;
+    auto value = arg_type_named(fn_name, args, "timeout", {AT_NUMBER});
+    char text[value.len+1];
+    fill_charp(value, text);
+    return (int)strtod(text, 0);
+}
 
-    for (int i=0; i<len; i++) {
-        auto arg = cmd_args[i];
-        arr[idx] = cmd_text + offset;
+struct Stdout_Cache {
+    bool enabled;
+    s64 ttl;
+    string watch;
+    string env;
+    bool background;
+};
 
-        for (int i=0; i<arg.len; i++) {
-            cmd_text[offset] = arg.text[i];
-            offset++;
+/// How the result of a stdout() call is cached: its ttl= (in
+/// seconds), watch=, env= and refresh= arguments. Results are
+/// only cached for calls with a ttl, with files to watch, or
+/// refreshed in the background.
+Stdout_Cache stdout_cache(Token* fn_name, bag<AST_Node*>* args) {
+    Stdout_Cache out = {0};
+    if (named_param_idx(args, "ttl") != -1) {
+        auto value = arg_type_named(fn_name, args, "ttl", {AT_NUMBER});
+        char text[value.len+1];
+        fill_charp(value, text);
+        out.ttl = (s64)strtod(text, 0);
+        if (out.ttl < 0) out.ttl = 0;
+    }
+    if (named_param_idx(args, "watch") != -1) {
+        out.watch = arg_type_named(fn_name, args, "watch", {AT_STRING});
+    }
+    if (named_param_idx(args, "env") != -1) {
+        out.env = arg_type_named(fn_name, args, "env", {AT_STRING});
+    }
+    if (named_param_idx(args, "refresh") != -1) {
+        auto value = arg_type_named(fn_name, args, "refresh", {AT_IDENT});
+        if (equal(&value, "background")) {
+            out.background = true;
+        } else if (!equal(&value, "wait")) {
+            FN_ERROR(fn_name, "expects 'refresh' to be wait or background, not " FSTR, FARG(value));
         }
-
-        cmd_text[offset] = 0;
-        offset++;
-        idx++;
     }
-    arr[idx] = 0;
-
-    int pipe_stdout[2];
-    int pipe_stderr[2];
-    assert(pipe(pipe_stdout) == 0, "Failed to create output pipe!");
-    assert(pipe(pipe_stderr) == 0, "Failed to create error pipe!");
+    out.enabled = out.ttl > 0 || out.watch.len > 0 || out.background;
+    return out;
+}
 
-    pid_t pid = fork();
-    assert(pid != -1, "Fork failed! %s", strerror(errno));
+/// The result of a stdout() call whose arguments were evaluated,
+/// if the cache has one to show, without running anything.
+optional<string> stdout_cached(Subline_State* s, Token* fn_name, bag<AST_Node*>* args, string* strs, int count) {
+    auto cache = stdout_cache(fn_name, args);
+    if (!cache.enabled) return error("Not cached");
+    auto opened = command_cache_open(strs, count, *state_cwd(s), cache.env, cache.watch, cache.ttl, cache.background);
+    int code;
+    bool fresh;
+    auto out = command_cache_load(&opened, &code, &fresh);
+    command_cache_free(&opened);
+    if (out.error) return out;
+    return ok(trim(&out.value));
+}
 
-    if (pid == 0) {
-        close(pipe_stdout[0]);
-        close(pipe_stderr[0]);
+/// Starts a stdout() call whose arguments were evaluated.
+Command* stdout_start(Subline_State* s, Token* fn_name, bag<AST_Node*>* args, string* strs, int count) {
+    auto timeout = command_timeout(fn_name, args);
+    auto cache = stdout_cache(fn_name, args);
+    if (!cache.enabled) return command_start(strs, count, timeout);
+    return command_start(strs, count, timeout, command_cache_open(strs, count, *state_cwd(s), cache.env, cache.watch, cache.ttl, cache.background));
+}
 
-        dup2(pipe_stdout[1], STDOUT_FILENO);
-        dup2(pipe_stderr[1], STDERR_FILENO);
+/// Returns a copy of the value of an environment
+/// variable, or an empty string if it is not set.
+string env_value(string name) {
+    char envname[name.len+1];
+    fill_charp(name, envname);
+    auto envvar = getenv(envname);
+    if (envvar == 0) return {0};
+    auto str = to_string(envvar);
+    return copy(&str);
+}
 
-        close(pipe_stdout[1]);
-        close(pipe_stderr[1]);
+/// The current directory, with $HOME shortened to ~.
+string dir_string(Subline_State* s) {
+    auto cwd = state_cwd(s);
+    auto home_charp = getenv("HOME");
+    if (home_charp == 0) return *cwd;
 
-        execvp(arr[0], arr);
-        assert(false, "Failed to run %s: %s", arr[0], strerror(errno));
+    auto home = to_string(home_charp);
+    if (starts(cwd, &home)) {
+        return stringf("~" FSTR, FARG(strip_prefix(cwd, &home)));
     }
 
-    close(pipe_stdout[1]);
-    close(pipe_stderr[1]);
+    return *cwd;
+}
+
+/// The current directory, relative to the git root.
+string git_dir_string(Subline_State* s) {
+    auto git = state_git(s);
+    if (git->error != 0) return {0};
 
-    siginfo_t siginfo;
-    auto wait_res = waitid(P_PID, pid, &siginfo, WEXITED);
-    assert(wait_res >= 0, "waitid() failed: %s", strerror(errno));
+    auto cwd = state_cwd(s);
+    auto gitdir = &git->value.dir;
+    if (equal(cwd, gitdir)) {
+        return const_string("/");
+    } else {
+        return strip_prefix(cwd, gitdir);
+    }
+}
 
-    auto out = read_pipe(pipe_stdout[0]);
-    auto err = read_pipe(pipe_stderr[0]);
+/// Evaluates the positional arguments of a call into out, and
+/// returns how many there were.
+int eval_positional(bag<AST_Node*>* args, string* out) {
+    int count = 0;
+    for (int i=0; i<args->len; i++) {
+        if (args->items[i]->kind == AT_PARAM_NAMED) continue;
+        out[count++] = eval(args->items[i]);
+    }
+    return count;
+}
 
-    return {
-        .out=out,
-        .err=err,
-        .code=WEXITSTATUS(siginfo.si_status),
-    };
+/// The command started early for a stdout() call, or 0.
+Command* prefetch_take(Subline_State* s, Token* call) {
+    for (int i=0; i<s->prefetched.len; i++) {
+        auto p = s->prefetched.items[i];
+        if (p.call != call) continue;
+        bag_remove(&s->prefetched, i);
+        return p.command;
+    }
+    return 0;
 }
 
-string do_call(Subline_State* s, Token* fn_name, bag<AST_Node*>* args) {
+string call_builtin(Subline_State* s, Token* fn_name, bag<AST_Node*>* args) {
     auto fn_name_str = token_text(fn_name);
 
     #define ARG_COUNT(count) assert_arg_count(fn_name, args, count)
@@ -605,117 +1012,121 @@ string do_call(Subline_State* s, Token* fn_name, bag<AST_Node*>* args) {
     } else if (equal(&fn_name_str, "env")) {
         ARG_COUNT(1);
         auto value = ARG_TYPE(0, AT_IDENT, AT_STRING);
-        char envname[255];
-        fill_charp(value, envname);
-        auto envvar = getenv(envname);
-        if (envvar == 0) return {0};
-        auto str = to_string(envvar);
-        return copy(&str);
+        return env_value(value);
 
     } else if (equal(&fn_name_str, "stdout")) {
         ARG_COUNT_MIN(1);
-        string strs[args->len];
-        for (int i=0; i<args->len; i++) {
-            strs[i] = eval(args->items[i]);
+        auto prefetched = prefetch_take(s, fn_name);
+        Command_Result res;
+        if (prefetched != 0) {
+            res = command_finish(prefetched);
+        } else {
+            string strs[args->len];
+            int count = eval_positional(args, strs);
+            if (count == 0) { FN_ERROR(fn_name, "expects a command%s", ""); }
+            res = command_finish(stdout_start(s, fn_name, args, strs, count));
         }
-        auto res = run_command(strs, args->len);
+
+        auto fallback = named_param_find(args, "fallback");
+        if (res.timed_out) return fallback.error ? string{0} : eval(fallback.value->value);
         return trim(&res.out);
 
     } else if (equal(&fn_name_str, "_")) {
         return to_string(" ");
 
-    } else if (equal(&fn_name_str, "bold")) {
+    } else if (style_builtin(&fn_name_str) != 0) {
         ARG_COUNT(0);
-        bold_enable(s);
+        style_builtin(&fn_name_str)->apply(s);
         return {0};
 
-    } else if (equal(&fn_name_str, "regular")) {
+    } else if (equal(&fn_name_str, "dir")) {
         ARG_COUNT(0);
-        bold_dim_disable(s);
-        return {0};
+        return dir_string(s);
 
-    } else if (equal(&fn_name_str, "dim")) {
+    } else if (equal(&fn_name_str, "in-git-repo")) {
         ARG_COUNT(0);
-        dim_enable(s);
-        return {0};
+        if (state_git(s)->error == 0) {
+            return SBLN_TRUE;
+        } else {
+            return SBLN_FALSE;
+        }
 
-    } else if (equal(&fn_name_str, "italic")) {
+    } else if (equal(&fn_name_str, "git-branch")) {
         ARG_COUNT(0);
-        italic_enable(s);
-        return {0};
+        return state_git_branch(s);
 
-    } else if (equal(&fn_name_str, "normal")) {
+    } else if (equal(&fn_name_str, "git-dirty")) {
         ARG_COUNT(0);
-        italic_disable(s);
-        return {0};
+        return state_git_dirty(s) ? SBLN_TRUE : SBLN_FALSE;
 
-    } else if (equal(&fn_name_str, "underline")) {
+    } else if (equal(&fn_name_str, "git-commit")) {
         ARG_COUNT(0);
-        underline_enable(s);
-        return {0};
+        return state_git_commit(s);
 
-    } else if (equal(&fn_name_str, "no-underline")) {
+    } else if (equal(&fn_name_str, "git-subject")) {
         ARG_COUNT(0);
-        underline_disable(s);
-        return {0};
+        return state_git_subject(s);
 
-    } else if (equal(&fn_name_str, "strike")) {
+    } else if (equal(&fn_name_str, "git-tag")) {
         ARG_COUNT(0);
-        strike_disable(s);
-        return {0};
+        return state_git_tag(s);
 
-    } else if (equal(&fn_name_str, "no-strike")) {
+    } else if (equal(&fn_name_str, "git-untracked")) {
         ARG_COUNT(0);
-        strike_enable(s);
-        return {0};
+        return state_git_untracked(s, false) > 0 ? SBLN_TRUE : SBLN_FALSE;
 
-    } else if (equal(&fn_name_str, "dir")) {
+    } else if (equal(&fn_name_str, "git-untracked-count")) {
         ARG_COUNT(0);
-        auto home_charp = getenv("HOME");
-        if (home_charp == 0) return s->cwd;
+        return to_string(state_git_untracked(s, true));
 
-        auto home = to_string(home_charp);
-        if (starts(&s->cwd, &home)) {
-            return stringf("~" FSTR, FARG(strip_prefix(&s->cwd, &home)));
-        }
+    } else if (equal(&fn_name_str, "git-conflicts")) {
+        ARG_COUNT(0);
+        return state_git_conflicts(s);
 
-        return s->cwd;
+    } else if (equal(&fn_name_str, "git-staged")) {
+        ARG_COUNT(0);
+        return state_git_staged(s);
 
-    } else if (equal(&fn_name_str, "in-git-repo")) {
+    } else if (equal(&fn_name_str, "git-state")) {
         ARG_COUNT(0);
-        if (s->git.error == 0) {
-            return SBLN_TRUE;
-        } else {
-            return SBLN_FALSE;
-        }
+        return state_git_operation(s);
 
-    } else if (equal(&fn_name_str, "git-branch")) {
+    } else if (equal(&fn_name_str, "fs-remote")) {
         ARG_COUNT(0);
-        if (s->git.error == 0) {
-            return s->git.value.branch;
-        } else {
-            return {0};
-        }
+        return state_fs_remote(s);
+
+    } else if (equal(&fn_name_str, "vcs-root")) {
+        ARG_COUNT(0);
+        return state_vcs_root(s);
+
+    } else if (equal(&fn_name_str, "vcs-kind")) {
+        ARG_COUNT(0);
+        return state_vcs_kind(s);
+
+    } else if (equal(&fn_name_str, "vcs-branch")) {
+        ARG_COUNT(0);
+        return state_vcs_branch(s);
+
+    } else if (equal(&fn_name_str, "git-ahead")) {
+        ARG_COUNT(0);
+        return upstream_count(s, true);
+
+    } else if (equal(&fn_name_str, "git-behind")) {
+        ARG_COUNT(0);
+        return upstream_count(s, false);
 
     } else if (equal(&fn_name_str, "git-root")) {
         ARG_COUNT(0);
-        if (s->git.error == 0) {
-            return s->git.value.dir;
+        auto git = state_git(s);
+        if (git->error == 0) {
+            return git->value.dir;
         } else {
             return {0};
         }
 
     } else if (equal(&fn_name_str, "git-dir")) {
         ARG_COUNT(0);
-        auto cwd = &s->cwd;
-        if (s->git.error != 0) return {0};
-
-        auto gitdir = &s->git.value.dir;
-        if (equal(cwd, gitdir)) {
-            return const_string("/");
-        } else {
-            return strip_prefix(cwd, gitdir);
-        }
+        return git_dir_string(s);
 
     } else if (equal(&fn_name_str, "not")) {
         ARG_COUNT(1);
@@ -752,6 +1163,39 @@ string do_call(Subline_State* s, Token* fn_name, bag<AST_Node*>* args) {
     exit(0);
 }
 
+/// Shown in place of what was deferred.
+string deferred_placeholder() {
+    auto placeholder = getenv("SUBLINE_PLACEHOLDER");
+    return to_string(placeholder != 0 ? placeholder : "\u2026");
+}
+
+/// Stands in for a slow builtin while deferring. Commands whose
+/// results are in the cache are shown all the same.
+string call_deferred(Subline_State* s, Token* fn_name, bag<AST_Node*>* args) {
+    auto name = token_text(fn_name);
+    if (equal(&name, "stdout") && args != 0) {
+        string strs[args->len];
+        int count = eval_positional(args, strs);
+        if (count > 0) {
+            auto cached = stdout_cached(s, fn_name, args, strs, count);
+            if (cached.error == 0) return cached.value;
+        }
+    }
+    s->deferred++;
+    return deferred_placeholder();
+}
+
+string do_call(Subline_State* s, Token* fn_name, bag<AST_Node*>* args) {
+    if (s->deferring && (builtin_providers(token_text(fn_name)) & PV_SLOW)) {
+        return call_deferred(s, fn_name, args);
+    }
+    if (!profiler.enabled) return call_builtin(s, fn_name, args);
+    profile_enter();
+    auto val = call_builtin(s, fn_name, args);
+    profile_exit(profile_builtin(token_text(fn_name)));
+    return val;
+}
+
 void style_apply(Subline_State* s, Display_Style old_style, Display_Style new_style) {
     if (old_style.bg.type != new_style.bg.type) {
         bg_apply(s, new_style.bg);
@@ -922,7 +1366,7 @@ string replace_escapes(Token* tok) {
     return string{new_text, ni};
 }
 
-string eval(AST_Node* node) {
+string eval_node(AST_Node* node) {
     switch (node->kind) {
     case AT_IDENT: {
         auto val = to_value(node);
@@ -942,12 +1386,7 @@ string eval(AST_Node* node) {
     case AT_ENV: {
         auto val = token_text(&to_value(node)->token);
         val.text++; val.len--;
-        char envname[val.len+1];
-        fill_charp(val, envname);
-        auto envvar = getenv(envname);
-        if (envvar == 0) return {0};
-        auto str = to_string(envvar);
-        return copy(&str);
+        return env_value(val);
     } break;
 
     case AT_CALL: {
@@ -981,7 +1420,10 @@ string eval(AST_Node* node) {
 
     case AT_IF: {
         auto if_stmt = to_if(node);
+        int deferred = state.deferred;
         auto val = eval(if_stmt->condition);
+        // Neither branch is known to be the right one yet.
+        if (state.deferring && state.deferred != deferred) return deferred_placeholder();
         if (equal(&val, &SBLN_TRUE)) {
             auto v = eval(if_stmt->body);
             display(v);
@@ -1001,28 +1443,78 @@ string eval(AST_Node* node) {
     }
 }
 
-int main() {
+string eval(AST_Node* node) {
+    if (!profiler.enabled) return eval_node(node);
+    profile_enter();
+    auto val = eval_node(node);
+    profile_exit(profile_node(node));
+    return val;
+}
+
+/// Tokenizes and parses a script. Tokens keep a pointer
+/// to the tokenizer's text, so the tokenizer must outlive
+/// the returned statements.
+bag<AST_Node*> parse_script(Subline_Tokenizer* st) {
+    auto tokens = st->tokenize();
+    auto sp = Subline_Parser::create(&tokens);
+    bag<AST_Node*> stmts;
+    REQUIRED(stmts, sp.parse());
+    return stmts;
+}
+
+/// Like parse_script, but goes through the on-disk cache of
+/// parsed scripts. Cached statements do not refer to the
+/// tokenizer at all.
+bag<AST_Node*> load_script(Subline_Tokenizer* st) {
+    auto cached = ast_cache_load(&st->text);
+    if (cached.error == 0) return cached.value;
+
+    auto stmts = parse_script(st);
+    ast_cache_store(&st->text, &stmts);
+    return stmts;
+}
+
+/// Starts the stdout() calls that can run before rendering,
+/// all at once, see prefetch.cpp.
+void state_prefetch(Subline_State* s, bag<AST_Node*>* stmts) {
+    bag<AST_Call*> calls = create_bag<AST_Call*>(4);
+    prefetch_calls(stmts, &calls);
+    if (s->prefetched.items == 0) s->prefetched = create_bag<Prefetch>(4);
+
+    for (int i=0; i<calls.len; i++) {
+        auto call = calls.items[i];
+        auto args = &call->params->values;
+        string strs[args->len];
+        int count = eval_positional(args, strs);
+        auto command = stdout_start(s, &call->ident, args, strs, count);
+        bag_add(&s->prefetched, Prefetch{&call->ident, command});
+    }
+    free(calls.items);
+}
+
+/// Evaluates and displays all statements. Providers that
+/// were not already placed in the state are computed lazily.
+void render(bag<AST_Node*>* stmts) {
     state.style = default_style();
-    string subline = read_pipe(stdin);
+    state.providers = script_providers(stmts);
+    state_prefetch(&state, stmts);
+    for (int i=0; i<stmts->len; i++) {
+        auto val = eval(stmts->items[i]);
+        display(val);
+    }
+    // Every prefetched call is evaluated, unless the analysis
+    // and eval disagree.
+    while (state.prefetched.len > 0) command_cancel(bag_pop(&state.prefetched).value.command);
+    reset(&state);
+}
 
-    REQUIRED(state.cwd, cwd_str());
+int render_local(string subline) {
     // string frag = path_frag(copy(&cwd), -1, 0);
     // auto venv = env_var("VIRTUAL_ENV");
     // auto last = env_var("?");
 
-
-    optional<string> git_dir = git_root(copy(&state.cwd));
-    state.git.error = git_dir.error;
-    if (git_dir.error == 0) {
-        state.git.value.dir = git_dir.value;
-        // @TODO: This copy() needs to be freed
-        auto branch = git_branch_name(copy(&git_dir.value));
-        if (branch.error) {
-            state.git.value.branch = {0};
-        } else {
-            state.git.value.branch = branch.value;
-        }
-    }
+    // cwd and git info are only looked up once the script uses them.
+    state.loaded = 0;
 
     auto st = Subline_Tokenizer(subline);
     /*auto st = Subline_Tokenizer(to_string(R"END(
@@ -1054,13 +1546,106 @@ int main() {
         arrow("P>>", text=default, bg=default)
     )END"));*/
 
-    auto tokens = st.tokenize();
-    auto sp = Subline_Parser::create(&tokens);
-    bag<AST_Node*> stmts;
-    REQUIRED(stmts, sp.parse());
-    for (int i=0; i<stmts.len; i++) {
-        auto val = eval(stmts.items[i]);
-        display(val);
+    auto stmts = load_script(&st);
+    render(&stmts);
+    // Freshly parsed tokens point into st, so report before it goes.
+    if (profiler.enabled) profile_report();
+    return 0;
+}
+
+#include "daemon.cpp"
+#include "emit_cpp.cpp"
+#include "bench.cpp"
+#include "async.cpp"
+
+#ifndef SUBLINE_NO_MAIN
+int usage() {
+    warn("Usage: subline [--daemon | --client | --emit-cpp | --bench N | --profile | --async-fd N] [script]\n");
+    warn("       subline --watch-repo [dir]\n");
+    return 1;
+}
+
+int main(int argc, char** argv) {
+    if (argc > 1 && strcmp(argv[1], "--daemon") == 0) {
+        return daemon_main();
     }
-    reset(&state);
+    if (argc > 1 && strcmp(argv[1], "--watch-repo") == 0) {
+        if (argc > 3) {
+            warn("Usage: subline --watch-repo [dir]\n");
+            return 1;
+        }
+        return watch_main(argc == 3 ? argv[2] : 0);
+    }
+
+    bool client = false;
+    bool emit = false;
+    bool profile = false;
+    int bench = 0;
+    int async_fd = -1;
+    const char* script_path = 0;
+    for (int i=1; i<argc; i++) {
+        if (strcmp(argv[i], "--client") == 0) {
+            client = true;
+        } else if (strcmp(argv[i], "--emit-cpp") == 0) {
+            emit = true;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profile = true;
+        } else if (strcmp(argv[i], "--bench") == 0) {
+            char* end = 0;
+            long n = i+1 < argc ? strtol(argv[++i], &end, 10) : 0;
+            if (end == 0 || *end != 0 || n <= 0 || n > INT_MAX) {
+                warn("--bench expects a positive number of iterations\n");
+                return usage();
+            }
+            bench = n;
+        } else if (strcmp(argv[i], "--async-fd") == 0 && i+1 < argc) {
+            async_fd = atoi(argv[++i]);
+            // Commands mustn't inherit it: one that leaves a process
+            // behind would keep the stream open, and could write to it.
+            if (fcntl(async_fd, F_SETFD, FD_CLOEXEC) == -1) {
+                warn("--async-fd expects an open file descriptor\n");
+                return 1;
+            }
+        } else if (script_path == 0) {
+            script_path = argv[i];
+        } else {
+            return usage();
+        }
+    }
+
+    if (profile && (client || emit || bench || async_fd != -1)) {
+        warn("--profile only times a local render, and can't be used with --client, --emit-cpp, --bench or --async-fd\n");
+        return 1;
+    }
+
+    string subline;
+    if (script_path == 0 || strcmp(script_path, "-") == 0) {
+        subline = read_pipe(stdin);
+    } else {
+        auto mapped = map_file(script_path);
+        if (mapped.error) {
+            warn("%s: %s\n", script_path, mapped.error);
+            return 1;
+        }
+        subline = mapped.value;
+    }
+
+    if (emit) {
+        auto st = Subline_Tokenizer(subline);
+        auto stmts = parse_script(&st);
+        emit_cpp(script_path == 0 ? "<stdin>" : script_path, &stmts);
+        return 0;
+    }
+
+    if (bench) return bench_main(bench, subline);
+    if (client && async_fd != -1) {
+        warn("--async-fd renders locally, and can't be used with --client\n");
+        return 1;
+    }
+    if (client) return client_main(subline);
+    if (async_fd != -1) return render_async(subline, async_fd);
+
+    if (profile) profile_enable();
+    return render_local(subline);
 }
+#endif
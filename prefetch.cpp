@@ -0,0 +1,84 @@
+#ifndef subline_prefetch
+#define subline_prefetch
+
+// Starting stdout() commands before rendering, so that they all
+// run at once, and a prompt takes as long as its slowest command
+// rather than all of them together.
+//
+// Only calls whose arguments are literals or environment variables
+// are started early, as nothing the script does before them could
+// change what they run. So are only the calls that are certain to
+// be evaluated: the bodies of ifs are skipped, as the commands in
+// a branch that isn't taken must not run at all.
+
+#include "utils.cpp"
+#include "tokenizer.cpp"
+#include "ast.cpp"
+#include "command.cpp"
+
+struct Prefetch {
+    // The name of the call, which identifies it.
+    Token* call;
+    Command* command;
+};
+
+/// Whether the arguments of a stdout() call are known before
+/// rendering. A fallback is only evaluated later, if at all.
+bool prefetchable(AST_Call* call) {
+    auto args = &call->params->values;
+    int positional = 0;
+    for (int i=0; i<args->len; i++) {
+        auto arg = args->items[i];
+        if (arg->kind == AT_PARAM_NAMED) {
+            auto named = to_param_named(arg);
+            auto name = token_text(&named->name);
+            // Left to fail when the call is evaluated.
+            bool number = equal(&name, "timeout") || equal(&name, "ttl");
+            bool text = equal(&name, "watch") || equal(&name, "env");
+            if (number && named->value->kind != AT_NUMBER) return false;
+            if (text && named->value->kind != AT_STRING) return false;
+            if (equal(&name, "refresh") && named->value->kind != AT_IDENT) return false;
+            continue;
+        }
+        if (arg->kind != AT_STRING && arg->kind != AT_NUMBER && arg->kind != AT_ENV) return false;
+        positional++;
+    }
+    return positional > 0;
+}
+
+void prefetch_calls(bag<AST_Node*>* nodes, bag<AST_Call*>* out);
+
+/// Finds the stdout() calls that can be started before rendering.
+void prefetch_calls(AST_Node* node, bag<AST_Call*>* out) {
+    switch (node->kind) {
+    case AT_CALL: {
+        auto call = to_call(node);
+        auto name = token_text(&call->ident);
+        if (equal(&name, "stdout")) {
+            if (prefetchable(call)) bag_add(out, call);
+            return;
+        }
+        // Named arguments may never be evaluated.
+        auto args = &call->params->values;
+        for (int i=0; i<args->len; i++) {
+            if (args->items[i]->kind != AT_PARAM_NAMED) prefetch_calls(args->items[i], out);
+        }
+    } break;
+
+    case AT_BLOCK: {
+        auto block = to_block(node);
+        if (block->params.error == 0) prefetch_calls(&block->params.value->values, out);
+        prefetch_calls(&block->statements, out);
+    } break;
+
+    case AT_IF: prefetch_calls(to_if(node)->condition, out); break;
+
+    default: break;
+    }
+}
+
+void prefetch_calls(bag<AST_Node*>* nodes, bag<AST_Call*>* out) {
+    for (int i=0; i<nodes->len; i++) prefetch_calls(nodes->items[i], out);
+}
+
+#endif
@@ -0,0 +1,191 @@
+#ifndef subline_profile
+#define subline_profile
+
+// Evaluation profiler, enabled with --profile.
+//
+// eval() and do_call() wrap every node and every builtin in a
+// profile frame. A frame records its wall time, and the time
+// spent in its children, so that every entry gets both an
+// inclusive (total) and an exclusive (self) time. Time spent
+// running commands is tracked separately, so that a slow
+// stdout() is easy to tell apart from a slow git probe. Looking
+// up the repository gets a frame of its own, "git_root", since
+// it's paid for by whichever builtin happens to need it first
+// ("vcs_root" when other kinds of repositories are looked for
+// in the same walk).
+
+#include "utils.cpp"
+#include "tokenizer.cpp"
+#include "ast.cpp"
+
+#include <pthread.h>
+
+struct Profile_Entry {
+    AST_Node* node;
+    string name;
+    int calls;
+    u64 total_ns;
+    u64 self_ns;
+    u64 exec_ns;
+};
+
+struct Profile_Frame {
+    u64 start;
+    u64 children_ns;
+    u64 exec_start;
+};
+
+struct Profiler {
+    bool enabled;
+    pthread_t thread;
+    bag<Profile_Entry> nodes;
+    bag<Profile_Entry> builtins;
+    bag<Profile_Frame> stack;
+    u64 exec_ns;
+};
+
+Profiler profiler;
+
+void profile_enable() {
+    profiler.enabled = true;
+    profiler.thread = pthread_self();
+    profiler.nodes = create_bag<Profile_Entry>(64);
+    profiler.builtins = create_bag<Profile_Entry>(16);
+    profiler.stack = create_bag<Profile_Frame>(16);
+    profiler.exec_ns = 0;
+}
+
+/// Whether to profile here. Git probes may also run on helper
+/// threads, which must keep away from the frame stack.
+bool profiling() {
+    return profiler.enabled && pthread_equal(profiler.thread, pthread_self());
+}
+
+void profile_enter() {
+    Profile_Frame frame;
+    frame.start = now_ns();
+    frame.children_ns = 0;
+    frame.exec_start = profiler.exec_ns;
+    bag_add(&profiler.stack, frame);
+}
+
+void profile_exit(Profile_Entry* entry) {
+    Profile_Frame frame;
+    REQUIRED(frame, bag_pop(&profiler.stack));
+
+    u64 wall = now_ns() - frame.start;
+    entry->calls++;
+    entry->total_ns += wall;
+    entry->self_ns += wall - frame.children_ns;
+    entry->exec_ns += profiler.exec_ns - frame.exec_start;
+
+    if (profiler.stack.len > 0) {
+        profiler.stack.items[profiler.stack.len-1].children_ns += wall;
+    }
+}
+
+Profile_Entry* profile_node(AST_Node* node) {
+    for (int i=0; i<profiler.nodes.len; i++) {
+        if (profiler.nodes.items[i].node == node) return &profiler.nodes.items[i];
+    }
+    Profile_Entry entry = {0};
+    entry.node = node;
+    bag_add(&profiler.nodes, entry);
+    return &profiler.nodes.items[profiler.nodes.len-1];
+}
+
+Profile_Entry* profile_builtin(string name) {
+    for (int i=0; i<profiler.builtins.len; i++) {
+        if (equal(&profiler.builtins.items[i].name, &name)) return &profiler.builtins.items[i];
+    }
+    Profile_Entry entry = {0};
+    entry.name = name;
+    bag_add(&profiler.builtins, entry);
+    return &profiler.builtins.items[profiler.builtins.len-1];
+}
+
+/// The token that best locates a node in the source.
+Token* node_token(AST_Node* node) {
+    switch (node->kind) {
+    case AT_IDENT:
+    case AT_NUMBER:
+    case AT_COLOR:
+    case AT_ENV:
+    case AT_STRING: return &to_value(node)->token;
+    case AT_CALL: return &to_call(node)->ident;
+    case AT_PARAM_NAMED: return &to_param_named(node)->name;
+    case AT_IF: return node_token(to_if(node)->condition);
+    case AT_PARAMS: {
+        auto params = to_params(node);
+        if (params->values.len == 0) return 0;
+        return node_token(params->values.items[0]);
+    }
+    case AT_BLOCK: {
+        auto block = to_block(node);
+        if (block->params.error == 0) {
+            auto tok = node_token(downcast(block->params.value));
+            if (tok != 0) return tok;
+        }
+        if (block->statements.len == 0) return 0;
+        return node_token(block->statements.items[0]);
+    }
+    default: return 0;
+    }
+}
+
+int compare_self_ns(const void* a, const void* b) {
+    auto x = ((const Profile_Entry*)a)->self_ns;
+    auto y = ((const Profile_Entry*)b)->self_ns;
+    return (x < y) - (x > y);
+}
+
+#define PROFILE_ROWS 25
+
+/// Prints both tables, slowest (by self time) first.
+void profile_report() {
+    fflush(stdout);
+    qsort(profiler.builtins.items, profiler.builtins.len, sizeof(Profile_Entry), compare_self_ns);
+    qsort(profiler.nodes.items, profiler.nodes.len, sizeof(Profile_Entry), compare_self_ns);
+
+    warn("\n%-16s %6s %10s %10s %10s   (times in microseconds)\n", "builtin", "calls", "total", "self", "exec");
+    for (int i=0; i<profiler.builtins.len; i++) {
+        auto e = &profiler.builtins.items[i];
+        warn(
+            "%-16.*s %6d %10.1f %10.1f %10.1f\n",
+            FARG(e->name), e->calls,
+            e->total_ns / 1000.0, e->self_ns / 1000.0, e->exec_ns / 1000.0
+        );
+    }
+
+    warn("\n%-10s %-8s %6s %10s %10s %10s   source\n", "line:col", "node", "calls", "total", "self", "exec");
+    for (int i=0; i<profiler.nodes.len && i<PROFILE_ROWS; i++) {
+        auto e = &profiler.nodes.items[i];
+        auto tok = node_token(e->node);
+        auto kind = ast_type_str(e->node->kind);
+
+        if (tok == 0 || tok->source == 0) {
+            warn(
+                "%-10s %-8s %6d %10.1f %10.1f %10.1f\n",
+                "?", kind, e->calls,
+                e->total_ns / 1000.0, e->self_ns / 1000.0, e->exec_ns / 1000.0
+            );
+            continue;
+        }
+
+        auto line = line_at_offset(tok->source, tok->start);
+        line = trim(&line);
+        int col = tok->start - (line_at_offset(tok->source, tok->start).text - tok->source->text) + 1;
+        auto loc = stringf("%d:%d", line_number(tok->source, tok->start), col);
+        warn(
+            "%-10.*s %-8s %6d %10.1f %10.1f %10.1f   %.*s\n",
+            FARG(loc), kind, e->calls,
+            e->total_ns / 1000.0, e->self_ns / 1000.0, e->exec_ns / 1000.0,
+            line.len > 60 ? 60 : line.len, line.text
+        );
+    }
+    if (profiler.nodes.len > PROFILE_ROWS) {
+        warn("(%d more nodes)\n", profiler.nodes.len - PROFILE_ROWS);
+    }
+}
+
+#endif
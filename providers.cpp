@@ -0,0 +1,126 @@
+#ifndef subline_providers
+#define subline_providers
+
+// Static analysis of which pieces of outside state a script
+// can reach. Providers are only ever computed on first use,
+// but knowing up front which ones a script can use lets the
+// daemon, the benchmark and the C++ emitter skip the rest
+// entirely.
+
+#include "utils.cpp"
+#include "tokenizer.cpp"
+#include "ast.cpp"
+
+enum PROVIDER {
+    PV_CWD        = 1 << 0,
+    PV_GIT_ROOT   = 1 << 1,
+    PV_GIT_BRANCH = 1 << 2,
+    PV_ENV        = 1 << 3,
+    PV_COMMAND    = 1 << 4,
+    PV_GIT_DIRTY  = 1 << 5,
+    // Not used by builtins directly: the state published by
+    // a --watch-repo watcher, see state_watch.
+    PV_GIT_WATCH  = 1 << 6,
+    PV_GIT_COMMIT = 1 << 7,
+    PV_GIT_UPSTREAM = 1 << 8,
+    PV_GIT_SUBJECT  = 1 << 9,
+    PV_GIT_TAG      = 1 << 10,
+    PV_GIT_OPERATION = 1 << 11,
+    PV_GIT_UNTRACKED = 1 << 12,
+    PV_GIT_UNTRACKED_COUNT = 1 << 13,
+    PV_GIT_CONFLICTS = 1 << 14,
+    PV_GIT_STAGED    = 1 << 15,
+    // The type of the cwd's filesystem, and the policy that git
+    // probes follow on it, see remote_fs.cpp.
+    PV_FS            = 1 << 16,
+    PV_VCS_ROOT      = 1 << 17,
+    PV_VCS_BRANCH    = 1 << 18,
+};
+
+#define PV_GIT (PV_GIT_ROOT | PV_GIT_BRANCH)
+// Everything read from the repository.
+#define PV_GIT_ALL (PV_GIT | PV_GIT_DIRTY | PV_GIT_WATCH | PV_GIT_COMMIT | \
+    PV_GIT_UPSTREAM | PV_GIT_SUBJECT | PV_GIT_TAG | PV_GIT_OPERATION | \
+    PV_GIT_UNTRACKED | PV_GIT_UNTRACKED_COUNT | PV_GIT_CONFLICTS | PV_GIT_STAGED)
+#define PV_VCS (PV_VCS_ROOT | PV_VCS_BRANCH)
+// Slow enough to be worth rendering later, see async.cpp.
+#define PV_SLOW (PV_COMMAND | PV_GIT_DIRTY | PV_GIT_UPSTREAM | PV_GIT_UNTRACKED | \
+    PV_GIT_UNTRACKED_COUNT | PV_GIT_CONFLICTS | PV_GIT_STAGED)
+
+/// Providers needed by the builtin with the given name.
+u32 builtin_providers(string name) {
+    if (equal(&name, "dir")) return PV_CWD | PV_ENV;
+    if (equal(&name, "git-dir")) return PV_CWD | PV_GIT_ROOT;
+    if (equal(&name, "in-git-repo")) return PV_CWD | PV_GIT_ROOT;
+    if (equal(&name, "git-root")) return PV_CWD | PV_GIT_ROOT;
+    if (equal(&name, "git-branch")) return PV_CWD | PV_GIT_ROOT | PV_GIT_BRANCH;
+    if (equal(&name, "git-dirty")) return PV_CWD | PV_GIT_ROOT | PV_GIT_DIRTY;
+    if (equal(&name, "git-commit")) return PV_CWD | PV_GIT_ROOT | PV_GIT_COMMIT;
+    if (equal(&name, "git-subject")) return PV_CWD | PV_GIT_ROOT | PV_GIT_SUBJECT;
+    if (equal(&name, "git-tag")) return PV_CWD | PV_GIT_ROOT | PV_GIT_TAG;
+    if (equal(&name, "git-untracked")) return PV_CWD | PV_GIT_ROOT | PV_GIT_UNTRACKED;
+    if (equal(&name, "git-untracked-count")) return PV_CWD | PV_GIT_ROOT | PV_GIT_UNTRACKED_COUNT;
+    if (equal(&name, "git-conflicts")) return PV_CWD | PV_GIT_ROOT | PV_GIT_CONFLICTS;
+    if (equal(&name, "git-staged")) return PV_CWD | PV_GIT_ROOT | PV_GIT_STAGED;
+    if (equal(&name, "git-state")) return PV_CWD | PV_GIT_ROOT | PV_GIT_OPERATION;
+    if (equal(&name, "git-ahead")) return PV_CWD | PV_GIT_ROOT | PV_GIT_UPSTREAM;
+    if (equal(&name, "git-behind")) return PV_CWD | PV_GIT_ROOT | PV_GIT_UPSTREAM;
+    if (equal(&name, "vcs-root")) return PV_CWD | PV_VCS_ROOT;
+    if (equal(&name, "vcs-kind")) return PV_CWD | PV_VCS_ROOT;
+    if (equal(&name, "vcs-branch")) return PV_CWD | PV_VCS | PV_GIT;
+    if (equal(&name, "fs-remote")) return PV_CWD | PV_FS | PV_GIT_ROOT;
+    if (equal(&name, "env")) return PV_ENV;
+    if (equal(&name, "stdout")) return PV_COMMAND | PV_ENV;
+    return 0;
+}
+
+u32 node_providers(AST_Node* node);
+
+u32 bag_providers(bag<AST_Node*>* nodes) {
+    u32 out = 0;
+    for (int i=0; i<nodes->len; i++) {
+        out |= node_providers(nodes->items[i]);
+    }
+    return out;
+}
+
+/// Over-approximates: arguments that a builtin never
+/// evaluates (like color names) are still walked.
+u32 node_providers(AST_Node* node) {
+    switch (node->kind) {
+    case AT_IDENT: return builtin_providers(token_text(&to_value(node)->token));
+    case AT_ENV: return PV_ENV;
+    case AT_STRING:
+    case AT_COLOR:
+    case AT_NUMBER: return 0;
+    case AT_PARAM_NAMED: return node_providers(to_param_named(node)->value);
+    case AT_PARAMS: return bag_providers(&to_params(node)->values);
+
+    case AT_CALL: {
+        auto call = to_call(node);
+        return builtin_providers(token_text(&call->ident)) | bag_providers(&call->params->values);
+    }
+
+    case AT_BLOCK: {
+        auto block = to_block(node);
+        u32 out = bag_providers(&block->statements);
+        if (block->params.error == 0) out |= bag_providers(&block->params.value->values);
+        return out;
+    }
+
+    case AT_IF: {
+        auto if_stmt = to_if(node);
+        u32 out = node_providers(if_stmt->condition) | node_providers(if_stmt->body);
+        if (if_stmt->else_body.error == 0) out |= node_providers(if_stmt->else_body.value);
+        return out;
+    }
+
+    default: return 0;
+    }
+}
+
+u32 script_providers(bag<AST_Node*>* stmts) {
+    return bag_providers(stmts);
+}
+
+#endif
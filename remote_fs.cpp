@@ -0,0 +1,377 @@
+#ifndef subline_remote_fs
+#define subline_remote_fs
+
+// Filesystems that answer over the network: NFS, SMB, sshfs and
+// other FUSE mounts, and the like. Any lookup on one can cost a
+// round trip to the server, and blocks for as long as the server
+// is unreachable, so git probes there follow a policy, set per
+// filesystem type in SUBLINE_REMOTE_FS:
+//
+//   probe     as on a local filesystem
+//   deadline  probes run on a helper thread, and the prompt is
+//             rendered without them if they aren't done within
+//             SUBLINE_REMOTE_TIMEOUT milliseconds (the default)
+//   cache     the repository and branch (and those of the nearest
+//             repository of any kind) found last time in the
+//             same directory are used, and are looked up again,
+//             with the deadline, once SUBLINE_REMOTE_TTL seconds
+//             old
+//   skip      no probes at all
+//
+// The type of a filesystem is found in /proc/self/mountinfo, and
+// not with statfs(): statfs() asks the filesystem itself, and
+// hangs with it.
+
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "utils.cpp"
+#include "files.cpp"
+#include "git.cpp"
+
+#define REMOTE_TIMEOUT_MS 150
+#define REMOTE_TTL 60
+
+enum FS_POLICY {
+    FSP_PROBE,
+    FSP_DEADLINE,
+    FSP_CACHE,
+    FSP_SKIP,
+};
+
+const char* FS_POLICY_NAMES[] = {"probe", "deadline", "cache", "skip"};
+auto FS_POLICIES = sizeof(FS_POLICY_NAMES) / sizeof(const char*);
+
+// Types are matched exactly, except for "fuse", which covers
+// every "fuse.<name>" type.
+const char* REMOTE_FS_TYPES[] = {
+    "nfs", "nfs4", "cifs", "smb3", "smbfs", "ncpfs", "9p", "afs",
+    "coda", "ceph", "lustre", "gfs2", "ocfs2", "glusterfs", "fuse",
+};
+
+bool fs_type_matches(string type, const char* name) {
+    if (equal(&type, name)) return true;
+    int len = strlen(name);
+    return strcmp(name, "fuse") == 0 && type.len > len &&
+        memcmp(type.text, name, len) == 0 && type.text[len] == '.';
+}
+
+bool fs_is_remote(string type) {
+    for (auto name : REMOTE_FS_TYPES) {
+        if (fs_type_matches(type, name)) return true;
+    }
+    return false;
+}
+
+/// Decodes the octal escapes (\040 for a space, ...) that
+/// mountinfo uses in paths, in place. Returns the new length.
+int mount_unescape(char* text, int len) {
+    int out = 0;
+    for (int i=0; i<len; i++) {
+        if (text[i] == '\\' && i+3 < len &&
+            text[i+1] >= '0' && text[i+1] <= '3' &&
+            text[i+2] >= '0' && text[i+2] <= '7' &&
+            text[i+3] >= '0' && text[i+3] <= '7') {
+            text[out++] = (text[i+1] - '0') * 64 + (text[i+2] - '0') * 8 + (text[i+3] - '0');
+            i += 3;
+        } else {
+            text[out++] = text[i];
+        }
+    }
+    return out;
+}
+
+/// Type of the filesystem the directory is on, as named in
+/// mountinfo ("ext4", "nfs4", "fuse.sshfs"...): that of the
+/// last mount on the longest mount point containing it.
+optional<string> fs_type(string dir) {
+    // Files in /proc have no size, so it's read like a pipe.
+    int fd = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return error("Failed to read mountinfo");
+    auto mountinfo = read_pipe(fd);
+    close(fd);
+    if (mountinfo.error) return error("Failed to read mountinfo");
+    auto file = mountinfo.value;
+
+    auto text = (char*)file.text;
+    int len = file.len;
+    int best_len = -1;
+    string best = {0};
+
+    int at = 0;
+    while (at < len) {
+        auto eol = (char*)memchr(text + at, '\n', len - at);
+        int end = eol ? eol - text : len;
+        auto line = text + at;
+        int line_len = end - at;
+        at = end + 1;
+
+        // "<id> <parent> <dev> <root> <mount point> <options> [<optional>...] - <type> ..."
+        int field = 0;
+        char* mount = 0;
+        int mount_len = 0;
+        auto p = line;
+        auto line_end = line + line_len;
+        while (p < line_end && field < 4) {
+            if (*p == ' ') field++;
+            p++;
+        }
+        if (field < 4) continue;
+        mount = p;
+        while (p < line_end && *p != ' ') p++;
+        mount_len = mount_unescape(mount, p - mount);
+
+        auto sep = (char*)memmem(p, line_end - p, " - ", 3);
+        if (sep == 0) continue;
+        auto type = sep + 3;
+        auto type_end = (char*)memchr(type, ' ', line_end - type);
+        if (type_end == 0) type_end = line_end;
+
+        while (mount_len > 1 && mount[mount_len-1] == '/') mount_len--;
+        bool contains = mount_len == 1 ? mount[0] == '/' :
+            dir.len >= mount_len && memcmp(dir.text, mount, mount_len) == 0 &&
+            (dir.len == mount_len || dir.text[mount_len] == '/');
+        if (contains && mount_len >= best_len) {
+            best_len = mount_len;
+            best = {type, (int)(type_end - type)};
+        }
+    }
+
+    if (best_len < 0) {
+        free((void*)file.text);
+        return error("No mount point contains the directory");
+    }
+    auto type = copy(&best);
+    free((void*)file.text);
+    return ok(type);
+}
+
+int env_int(const char* name, int fallback) {
+    auto value = getenv(name);
+    if (value == 0 || value[0] == 0) return fallback;
+    char* end;
+    long n = strtol(value, &end, 10);
+    if (*end != 0 || n < 0) return fallback;
+    return n;
+}
+
+/// Policy for a filesystem type, given the value of
+/// SUBLINE_REMOTE_FS: a comma separated list of "<type>=<policy>"
+/// (which also applies to local filesystems) and at most one lone
+/// "<policy>", for the remote filesystems not listed. The default
+/// is "deadline".
+FS_POLICY fs_policy(string type, const char* config) {
+    bool remote = fs_is_remote(type);
+    FS_POLICY fallback = remote ? FSP_DEADLINE : FSP_PROBE;
+    if (config == 0) return fallback;
+
+    auto p = config;
+    while (*p) {
+        auto end = strchr(p, ',');
+        if (end == 0) end = p + strlen(p);
+        string item = {p, (int)(end - p)};
+        item = trim(&item);
+
+        int eq = index_of(&item, '=', 1);
+        auto name = eq >= 0 ? slice(&item, 0, eq) : string{0};
+        auto value = eq >= 0 ? slice(&item, eq + 1, item.len) : item;
+        name = trim(&name);
+        value = trim(&value);
+
+        for (int i=0; i<(int)FS_POLICIES; i++) {
+            if (!equal(&value, FS_POLICY_NAMES[i])) continue;
+            if (eq < 0) {
+                if (remote) fallback = (FS_POLICY)i;
+            } else {
+                auto name_charp = copy(&name);
+                bool match = fs_type_matches(type, name_charp.text);
+                free((void*)name_charp.text);
+                if (match) return (FS_POLICY)i;
+            }
+        }
+
+        p = *end ? end + 1 : end;
+    }
+    return fallback;
+}
+
+struct Deadline_Task {
+    void (*run)(void* arg);
+    // Called by the helper thread instead of the caller when the
+    // caller stopped waiting.
+    void (*discard)(void* arg);
+    void* arg;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool done;
+    bool abandoned;
+};
+
+void* deadline_thread(void* arg) {
+    auto task = (Deadline_Task*)arg;
+    task->run(task->arg);
+
+    pthread_mutex_lock(&task->lock);
+    task->done = true;
+    bool abandoned = task->abandoned;
+    pthread_cond_signal(&task->cond);
+    pthread_mutex_unlock(&task->lock);
+
+    if (abandoned) {
+        task->discard(task->arg);
+        pthread_cond_destroy(&task->cond);
+        pthread_mutex_destroy(&task->lock);
+        free(task);
+    }
+    return 0;
+}
+
+/// Runs a task on a helper thread, and waits for it at most ms
+/// milliseconds. When it takes longer, returns false, and the
+/// thread is left to finish (or to be killed when the process
+/// exits, which works even if it's stuck in an NFS call), and to
+/// discard arg.
+bool run_with_deadline(void (*run)(void*), void (*discard)(void*), void* arg, int ms) {
+    auto task = (Deadline_Task*)calloc(1, sizeof(Deadline_Task));
+    task->run = run;
+    task->discard = discard;
+    task->arg = arg;
+    pthread_mutex_init(&task->lock, 0);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&task->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pthread_t thread;
+    pthread_attr_t thread_attr;
+    pthread_attr_init(&thread_attr);
+    pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_DETACHED);
+    int res = pthread_create(&thread, &thread_attr, deadline_thread, task);
+    pthread_attr_destroy(&thread_attr);
+    if (res != 0) {
+        // Not waiting at all beats waiting without a limit.
+        discard(arg);
+        pthread_cond_destroy(&task->cond);
+        pthread_mutex_destroy(&task->lock);
+        free(task);
+        return false;
+    }
+
+    struct timespec until;
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    until.tv_sec += ms / 1000;
+    until.tv_nsec += (ms % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&task->lock);
+    while (!task->done) {
+        if (pthread_cond_timedwait(&task->cond, &task->lock, &until) == ETIMEDOUT) break;
+    }
+    bool done = task->done;
+    if (!done) task->abandoned = true;
+    pthread_mutex_unlock(&task->lock);
+
+    if (done) {
+        pthread_cond_destroy(&task->cond);
+        pthread_mutex_destroy(&task->lock);
+        free(task);
+    }
+    return done;
+}
+
+// The repository found in a directory of a remote filesystem, for
+// the cache policy: "<hash of the directory>.repo" in the cache
+// directory, holding NUL separated fields.
+#define REPO_CACHE_VERSION "2"
+
+/// The nearest repository of any kind, as recorded in the cache.
+/// Only known if the script that recorded it looked for one.
+struct Cached_VCS {
+    bool known;
+    u32 kind;
+    string root;
+    string branch;
+};
+
+string repo_cache_name(string dir) {
+    return stringf("%016lx.repo", (unsigned long)hash(&dir));
+}
+
+/// The repository recorded for the directory, if there is one,
+/// and how many seconds ago it was recorded. found is false if
+/// the directory was recorded as not being in a repository.
+bool repo_cache_load(string dir, Git_State* git, Cached_VCS* vcs, bool* found, s64* age) {
+    auto cache = cache_dir();
+    if (cache.error) return false;
+    auto name = repo_cache_name(dir);
+    auto path = stringf(FSTR "/" FSTR, FARG(cache.value), FARG(name));
+    free((void*)name.text);
+    free((void*)cache.value.text);
+
+    struct stat st;
+    auto file = stat(path.text, &st) == 0 ? read_file(path.text) : optional<string>(error("No cached repository"));
+    free((void*)path.text);
+    if (file.error) return false;
+
+    // version, directory, found, root, git dir, common dir, branch,
+    // vcs known, vcs kind, vcs root, vcs branch
+    string fields[11];
+    int count = 0;
+    int start = 0;
+    for (int i=0; i<file.value.len && count < 11; i++) {
+        if (file.value.text[i] != 0) continue;
+        fields[count++] = {file.value.text + start, i - start};
+        start = i + 1;
+    }
+    bool valid = count == 11 && equal(&fields[0], REPO_CACHE_VERSION) && equal(&fields[1], &dir);
+    if (!valid) {
+        free((void*)file.value.text);
+        return false;
+    }
+
+    *found = equal(&fields[2], "1");
+    *git = {0};
+    if (*found) {
+        git->dir = copy(&fields[3]);
+        git->git_dir = copy(&fields[4]);
+        git->common_dir = copy(&fields[5]);
+        git->branch = copy(&fields[6]);
+    }
+    *vcs = {0};
+    vcs->known = equal(&fields[7], "1");
+    if (vcs->known) {
+        vcs->kind = atoi(fields[8].text);
+        vcs->root = copy(&fields[9]);
+        vcs->branch = copy(&fields[10]);
+    }
+    *age = time(0) - st.st_mtime;
+    free((void*)file.value.text);
+    return true;
+}
+
+void repo_cache_store(string dir, optional<Git_State>* git, Cached_VCS* vcs) {
+    auto found = git->error == 0;
+    Git_State empty = {0};
+    auto value = found ? &git->value : &empty;
+    auto data = stringf(
+        REPO_CACHE_VERSION "%c" FSTR "%c%d%c" FSTR "%c" FSTR "%c" FSTR "%c" FSTR "%c"
+        "%d%c%u%c" FSTR "%c" FSTR "%c",
+        0, FARG(dir), 0, found ? 1 : 0, 0, FARG(value->dir), 0, FARG(value->git_dir), 0,
+        FARG(value->common_dir), 0, FARG(value->branch), 0,
+        vcs->known ? 1 : 0, 0, vcs->kind, 0, FARG(vcs->root), 0, FARG(vcs->branch), 0);
+    auto name = repo_cache_name(dir);
+    cache_write(name.text, data.text, data.len);
+    free((void*)name.text);
+    free((void*)data.text);
+}
+
+#endif
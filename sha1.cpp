@@ -0,0 +1,90 @@
+#ifndef subline_sha1
+#define subline_sha1
+
+// SHA-1, as used by git to name objects.
+
+#include <string.h>
+
+#include "utils.cpp"
+
+struct SHA1 {
+    u32 h[5];
+    u64 len;
+    u8 block[64];
+    int used;
+};
+
+SHA1 sha1_create() {
+    SHA1 s;
+    s.h[0] = 0x67452301;
+    s.h[1] = 0xEFCDAB89;
+    s.h[2] = 0x98BADCFE;
+    s.h[3] = 0x10325476;
+    s.h[4] = 0xC3D2E1F0;
+    s.len = 0;
+    s.used = 0;
+    return s;
+}
+
+#define ROL32(X, N) (((X) << (N)) | ((X) >> (32-(N))))
+
+void sha1_block(SHA1* s, const u8* block) {
+    u32 w[80];
+    for (int i=0; i<16; i++) {
+        w[i] = (u32)block[i*4] << 24 | (u32)block[i*4+1] << 16 | (u32)block[i*4+2] << 8 | block[i*4+3];
+    }
+    for (int i=16; i<80; i++) {
+        w[i] = ROL32(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+    }
+
+    u32 a = s->h[0], b = s->h[1], c = s->h[2], d = s->h[3], e = s->h[4];
+    for (int i=0; i<80; i++) {
+        u32 f, k;
+        if (i < 20)      { f = (b & c) | (~b & d);          k = 0x5A827999; }
+        else if (i < 40) { f = b ^ c ^ d;                   k = 0x6ED9EBA1; }
+        else if (i < 60) { f = (b & c) | (b & d) | (c & d); k = 0x8F1BBCDC; }
+        else             { f = b ^ c ^ d;                   k = 0xCA62C1D6; }
+        u32 t = ROL32(a, 5) + f + e + k + w[i];
+        e = d; d = c; c = ROL32(b, 30); b = a; a = t;
+    }
+
+    s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d; s->h[4] += e;
+}
+
+void sha1_update(SHA1* s, const void* data, u64 len) {
+    auto bytes = (const u8*)data;
+    s->len += len;
+    while (len > 0) {
+        u64 take = 64 - s->used;
+        if (take > len) take = len;
+        memcpy(s->block + s->used, bytes, take);
+        s->used += take;
+        bytes += take;
+        len -= take;
+        if (s->used == 64) {
+            sha1_block(s, s->block);
+            s->used = 0;
+        }
+    }
+}
+
+void sha1_final(SHA1* s, u8 out[20]) {
+    u64 bits = s->len * 8;
+    u8 pad = 0x80;
+    sha1_update(s, &pad, 1);
+    u8 zero = 0;
+    while (s->used != 56) sha1_update(s, &zero, 1);
+    u8 len_be[8];
+    for (int i=0; i<8; i++) len_be[i] = bits >> (56 - i*8);
+    sha1_update(s, len_be, 8);
+    for (int i=0; i<5; i++) {
+        out[i*4]   = s->h[i] >> 24;
+        out[i*4+1] = s->h[i] >> 16;
+        out[i*4+2] = s->h[i] >> 8;
+        out[i*4+3] = s->h[i];
+    }
+}
+
+#undef ROL32
+
+#endif
@@ -0,0 +1,384 @@
+#ifndef subline_untracked
+#define subline_untracked
+
+// Finding untracked files: files in the worktree that are neither
+// in the index nor ignored, as git status -uall lists them.
+//
+// The worktree is walked with getdents64, by a pool of threads.
+// Each thread keeps its own stack of directories to read, and
+// takes work from the others when it runs out, so a deep
+// directory doesn't leave the rest of the pool idle. Ignored
+// directories are never opened, and neither are directories
+// holding another repository, which count as a single untracked
+// entry, as in git. Every directory is matched against the
+// stretch of the index under it, found by binary search; once a
+// directory has no tracked files, none of its contents need to be
+// looked up. When only the existence of an untracked file is
+// asked for, the walk stops at the first one.
+
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include "utils.cpp"
+#include "git.cpp"
+#include "git_index.cpp"
+#include "gitignore.cpp"
+
+#define UNTRACKED_MAX_THREADS 16
+// The calling thread walks this many directories on its own
+// before starting the pool; most repositories are done by then.
+#define UNTRACKED_THREADED_MIN 64
+#define DENTS_BUFFER 32768
+
+struct Walk_Dir {
+    // Relative to the worktree, with a trailing slash, except
+    // for the root, which is empty. Allocated.
+    string path;
+    Ignore_List* ignores;
+    // Index entries under this directory.
+    u32 lo;
+    u32 hi;
+};
+
+struct Walk_Queue {
+    pthread_mutex_t lock;
+    bag<Walk_Dir> dirs;
+};
+
+struct Untracked_Walk {
+    Git_Index* index;
+    int root_fd;
+    bool count_all;
+
+    Walk_Queue queues[UNTRACKED_MAX_THREADS];
+    int threads;
+    // Directories queued or being read. The walk is over when
+    // this drops to zero.
+    int pending;
+    // Idle workers wait on this until something is pushed, or
+    // the walk is over.
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle;
+    int pushes;
+    int found;
+    int stop;
+
+    // Ignore lists read during the walk, freed at the end.
+    pthread_mutex_t lists_lock;
+    bag<Ignore_List*> lists;
+};
+
+struct Walk_Worker {
+    Untracked_Walk* walk;
+    int id;
+};
+
+/// Compares an index path with the path made of a directory's
+/// path and name.
+int compare_index_path(const char* entry, string* dir, const char* name, int name_len) {
+    int cmp = strncmp(entry, dir->text, dir->len);
+    if (cmp != 0) return cmp;
+    entry += dir->len;
+    for (int i=0; i<name_len; i++) {
+        if (entry[i] != name[i]) return (u8)entry[i] < (u8)name[i] ? -1 : 1;
+    }
+    return entry[name_len] == 0 ? 0 : 1;
+}
+
+/// First entry in [lo, hi) whose path is not before dir/name
+/// (or, when past is set, not before anything under dir/name/).
+u32 index_bound(Git_Index* index, u32 lo, u32 hi, string* dir, const char* name, int name_len, bool past) {
+    while (lo < hi) {
+        u32 mid = lo + (hi - lo) / 2;
+        auto path = index_path(index, &index->entries.items[mid]);
+        int cmp = compare_index_path(path, dir, name, name_len);
+        // Paths under dir/name/ compare as greater than dir/name.
+        if (cmp > 0 && past) {
+            auto rest = path + dir->len;
+            if (strncmp(rest, name, name_len) == 0 && rest[name_len] == '/') cmp = -1;
+        }
+        if (cmp < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+bool index_has(Git_Index* index, u32 lo, u32 hi, string* dir, const char* name, int name_len) {
+    u32 at = index_bound(index, lo, hi, dir, name, name_len, false);
+    return at < hi && compare_index_path(index_path(index, &index->entries.items[at]), dir, name, name_len) == 0;
+}
+
+void walk_push(Untracked_Walk* walk, int queue, Walk_Dir dir) {
+    __atomic_fetch_add(&walk->pending, 1, __ATOMIC_RELAXED);
+    auto q = &walk->queues[queue];
+    pthread_mutex_lock(&q->lock);
+    bag_add(&q->dirs, dir);
+    pthread_mutex_unlock(&q->lock);
+
+    pthread_mutex_lock(&walk->idle_lock);
+    walk->pushes++;
+    pthread_cond_broadcast(&walk->idle);
+    pthread_mutex_unlock(&walk->idle_lock);
+}
+
+void walk_done(Untracked_Walk* walk) {
+    pthread_mutex_lock(&walk->idle_lock);
+    if (__atomic_sub_fetch(&walk->pending, 1, __ATOMIC_RELEASE) == 0) pthread_cond_broadcast(&walk->idle);
+    pthread_mutex_unlock(&walk->idle_lock);
+}
+
+/// Takes a directory from the thread's own queue (the most
+/// recently added one), or from the oldest end of another's.
+bool walk_take(Untracked_Walk* walk, int queue, Walk_Dir* out) {
+    for (int i=0; i<walk->threads; i++) {
+        auto q = &walk->queues[(queue + i) % walk->threads];
+        pthread_mutex_lock(&q->lock);
+        bool taken = q->dirs.len > 0;
+        if (taken && i == 0) {
+            *out = q->dirs.items[--q->dirs.len];
+        } else if (taken) {
+            *out = q->dirs.items[0];
+            memmove(q->dirs.items, q->dirs.items + 1, sizeof(Walk_Dir) * (q->dirs.len - 1));
+            q->dirs.len--;
+        }
+        pthread_mutex_unlock(&q->lock);
+        if (taken) return true;
+    }
+    return false;
+}
+
+void walk_found(Untracked_Walk* walk) {
+    __atomic_fetch_add(&walk->found, 1, __ATOMIC_RELAXED);
+    if (!walk->count_all) __atomic_store_n(&walk->stop, 1, __ATOMIC_RELAXED);
+}
+
+struct Dir_Entry {
+    // Offset of the name in the names buffer.
+    int name;
+    int len;
+    u8 type;
+};
+
+/// Reads one directory, queueing the subdirectories that have to
+/// be walked and counting the untracked files in it.
+void walk_dir(Untracked_Walk* walk, int queue, Walk_Dir* dir) {
+    char path[PATH_MAX];
+    if (dir->path.len == 0) {
+        path[0] = '.';
+        path[1] = 0;
+    } else {
+        fill_charp(dir->path, path);
+    }
+    int fd = openat(walk->root_fd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd == -1) return;
+
+    // Names are collected first, since a .gitignore applies to
+    // every entry of its directory.
+    char buf[DENTS_BUFFER];
+    auto names = create_bag<char>(1024);
+    auto entries = create_bag<Dir_Entry>(64);
+    bool has_gitignore = false;
+    bool has_git = false;
+    while (true) {
+        long n = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+        if (n <= 0) break;
+        for (long off = 0; off < n; ) {
+            auto ent = (struct dirent64*)(buf + off);
+            off += ent->d_reclen;
+            auto name = ent->d_name;
+            if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0))) continue;
+            if (strcmp(name, ".git") == 0) {
+                has_git = true;
+                continue;
+            }
+            if (strcmp(name, ".gitignore") == 0) has_gitignore = true;
+
+            int len = strlen(name);
+            Dir_Entry entry = {names.len, len, ent->d_type};
+            for (int i=0; i<=len; i++) bag_add(&names, name[i]);
+            bag_add(&entries, entry);
+        }
+    }
+
+    // Another repository: untracked as a whole, unless the index
+    // has it as a submodule, which the caller already checked.
+    if (has_git && dir->path.len > 0) {
+        walk_found(walk);
+        entries.len = 0;
+    }
+
+    auto ignores = dir->ignores;
+    if (has_gitignore && entries.len > 0) {
+        int ignore_fd = openat(fd, ".gitignore", O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (ignore_fd != -1 && fstat(ignore_fd, &st) == 0 && S_ISREG(st.st_mode)) {
+            auto text = (char*)malloc(st.st_size + 1);
+            long len = 0;
+            while (len < st.st_size) {
+                auto res = read(ignore_fd, text + len, st.st_size - len);
+                if (res <= 0) break;
+                len += res;
+            }
+            ignores = ignore_list(ignores, dir->path, text, len);
+            free(text);
+            pthread_mutex_lock(&walk->lists_lock);
+            bag_add(&walk->lists, ignores);
+            pthread_mutex_unlock(&walk->lists_lock);
+        }
+        if (ignore_fd != -1) close(ignore_fd);
+    }
+
+    char full[PATH_MAX];
+    fill_charp(dir->path, full);
+    for (int i=0; i<entries.len && !__atomic_load_n(&walk->stop, __ATOMIC_RELAXED); i++) {
+        auto entry = entries.items[i];
+        auto name = names.items + entry.name;
+        if (dir->path.len + entry.len + 1 >= PATH_MAX) continue;
+
+        bool is_dir = entry.type == DT_DIR;
+        if (entry.type == DT_UNKNOWN) {
+            struct stat st;
+            if (fstatat(fd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+            is_dir = S_ISDIR(st.st_mode);
+        }
+
+        // Tracked files, and submodules, are done with.
+        bool tracked = dir->lo < dir->hi && index_has(walk->index, dir->lo, dir->hi, &dir->path, name, entry.len);
+        if (tracked) continue;
+
+        memcpy(full + dir->path.len, name, entry.len);
+        full[dir->path.len + entry.len] = 0;
+        if (ignored(ignores, full, dir->path.len + entry.len, is_dir)) continue;
+
+        if (!is_dir) {
+            walk_found(walk);
+            continue;
+        }
+
+        Walk_Dir sub;
+        sub.path = stringf("%s/", full);
+        sub.ignores = ignores;
+        sub.lo = sub.hi = 0;
+        if (dir->lo < dir->hi) {
+            sub.lo = index_bound(walk->index, dir->lo, dir->hi, &dir->path, name, entry.len, false);
+            sub.hi = index_bound(walk->index, sub.lo, dir->hi, &dir->path, name, entry.len, true);
+        }
+        walk_push(walk, queue, sub);
+    }
+
+    free(names.items);
+    free(entries.items);
+    close(fd);
+}
+
+void* untracked_worker(void* arg) {
+    auto worker = (Walk_Worker*)arg;
+    auto walk = worker->walk;
+    while (__atomic_load_n(&walk->pending, __ATOMIC_ACQUIRE) > 0) {
+        pthread_mutex_lock(&walk->idle_lock);
+        int seen = walk->pushes;
+        pthread_mutex_unlock(&walk->idle_lock);
+
+        Walk_Dir dir;
+        if (!walk_take(walk, worker->id, &dir)) {
+            // Nothing to take, but others are still reading
+            // directories, which may have subdirectories.
+            pthread_mutex_lock(&walk->idle_lock);
+            while (walk->pushes == seen && walk->pending > 0) pthread_cond_wait(&walk->idle, &walk->idle_lock);
+            pthread_mutex_unlock(&walk->idle_lock);
+            continue;
+        }
+        if (!__atomic_load_n(&walk->stop, __ATOMIC_RELAXED)) walk_dir(walk, worker->id, &dir);
+        free((void*)dir.path.text);
+        walk_done(walk);
+    }
+    return 0;
+}
+
+/// Counts the untracked files in the worktree. Unless count_all
+/// is set, the walk stops at the first one, and the count is at
+/// most 1.
+optional<int> git_untracked(Git_State* git, bool count_all) {
+    char path[PATH_MAX];
+    fill_charp(git->dir, path);
+    int root_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd == -1) return error("Failed to open the repository");
+
+    git_path(git->git_dir, "index", path);
+    auto index_opt = git_index_load(path);
+    Git_Index index = {0};
+    if (index_opt.error == 0) index = index_opt.value;
+
+    Untracked_Walk walk = {0};
+    walk.index = &index;
+    walk.root_fd = root_fd;
+    walk.count_all = count_all;
+    walk.lists = create_bag<Ignore_List*>(16);
+    pthread_mutex_init(&walk.lists_lock, 0);
+    pthread_mutex_init(&walk.idle_lock, 0);
+    pthread_cond_init(&walk.idle, 0);
+
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > UNTRACKED_MAX_THREADS) threads = UNTRACKED_MAX_THREADS;
+    if (threads < 1) threads = 1;
+    for (int i=0; i<threads; i++) {
+        pthread_mutex_init(&walk.queues[i].lock, 0);
+        walk.queues[i].dirs = create_bag<Walk_Dir>(64);
+    }
+    walk.threads = 1;
+
+    auto global = git_global_ignores(git);
+    string root = to_string("");
+    walk_push(&walk, 0, {copy(&root), global, 0, (u32)index.entries.len});
+
+    // Small worktrees are walked by the calling thread alone.
+    Walk_Dir dir;
+    for (int i=0; i<UNTRACKED_THREADED_MIN && walk_take(&walk, 0, &dir); i++) {
+        if (!walk.stop) walk_dir(&walk, 0, &dir);
+        free((void*)dir.path.text);
+        walk.pending--;
+    }
+
+    if (walk.pending > 0) {
+        walk.threads = threads;
+        pthread_t pool[UNTRACKED_MAX_THREADS];
+        Walk_Worker workers[UNTRACKED_MAX_THREADS];
+        int started = 0;
+        for (int i=1; i<threads; i++) {
+            workers[i] = {&walk, i};
+            if (pthread_create(&pool[started], 0, untracked_worker, &workers[i]) == 0) started++;
+        }
+        workers[0] = {&walk, 0};
+        untracked_worker(&workers[0]);
+        for (int i=0; i<started; i++) pthread_join(pool[i], 0);
+    }
+
+    for (int i=0; i<threads; i++) {
+        auto q = &walk.queues[i];
+        for (int j=0; j<q->dirs.len; j++) free((void*)q->dirs.items[j].path.text);
+        free(q->dirs.items);
+        pthread_mutex_destroy(&q->lock);
+    }
+    for (int i=0; i<walk.lists.len; i++) ignore_list_free(walk.lists.items[i]);
+    free(walk.lists.items);
+    while (global != 0) {
+        auto parent = global->parent;
+        ignore_list_free(global);
+        global = parent;
+    }
+    pthread_mutex_destroy(&walk.lists_lock);
+    pthread_mutex_destroy(&walk.idle_lock);
+    pthread_cond_destroy(&walk.idle);
+
+    close(root_fd);
+    if (index_opt.error == 0) git_index_free(&index);
+    return ok(walk.found);
+}
+
+#endif
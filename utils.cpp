@@ -4,6 +4,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <time.h>
 
 typedef u_int8_t  u8;
 typedef u_int16_t u16;
@@ -182,6 +183,16 @@ const string line_at_offset(const string* str, int offset) {
     return string{str->text + line_start + 1, len-1};
 }
 
+/// Returns the 1-based number of the line that the
+/// character at the given offset is a part of.
+int line_number(const string* str, int offset) {
+    int line = 1;
+    for (int i=0; i<offset && i<str->len; i++) {
+        if (str->text[i] == '\n') line++;
+    }
+    return line;
+}
+
 /// Allocates memory and copies a string to it.
 /// len+1 bytes are allocated, with the last byte
 /// set to 0. The last byte is NOT considered to
@@ -259,7 +270,17 @@ bool equal(const string* str1, const char* str2) {
     for (int i=0; i<str1->len; i++) {
         if (str1->text[i] != str2[i]) return false;
     }
-    return true;
+    return str2[str1->len] == 0;
+}
+
+/// 64-bit FNV-1a hash of the bytes of a string.
+u64 hash(const string* str) {
+    u64 h = 0xcbf29ce484222325;
+    for (int i=0; i<str->len; i++) {
+        h ^= (u8)str->text[i];
+        h *= 0x100000001b3;
+    }
+    return h;
 }
 
 /// Returns a substring of the original string.
@@ -278,12 +299,12 @@ const string slice(const string* str, int start, int end) {
 const string trim(const string* str) {
     string out = *str;
     char ch;
-    while (ch = out.text[0], ch == ' ' || ch == '\n' || ch == '\t') {
+    while (out.len > 0 && (ch = out.text[0], ch == ' ' || ch == '\n' || ch == '\t')) {
         out.text++;
         out.len--;
     }
 
-    while (ch = out.text[out.len-1], ch == ' ' || ch == '\n' || ch == '\t') {
+    while (out.len > 0 && (ch = out.text[out.len-1], ch == ' ' || ch == '\n' || ch == '\t')) {
         out.len--;
     }
 
@@ -395,6 +416,34 @@ void arena_clear(Arena* a) {
     a->current = 0;
 }
 
+/// Releases the arena's backing memory.
+void arena_free(Arena* a) {
+    free(a->items);
+    a->items = 0;
+    a->capacity = 0;
+    a->current = 0;
+}
+
+/// Big-endian integer readers, for git's file formats.
+u16 be16(const u8* p) {
+    return (u16)(p[0] << 8 | p[1]);
+}
+
+u32 be32(const u8* p) {
+    return (u32)p[0] << 24 | (u32)p[1] << 16 | (u32)p[2] << 8 | p[3];
+}
+
+u64 be64(const u8* p) {
+    return (u64)be32(p) << 32 | be32(p+4);
+}
+
+/// Monotonic clock reading, in nanoseconds.
+u64 now_ns() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
 /// Turns any pointer into a void*.
 template<typename T>
 void* spoof(T* ptr) { return (void*)ptr; }
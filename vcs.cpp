@@ -0,0 +1,276 @@
+#ifndef subline_vcs
+#define subline_vcs
+
+// Mercurial and Jujutsu repositories, read without running hg or
+// jj. They are found by the same walk as git repositories, see
+// vcs_discover.
+//
+// Mercurial keeps the working directory's branch in .hg/branch
+// (none means "default"), and the active bookmark, if any, in
+// .hg/bookmarks.current.
+//
+// Jujutsu keeps its state in protobuf files. The working copy
+// (.jj/working_copy/checkout) names the operation it was last
+// updated at, and its workspace. The operation names a view,
+// which holds the working-copy commit of every workspace and the
+// targets of every bookmark. Commits live in a git repository
+// (named in .jj/repo/store/git_target), so their parents are
+// read as git commits.
+// Formats: https://github.com/jj-vcs/jj/tree/main/lib/src/protos
+
+#include <string.h>
+
+#include "utils.cpp"
+#include "files.cpp"
+#include "git.cpp"
+#include "git_objects.cpp"
+
+/// Active bookmark of a Mercurial working directory, or its
+/// branch if no bookmark is active.
+optional<string> hg_branch(string root) {
+    char path[PATH_MAX];
+    char buf[256];
+    git_path(root, ".hg/bookmarks.current", path);
+    int len = read_small(path, buf, sizeof(buf));
+    if (len > 0) return ok(stringf("%.*s", len, buf));
+
+    git_path(root, ".hg/branch", path);
+    len = read_small(path, buf, sizeof(buf));
+    if (len > 0) return ok(stringf("%.*s", len, buf));
+    return ok(to_string("default"));
+}
+
+enum PROTO_WIRE {
+    PW_VARINT = 0,
+    PW_FIXED64 = 1,
+    PW_BYTES = 2,
+    PW_FIXED32 = 5,
+};
+
+struct Proto_Field {
+    u32 number;
+    PROTO_WIRE wire;
+    u64 varint;
+    // Contents of PW_BYTES fields: strings, bytes and messages.
+    string bytes;
+};
+
+bool proto_varint(const u8** p, const u8* end, u64* out) {
+    u64 value = 0;
+    for (int shift=0; shift < 64 && *p < end; shift += 7) {
+        u8 byte = *(*p)++;
+        value |= (u64)(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *out = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+/// Reads the next field of a message. Returns false at the end
+/// of the message, or if it's malformed.
+bool proto_next(const u8** p, const u8* end, Proto_Field* out) {
+    u64 key;
+    if (*p >= end || !proto_varint(p, end, &key)) return false;
+    out->number = key >> 3;
+    out->wire = (PROTO_WIRE)(key & 7);
+    out->bytes = {0};
+    switch (out->wire) {
+    case PW_VARINT: return proto_varint(p, end, &out->varint);
+    case PW_FIXED64:
+        if (end - *p < 8) return false;
+        *p += 8;
+        return true;
+    case PW_FIXED32:
+        if (end - *p < 4) return false;
+        *p += 4;
+        return true;
+    case PW_BYTES: {
+        u64 len;
+        if (!proto_varint(p, end, &len) || len > (u64)(end - *p)) return false;
+        out->bytes = {(const char*)*p, (int)len};
+        *p += len;
+        return true;
+    }
+    default: return false;
+    }
+}
+
+#define PROTO_EACH(field, message) \
+    for (auto _p = (const u8*)(message).text, _end = _p + (message).len; proto_next(&_p, _end, &(field)); )
+
+string bytes_hex(string bytes) {
+    const char* digits = "0123456789abcdef";
+    auto out = (char*)malloc(bytes.len * 2 + 1);
+    for (int i=0; i<bytes.len; i++) {
+        out[i*2] = digits[(u8)bytes.text[i] >> 4];
+        out[i*2+1] = digits[(u8)bytes.text[i] & 15];
+    }
+    out[bytes.len * 2] = 0;
+    return {out, bytes.len * 2};
+}
+
+/// Reads "<dir>/<hex of id>".
+optional<string> jj_object(string dir, string id) {
+    auto hex = bytes_hex(id);
+    auto path = stringf(FSTR "/" FSTR, FARG(dir), FARG(hex));
+    auto file = read_file(path.text);
+    free((void*)hex.text);
+    free((void*)path.text);
+    return file;
+}
+
+/// The commit a bookmark points to, unless it's conflicted or
+/// deleted.
+bool jj_ref_target(string target, string* out) {
+    Proto_Field field;
+    PROTO_EACH(field, target) {
+        // A plain commit id, as written by older versions.
+        if (field.number == 1 && field.wire == PW_BYTES) {
+            *out = field.bytes;
+            return true;
+        }
+        if (field.number != 3 || field.wire != PW_BYTES) continue;
+
+        // A conflict with no removes and a single add is resolved.
+        int adds = 0;
+        bool removes = false;
+        string commit = {0};
+        Proto_Field term;
+        PROTO_EACH(term, field.bytes) {
+            if (term.number == 1) removes = true;
+            if (term.number != 2 || term.wire != PW_BYTES) continue;
+            adds++;
+            Proto_Field value;
+            PROTO_EACH(value, term.bytes) {
+                if (value.number == 1 && value.wire == PW_BYTES) commit = value.bytes;
+            }
+        }
+        if (removes || adds != 1 || commit.len == 0) return false;
+        *out = commit;
+        return true;
+    }
+    return false;
+}
+
+/// Appends the names of the bookmarks pointing to the commit.
+void jj_bookmarks_at(string view, string commit, bag<char>* out) {
+    Proto_Field field;
+    PROTO_EACH(field, view) {
+        if (field.number != 5 || field.wire != PW_BYTES) continue;
+        string name = {0};
+        string target = {0};
+        Proto_Field bookmark;
+        PROTO_EACH(bookmark, field.bytes) {
+            if (bookmark.wire != PW_BYTES) continue;
+            if (bookmark.number == 1) name = bookmark.bytes;
+            if (bookmark.number == 2 && !jj_ref_target(bookmark.bytes, &target)) target = {0};
+        }
+        if (name.len == 0 || !equal(&target, &commit)) continue;
+        if (out->len > 0) bag_add(out, ' ');
+        for (int i=0; i<name.len; i++) bag_add(out, name.text[i]);
+    }
+}
+
+/// Bookmarks on the working-copy commit of a Jujutsu workspace,
+/// or, if there are none, on its parents.
+optional<string> jj_branch(string root) {
+    auto jj = stringf(FSTR "/.jj", FARG(root));
+    auto checkout_path = stringf(FSTR "/working_copy/checkout", FARG(jj));
+    auto checkout = read_file(checkout_path.text);
+    free((void*)checkout_path.text);
+    if (checkout.error) return error("No working copy");
+
+    string operation_id = {0};
+    string workspace = to_string("default");
+    Proto_Field field;
+    PROTO_EACH(field, checkout.value) {
+        if (field.wire != PW_BYTES) continue;
+        if (field.number == 2) operation_id = field.bytes;
+        if (field.number == 3 && field.bytes.len > 0) workspace = field.bytes;
+    }
+
+    // Other workspaces have a file naming the repository instead.
+    char buf[PATH_MAX];
+    auto repo_link = stringf(FSTR "/repo", FARG(jj));
+    int len = read_small(repo_link.text, buf, sizeof(buf));
+    auto repo = len > 0 ? git_relative(jj, buf, len) : repo_link;
+    if (len > 0) free((void*)repo_link.text);
+
+    auto operations = stringf(FSTR "/op_store/operations", FARG(repo));
+    auto views = stringf(FSTR "/op_store/views", FARG(repo));
+    auto operation = jj_object(operations, operation_id);
+    optional<string> view = error("No operation");
+    if (operation.error == 0) {
+        PROTO_EACH(field, operation.value) {
+            if (field.number == 1 && field.wire == PW_BYTES) view = jj_object(views, field.bytes);
+        }
+    }
+
+    string commit = {0};
+    if (view.error == 0) {
+        PROTO_EACH(field, view.value) {
+            if (field.wire != PW_BYTES) continue;
+            // Written by versions without multiple workspaces.
+            if (field.number == 2 && commit.len == 0) commit = field.bytes;
+            if (field.number != 8) continue;
+            string key = {0};
+            string value = {0};
+            Proto_Field entry;
+            PROTO_EACH(entry, field.bytes) {
+                if (entry.number == 1 && entry.wire == PW_BYTES) key = entry.bytes;
+                if (entry.number == 2 && entry.wire == PW_BYTES) value = entry.bytes;
+            }
+            if (equal(&key, &workspace)) commit = value;
+        }
+    }
+
+    bag<char> names = create_bag<char>(32);
+    if (commit.len > 0) jj_bookmarks_at(view.value, commit, &names);
+
+    // The working-copy commit is usually a new one on top of the
+    // bookmarked commit.
+    if (names.len == 0 && commit.len == sizeof(Git_Oid)) {
+        auto target_path = stringf(FSTR "/store/git_target", FARG(repo));
+        len = read_small(target_path.text, buf, sizeof(buf));
+        free((void*)target_path.text);
+        if (len > 0) {
+            Git_State git = {0};
+            auto store = stringf(FSTR "/store", FARG(repo));
+            git.git_dir = git_relative(store, buf, len);
+            git.common_dir = git.git_dir;
+            free((void*)store.text);
+
+            Git_Oid oid;
+            memcpy(oid.hash, commit.text, sizeof(oid.hash));
+            auto obj = git_read_object(&git, &oid);
+            if (obj.error == 0 && obj.value.type == OBJ_COMMIT) {
+                bag<Git_Oid> parents = create_bag<Git_Oid>(2);
+                commit_parents(&obj.value.data, &parents);
+                for (int i=0; i<parents.len; i++) {
+                    string parent = {(const char*)parents.items[i].hash, sizeof(Git_Oid)};
+                    jj_bookmarks_at(view.value, parent, &names);
+                }
+                free(parents.items);
+            }
+            if (obj.error == 0) git_object_free(&obj.value);
+        }
+    }
+
+    free((void*)jj.text);
+    free((void*)repo.text);
+    free((void*)operations.text);
+    free((void*)views.text);
+    free((void*)checkout.value.text);
+    if (operation.error == 0) free((void*)operation.value.text);
+    if (view.error == 0) free((void*)view.value.text);
+
+    if (names.len == 0) {
+        free(names.items);
+        return error("No bookmarks");
+    }
+    return ok(string{names.items, names.len});
+}
+
+#endif
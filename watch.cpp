@@ -0,0 +1,437 @@
+#ifndef subline_watch
+#define subline_watch
+
+// Repository watcher, started with --watch-repo.
+//
+// The watcher computes the branch and the dirty state of one
+// worktree, publishes them in subline-state in its git directory,
+// and then sleeps on inotify until something that could change
+// them does: HEAD, the index, packed-refs, anything under refs/,
+// or any worktree directory holding tracked files.
+//
+// Prompts read the state file instead of probing the repository.
+// The file is only trusted while the watcher holds its lock, and
+// while HEAD and the index still have the mtimes the watcher saw.
+// The watcher deletes the file as soon as an event arrives, and
+// only writes it again once the state has been recomputed.
+// Meanwhile (and with no watcher, or once the watch limit ran
+// out) prompts compute the state themselves, as they would
+// without a watcher.
+
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/inotify.h>
+
+#include "utils.cpp"
+#include "files.cpp"
+#include "git.cpp"
+#include "git_index.cpp"
+
+#define WATCH_STATE_VERSION 1
+// Events that arrive this close together are handled as one.
+#define WATCH_SETTLE_MS 20
+// But a steady stream of events doesn't postpone an update forever.
+#define WATCH_SETTLE_MAX_MS 250
+// Prompts briefly share the lock to check for a watcher, so a new
+// watcher retries (1ms apart) before giving up on it.
+#define WATCH_LOCK_ATTEMPTS 20
+
+const char WATCH_STATE_MAGIC[8] = {'S','U','B','L','W','C','H',0};
+
+enum WATCH_DIRTY {
+    WD_CLEAN, WD_DIRTY, WD_UNKNOWN,
+};
+
+struct Watch_State_Header {
+    char magic[8];
+    u32 version;
+    s32 pid;
+    Dir_Stamp head_mtime;
+    Dir_Stamp index_mtime;
+    u32 dirty;
+    u32 has_branch;
+    u32 branch_len;
+    u32 pad;
+};
+
+struct Watch_State {
+    bool has_branch;
+    string branch;
+    WATCH_DIRTY dirty;
+};
+
+Dir_Stamp file_stamp(const char* path) {
+    struct stat st;
+    if (stat(path, &st) != 0) return {-1, -1};
+    return {st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+}
+
+bool same_stamp(Dir_Stamp a, Dir_Stamp b) {
+    return a.sec == b.sec && a.nsec == b.nsec;
+}
+
+/// Whether a watcher holds the lock on the repository. Unlike
+/// its pid, the lock can't outlive it.
+bool watcher_alive(Git_State* git) {
+    char path[PATH_MAX];
+    git_path(git->git_dir, "subline-watch.lock", path);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return false;
+    bool held = flock(fd, LOCK_SH | LOCK_NB) != 0 && errno == EWOULDBLOCK;
+    close(fd);
+    return held;
+}
+
+/// Reads the state published by a live watcher of the repository.
+optional<Watch_State> watch_state_load(Git_State* git) {
+    char path[PATH_MAX];
+    git_path(git->git_dir, "subline-state", path);
+
+    auto file = map_file(path);
+    if (file.error) return error(file.error);
+
+    Watch_State_Header h;
+    if ((u64)file.value.len < sizeof(h)) {
+        if (file.value.len > 0) munmap((void*)file.value.text, file.value.len);
+        return error("Invalid watch state");
+    }
+    memcpy(&h, file.value.text, sizeof(h));
+
+    bool valid =
+        memcmp(h.magic, WATCH_STATE_MAGIC, sizeof(WATCH_STATE_MAGIC)) == 0 &&
+        h.version == WATCH_STATE_VERSION &&
+        (u64)file.value.len == sizeof(h) + h.branch_len &&
+        watcher_alive(git);
+
+    if (valid) {
+        git_path(git->git_dir, "HEAD", path);
+        valid = same_stamp(file_stamp(path), h.head_mtime);
+    }
+    if (valid) {
+        git_path(git->git_dir, "index", path);
+        valid = same_stamp(file_stamp(path), h.index_mtime);
+    }
+
+    Watch_State state = {0};
+    if (valid) {
+        state.has_branch = h.has_branch;
+        string branch = {file.value.text + sizeof(h), (int)h.branch_len};
+        state.branch = copy(&branch);
+        state.dirty = (WATCH_DIRTY)h.dirty;
+    }
+
+    munmap((void*)file.value.text, file.value.len);
+    if (!valid) return error("Stale watch state");
+    return ok(state);
+}
+
+/// Computes the state of the repository and publishes it.
+void watch_publish(Git_State* git) {
+    char path[PATH_MAX];
+
+    Watch_State_Header h = {0};
+    memcpy(h.magic, WATCH_STATE_MAGIC, sizeof(WATCH_STATE_MAGIC));
+    h.version = WATCH_STATE_VERSION;
+    h.pid = getpid();
+
+    // Stamps are taken first: if HEAD or the index change while
+    // the state is computed, prompts will not trust it, and the
+    // change will be picked up by the next update.
+    git_path(git->git_dir, "HEAD", path);
+    h.head_mtime = file_stamp(path);
+    git_path(git->git_dir, "index", path);
+    h.index_mtime = file_stamp(path);
+
+    auto branch = git_branch_name(git);
+    h.has_branch = branch.error == 0;
+    h.branch_len = branch.error ? 0 : branch.value.len;
+
+    auto dirty = git_dirty(git);
+    h.dirty = dirty.error ? WD_UNKNOWN : dirty.value ? WD_DIRTY : WD_CLEAN;
+
+    git_path(git->git_dir, "subline-state", path);
+    auto tmp = stringf("%s.%d.tmp", path, getpid());
+    int fd = open(tmp.text, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) return;
+
+    bool complete =
+        write(fd, &h, sizeof(h)) == sizeof(h) &&
+        write(fd, branch.value.text, h.branch_len) == h.branch_len;
+    close(fd);
+
+    if (complete) rename(tmp.text, path);
+    else unlink(tmp.text);
+
+    if (branch.error == 0) free((void*)branch.value.text);
+    free((void*)tmp.text);
+}
+
+void watch_unpublish(Git_State* git) {
+    char path[PATH_MAX];
+    git_path(git->git_dir, "subline-state", path);
+    unlink(path);
+}
+
+#define WATCH_GIT_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF)
+#define WATCH_TREE_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO | IN_CREATE | IN_DELETE | IN_ONLYDIR)
+
+struct Watcher {
+    Git_State git;
+    int fd;
+    // Watch descriptors of the git directory, and of the common
+    // directory (which is the same one outside linked worktrees).
+    int git_wd;
+    int common_wd;
+    // Every watch on git's own directories (the two above, and
+    // refs), where lock files are git's and change nothing.
+    bag<int> git_wds;
+    // Set once inotify_add_watch() fails for lack of watches.
+    bool exhausted;
+};
+
+bool watch_add(Watcher* w, const char* path, u32 mask, int* wd_out) {
+    int wd = inotify_add_watch(w->fd, path, mask);
+    if (wd == -1) {
+        if (errno == ENOSPC || errno == ENOMEM) w->exhausted = true;
+        return false;
+    }
+    if (wd_out) *wd_out = wd;
+    return true;
+}
+
+bool is_git_wd(Watcher* w, int wd) {
+    for (int i=0; i<w->git_wds.len; i++) {
+        if (w->git_wds.items[i] == wd) return true;
+    }
+    return false;
+}
+
+/// Watches one of git's own directories.
+bool watch_add_git(Watcher* w, const char* path, int* wd_out) {
+    int wd;
+    if (!watch_add(w, path, WATCH_GIT_EVENTS | IN_ONLYDIR, &wd)) return false;
+    if (wd_out) *wd_out = wd;
+    if (!is_git_wd(w, wd)) bag_add(&w->git_wds, wd);
+    return true;
+}
+
+void watch_refs(Watcher* w, char* path, int len) {
+    if (w->exhausted) return;
+    if (!watch_add_git(w, path, 0)) return;
+
+    DIR* dir = opendir(path);
+    if (dir == 0) return;
+    while (auto ent = readdir(dir)) {
+        if (ent->d_type != DT_DIR || ent->d_name[0] == '.') continue;
+        int name_len = strlen(ent->d_name);
+        if (len + 1 + name_len >= PATH_MAX) continue;
+        path[len] = '/';
+        memcpy(path + len + 1, ent->d_name, name_len + 1);
+        watch_refs(w, path, len + 1 + name_len);
+        path[len] = 0;
+    }
+    closedir(dir);
+}
+
+/// Watches every directory that holds tracked files, and their
+/// parents. Watching an already watched directory is a no-op,
+/// so this is simply repeated whenever the index changes.
+void watch_worktree(Watcher* w) {
+    char path[PATH_MAX];
+    fill_charp(w->git.dir, path);
+    watch_add(w, path, WATCH_TREE_EVENTS, 0);
+
+    git_path(w->git.git_dir, "index", path);
+    auto index_opt = git_index_load(path);
+    if (index_opt.error) return;
+    auto index = index_opt.value;
+
+    fill_charp(w->git.dir, path);
+    int base = w->git.dir.len + 1;
+    path[w->git.dir.len] = '/';
+    const char* prev = 0;
+    int prev_len = -1;
+
+    for (int i=0; i<index.entries.len && !w->exhausted; i++) {
+        auto entry_path = index_path(&index, &index.entries.items[i]);
+        int len = dirname_len(entry_path);
+        if (len == 0 || (len == prev_len && memcmp(entry_path, prev, len) == 0)) continue;
+        prev = entry_path;
+        prev_len = len;
+        if (base + len >= PATH_MAX) continue;
+
+        // Parents are watched too, since a directory holding
+        // no files of its own can still be removed or renamed.
+        for (int j=1; j<=len && !w->exhausted; j++) {
+            if (j < len && entry_path[j] != '/') continue;
+            memcpy(path + base, entry_path, j);
+            path[base + j] = 0;
+            watch_add(w, path, WATCH_TREE_EVENTS, 0);
+        }
+    }
+
+    git_index_free(&index);
+}
+
+/// Drains pending events. Returns whether the watches need
+/// to be refreshed, and sets *gone if .git disappeared.
+bool watch_drain(Watcher* w, bool* gone) {
+    alignas(inotify_event) char buf[16 * 1024];
+    bool rewatch = false;
+
+    while (true) {
+        auto len = read(w->fd, buf, sizeof(buf));
+        if (len <= 0) break;
+
+        for (char* p = buf; p < buf + len; ) {
+            auto ev = (inotify_event*)p;
+            p += sizeof(inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) rewatch = true;
+            if (ev->wd == w->git_wd) {
+                if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) *gone = true;
+                if (ev->len > 0 && strcmp(ev->name, "index") == 0) rewatch = true;
+            }
+            if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))) rewatch = true;
+        }
+    }
+    return rewatch;
+}
+
+/// Whether an event is one of the watcher's own writes, or
+/// one of git's lock files, which change nothing by themselves.
+/// In the worktree, a .lock file is just another file.
+bool watch_ignored(Watcher* w, inotify_event* ev) {
+    if (ev->len == 0) return false;
+    if (ev->wd == w->git_wd && strncmp(ev->name, "subline-", 8) == 0) return true;
+    if (!is_git_wd(w, ev->wd)) return false;
+    int len = strlen(ev->name);
+    return len > 5 && strcmp(ev->name + len - 5, ".lock") == 0;
+}
+
+/// Waits for events that are not ignored. Returns false if the
+/// watcher should stop.
+bool watch_wait(Watcher* w, bool* rewatch) {
+    alignas(inotify_event) char buf[16 * 1024];
+    pollfd pfd = {w->fd, POLLIN, 0};
+
+    while (true) {
+        if (poll(&pfd, 1, -1) == -1) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+
+        auto len = read(w->fd, buf, sizeof(buf));
+        if (len <= 0) continue;
+
+        bool relevant = false;
+        for (char* p = buf; p < buf + len; ) {
+            auto ev = (inotify_event*)p;
+            p += sizeof(inotify_event) + ev->len;
+
+            if (ev->wd == w->git_wd && (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF))) return false;
+            if (ev->mask & IN_Q_OVERFLOW) *rewatch = true;
+            if (ev->wd == w->git_wd && ev->len > 0 && strcmp(ev->name, "index") == 0) *rewatch = true;
+            if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))) *rewatch = true;
+            if (!watch_ignored(w, ev)) relevant = true;
+        }
+        if (relevant) return true;
+    }
+}
+
+int watch_main(const char* dir) {
+    char real[PATH_MAX];
+    if (realpath(dir == 0 ? "." : dir, real) == 0) {
+        warn("subline: %s: %s\n", dir == 0 ? "." : dir, strerror(errno));
+        return 1;
+    }
+    auto view = to_string(real);
+    auto cwd = copy(&view);
+
+    auto git_opt = git_discover(cwd);
+    if (git_opt.error) {
+        warn("subline: %.*s is not inside of a git repository\n", FARG(cwd));
+        return 1;
+    }
+
+    Watcher w = {0};
+    w.git = git_opt.value;
+
+    char path[PATH_MAX];
+    git_path(w.git.git_dir, "subline-watch.lock", path);
+    int lock = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    bool locked = false;
+    for (int i=0; i<WATCH_LOCK_ATTEMPTS && lock != -1 && !locked; i++) {
+        locked = flock(lock, LOCK_EX | LOCK_NB) == 0;
+        if (!locked) usleep(1000);
+    }
+    if (!locked) {
+        warn("subline: %.*s is already being watched\n", FARG(w.git.dir));
+        return 1;
+    }
+
+    w.fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (w.fd == -1) {
+        warn("subline: inotify is not available: %s\n", strerror(errno));
+        return 1;
+    }
+
+    fill_charp(w.git.git_dir, path);
+    watch_add_git(&w, path, &w.git_wd);
+    fill_charp(w.git.common_dir, path);
+    watch_add_git(&w, path, &w.common_wd);
+    git_path(w.git.common_dir, "refs", path);
+    watch_refs(&w, path, strlen(path));
+    watch_worktree(&w);
+
+    while (true) {
+        if (w.exhausted) {
+            // Without every watch in place, changes could go
+            // unnoticed. Prompts go back to probing themselves.
+            watch_unpublish(&w.git);
+            warn("subline: Ran out of inotify watches, see fs.inotify.max_user_watches\n");
+            return 1;
+        }
+
+        watch_publish(&w.git);
+
+        bool rewatch = false;
+        if (!watch_wait(&w, &rewatch)) break;
+
+        // Whatever happened, the published state may be wrong
+        // until it's been computed again.
+        watch_unpublish(&w.git);
+
+        // Let bursts of events (a checkout, a build) settle.
+        u64 start = now_ns();
+        pollfd pfd = {w.fd, POLLIN, 0};
+        while (now_ns() - start < WATCH_SETTLE_MAX_MS * 1000000ull) {
+            if (poll(&pfd, 1, WATCH_SETTLE_MS) <= 0) break;
+            bool gone = false;
+            if (watch_drain(&w, &gone)) rewatch = true;
+            if (gone) {
+                watch_unpublish(&w.git);
+                return 0;
+            }
+        }
+
+        if (rewatch) {
+            git_path(w.git.common_dir, "refs", path);
+            watch_refs(&w, path, strlen(path));
+            watch_worktree(&w);
+        }
+    }
+
+    watch_unpublish(&w.git);
+    return 0;
+}
+
+#endif